@@ -0,0 +1,185 @@
+#pragma once
+
+#include "Common.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// Audio FIFO with a linear interpolation resampler
+//
+// Used by the output around frame drops and repeats: instead of skipping
+// the audio of a dropped frame or playing silence over a repeated one, the
+// difference is spread over several frame slots by playing the audio
+// slightly faster or slower, so the sound stays continuous. Buffers are
+// preallocated; nothing allocates on the callback thread.
+class AudioStretcher final
+{
+public:
+
+    // Constructor
+
+    AudioStretcher()
+        : frameBytes_(Utility::GetAudioSampleFrameBytes()),
+          buffered_(0), delta_(0), applied_(0), slots_(0), slot_(0)
+    {
+        // Room for a few frames of backlog plus the one being added
+        fifo_.resize(static_cast<std::size_t>(Config::audioFrameCapacity * 4 * frameBytes_));
+        output_.resize(static_cast<std::size_t>(Config::audioFrameCapacity * frameBytes_));
+    }
+
+    // Public methods
+
+    // Input sample frames waiting to be played
+    long CountBuffered() const
+    {
+        return buffered_;
+    }
+
+    // True while an adjustment is being spread over the slots
+    bool IsAdjusting() const
+    {
+        return slot_ < slots_;
+    }
+
+    // Append input samples (excess beyond the capacity is discarded).
+    void Push(const void* data, long sampleFrames)
+    {
+        auto count = (std::min)(sampleFrames, GetCapacity() - buffered_);
+        std::memcpy(
+            fifo_.data() + buffered_ * frameBytes_, data,
+            static_cast<std::size_t>(count * frameBytes_)
+        );
+        buffered_ += count;
+    }
+
+    void PushSilence(long sampleFrames)
+    {
+        auto count = (std::min)(sampleFrames, GetCapacity() - buffered_);
+        std::memset(
+            fifo_.data() + buffered_ * frameBytes_, 0,
+            static_cast<std::size_t>(count * frameBytes_)
+        );
+        buffered_ += count;
+    }
+
+    // Consume the given number of extra input sample frames (fewer when
+    // negative) over the next slots, on top of what's still pending.
+    void Adjust(long sampleFrames, int slots)
+    {
+        delta_ = delta_ - applied_ + sampleFrames;
+        applied_ = 0;
+        slots_ = (std::max)(slots, 1);
+        slot_ = 0;
+    }
+
+    // Produce the audio of a slot. Consumes the slot's length plus its
+    // share of the adjustment, or everything buffered when draining. Any
+    // shortfall is filled with silence.
+    const void* Pull(long sampleFrames, bool drain)
+    {
+        assert(sampleFrames <= Config::audioFrameCapacity);
+
+        long in;
+        if (drain)
+        {
+            in = buffered_;
+            delta_ = applied_ = 0;
+            slots_ = slot_ = 0;
+        }
+        else
+        {
+            auto share = 0L;
+            if (slot_ < slots_)
+            {
+                slot_++;
+                auto target = static_cast<long>(
+                    static_cast<int64_t>(delta_) * slot_ / slots_
+                );
+                share = target - applied_;
+                applied_ = target;
+            }
+            in = (std::max)(sampleFrames + share, 0L);
+        }
+
+        // Input read position of an output sample scales with in/out, so
+        // the slot plays the consumed samples as a continuous stretch.
+        auto available = (std::min)(in, buffered_);
+        for (long i = 0; i < sampleFrames; i++)
+        {
+            auto pos = static_cast<double>(i) * in / sampleFrames;
+            auto i0 = static_cast<long>(pos);
+            auto dst = output_.data() + i * frameBytes_;
+
+            if (i0 >= available)
+            {
+                std::memset(dst, 0, static_cast<std::size_t>(frameBytes_));
+                continue;
+            }
+
+            // The next sample may belong to the following slot.
+            auto i1 = (std::min)(i0 + 1, buffered_ - 1);
+            Interpolate(dst, Sample(i0), Sample(i1), pos - i0);
+        }
+
+        // Remove the consumed samples.
+        auto remaining = buffered_ - available;
+        std::memmove(
+            fifo_.data(), fifo_.data() + available * frameBytes_,
+            static_cast<std::size_t>(remaining * frameBytes_)
+        );
+        buffered_ = remaining;
+
+        return output_.data();
+    }
+
+    void Clear()
+    {
+        buffered_ = 0;
+        delta_ = applied_ = 0;
+        slots_ = slot_ = 0;
+    }
+
+private:
+
+    long frameBytes_;
+    std::vector<uint8_t> fifo_;
+    std::vector<uint8_t> output_;
+    long buffered_;
+    long delta_;   // Extra input sample frames of the adjustment
+    long applied_; // ... consumed so far
+    int slots_;
+    int slot_;
+
+    long GetCapacity() const
+    {
+        return static_cast<long>(fifo_.size()) / frameBytes_;
+    }
+
+    const uint8_t* Sample(long index) const
+    {
+        return fifo_.data() + index * frameBytes_;
+    }
+
+    // Blend two sample frames (all channels) in the configured format.
+    static void Interpolate(uint8_t* dst, const uint8_t* a, const uint8_t* b, double t)
+    {
+        if (Config::audioSampleType == bmdAudioSampleType16bitInteger)
+            Blend<int16_t>(dst, a, b, t);
+        else
+            Blend<int32_t>(dst, a, b, t);
+    }
+
+    template <typename T>
+    static void Blend(uint8_t* dst, const uint8_t* a, const uint8_t* b, double t)
+    {
+        for (auto ch = 0; ch < Config::audioChannels; ch++)
+        {
+            T x, y;
+            std::memcpy(&x, a + ch * sizeof(T), sizeof(T));
+            std::memcpy(&y, b + ch * sizeof(T), sizeof(T));
+            auto v = static_cast<T>(std::lround(x + (static_cast<double>(y) - x) * t));
+            std::memcpy(dst + ch * sizeof(T), &v, sizeof(T));
+        }
+    }
+};
@@ -0,0 +1,792 @@
+#pragma once
+
+#include "Common.h"
+#include "EventLog.h"
+#include "FileSource.h"
+#include "FrameExport.h"
+#include "Receiver.h"
+#include "Recorder.h"
+#include "Sender.h"
+#include "SimulatedDevice.h"
+#include "Timeshift.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Loopback benchmark
+//
+// Runs Receiver -> Sender against simulated devices (one independent
+// pipeline per channel, optionally fanned out to several outputs) for a
+// given time and writes the results as JSON. Counters are sampled after a
+// warm-up period (which includes the initial format change), so the
+// figures only cover the steady state. The input clock can be offset by a
+// number of ppm to exercise the drift compensation, and the input signal
+// can be flipped between two modes at an interval to exercise the format
+// change handling. Optionally every input is recorded to a file at the
+// same time, to see the disk throughput and whether the capture callback
+// is affected by it, and the outputs can play the input out with a delay
+// through a timeshift ring, or play a recorded frame file instead of the
+// input. The inputs can also be exported through shared memory, with a
+// number of reader threads attached, to see what publishing costs as
+// readers come and go. The input frames can be delivered with a random
+// delay (jitter) to see how the latency controller settles on it, traced
+// once a second.
+//
+// A simulated day of drift takes a little over an hour with the speed
+// factor (--mode=NTSC --seconds=86400 --speed=20 --ppm=100); the depth
+// range in the drift figures shows whether the queue stayed bounded.
+//
+// Heap allocations are only counted in a build with COUNT_HEAP_ALLOCATIONS
+// defined (reported as null otherwise), the simulated devices' own apart
+// from the pipeline's.
+//
+// The benchmark only needs the simulated devices, but it is built with
+// the rest of the program, so it only runs where that builds: Windows for
+// now. The frame buffer memory goes through Platform.h, but the DeckLink
+// interfaces still come from the MIDL-generated DeckLinkAPI_h.h (COM), and
+// the recorder, file playout, timeshift ring and export use Win32 file
+// I/O and file mappings directly.
+//
+class Benchmark final
+{
+public:
+
+    struct Options
+    {
+        BMDDisplayMode mode;
+        double seconds; // Measured duration in simulated time
+        double speed;   // Simulated clock speed relative to real time
+        int channels;   // Number of simulated devices running at once
+        int outputs;    // Outputs fed by each input
+        double drift;   // Input clock offset in ppm
+        double flipInterval;    // Seconds between signal mode flips (zero: none)
+        BMDDisplayMode flipMode; // Mode alternating with the main one
+        const char* recordPath;  // File to record to (nullptr: no recording)
+        double timeshift;        // Playout delay in seconds (zero: direct)
+        const char* playPath;    // Frame file the outputs play in a loop (nullptr: the input)
+        int exportReaders;       // Readers of the shared memory export (negative: no export)
+        double jitter;           // Maximum input delivery delay in ms (zero: none)
+    };
+
+    // Heap allocation counter (bumped by the global operator new in a
+    // build with COUNT_HEAP_ALLOCATIONS defined, see DeckLinkTest.cpp)
+    static std::atomic<uint64_t>& AllocationCount()
+    {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+    // ... and the ones made by the simulated devices themselves (frame and
+    // packet objects a driver would keep in pools), counted apart
+    static std::atomic<uint64_t>& DeviceAllocationCount()
+    {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+    static void Run(const Options& options, FILE* stream)
+    {
+        SimulatedDisplayMode::Info mode;
+        if (!SimulatedDisplayMode::Find(options.mode, mode))
+        {
+            std::fprintf(stream, "{ \"error\": \"unsupported mode\" }\n");
+            return;
+        }
+
+        // Cost of a single stage measurement, to put the instrumentation
+        // overhead in relation to the frame time
+        auto timerCost = MeasureTimerCost();
+
+        // Events go to stderr so the JSON output stays clean.
+        auto log = new EventLog(Config::eventLogCapacity, stderr);
+
+        // Independent device and pipeline per channel
+        std::vector<Channel> channels(options.channels);
+        for (auto i = 0; i < options.channels; i++)
+        {
+            auto& ch = channels[i];
+
+            std::vector<SimulatedOutput*> outputs;
+            std::tie(ch.input, outputs) = SimulatedDevice::CreateInputOutputs(
+                options.mode, options.outputs, options.speed
+            );
+
+            ch.input->SetClockOffset(options.drift);
+            ch.input->SetJitter(options.jitter);
+
+            ch.receiver = new Receiver(log, i, Receiver::GetConversionWorkers(options.channels));
+            ch.receiver->StartReceiving(ch.input);
+
+            // Delayed playout goes through a timeshift ring in the page file
+            // (the outputs share it).
+            ch.timeshift = nullptr;
+            auto delay = static_cast<int>(options.timeshift * mode.timeScale / mode.frameDuration);
+            if (delay > 0)
+            {
+                ch.timeshift = new Timeshift();
+                if (!ch.timeshift->Start(
+                        ch.receiver, delay + Config::timeshiftSpareSlots,
+                        Timeshift::GetSlotSize(mode.width, mode.height, Receiver::GetFramePixelFormat()),
+                        nullptr))
+                {
+                    std::fprintf(stderr, "Can't map the timeshift ring; playing out directly\n");
+                    ch.timeshift->Release();
+                    ch.timeshift = nullptr;
+                }
+            }
+
+            for (auto output : outputs)
+            {
+                Output out = {};
+                out.device = output;
+                out.sender = new Sender(log, i);
+                out.trace.reserve(static_cast<size_t>(options.seconds) + 2);
+
+                // File playout: every output reads the file on its own.
+                if (options.playPath != nullptr)
+                {
+                    out.file = new FileSource(true);
+                    if (!out.file->Open(options.playPath))
+                    {
+                        std::fprintf(stderr, "Can't play %s; playing out the input\n", options.playPath);
+                        out.file->Release();
+                        out.file = nullptr;
+                    }
+                }
+
+                if (out.file != nullptr)
+                {
+                    out.sender->StartSending(output, out.file, options.mode);
+                }
+                else if (ch.timeshift != nullptr)
+                {
+                    auto source = new TimeshiftSource(ch.timeshift, delay);
+                    out.sender->StartSending(output, source, options.mode);
+                    source->Release();
+                }
+                else
+                {
+                    out.sender->StartSending(output, ch.receiver, options.mode);
+                }
+                ch.outputs.push_back(out);
+            }
+
+            // Shared memory export, read by threads opening it by name just
+            // like other processes would
+            ch.exporter = nullptr;
+            if (options.exportReaders >= 0)
+            {
+                auto name = "Local\\DeckLinkBenchmark." + std::to_string(i);
+                ch.exporter = new FrameExport();
+                if (ch.exporter->Start(
+                        ch.receiver, name.c_str(), Config::exportSlots,
+                        FrameExport::GetSlotSize(mode.width, mode.height, Receiver::GetFramePixelFormat())))
+                {
+                    for (auto r = 0; r < options.exportReaders; r++)
+                    {
+                        auto reader = new ExportReader();
+                        if (reader->Start(name.c_str()))
+                            ch.readers.push_back(reader);
+                        else
+                            delete reader;
+                    }
+                }
+                else
+                {
+                    std::fprintf(stderr, "Can't export to %s\n", name.c_str());
+                    ch.exporter->Release();
+                    ch.exporter = nullptr;
+                }
+            }
+
+            // Channels after the first one record to numbered files.
+            ch.recorder = nullptr;
+            if (options.recordPath != nullptr)
+            {
+                std::string path = options.recordPath;
+                if (i > 0) path += "." + std::to_string(i);
+                ch.recorder = new Recorder(log, i);
+                if (!ch.recorder->StartRecording(ch.receiver, path.c_str()))
+                {
+                    std::fprintf(stderr, "Can't record to %s\n", path.c_str());
+                    ch.recorder->Release();
+                    ch.recorder = nullptr;
+                }
+            }
+        }
+
+        // Warm up, then measure.
+        Sleep(WarmupSeconds, options.speed);
+        auto allocations = AllocationCount().load(std::memory_order_relaxed);
+        auto deviceAllocations = DeviceAllocationCount().load(std::memory_order_relaxed);
+        for (auto& ch : channels) Sample(ch, true);
+        if (options.jitter > 0) Trace(channels);
+
+        // Measure in steps of a second, alternating the signal mode on the
+        // way (ending on the main one) and tracing the latency controllers
+        // when the input is jittery.
+        auto flips = options.flipInterval > 0 ?
+            static_cast<int>(options.seconds / options.flipInterval) : 0;
+        auto flip = 0;
+        auto second = 0;
+        double elapsed = 0;
+        while (elapsed < options.seconds)
+        {
+            auto next = (std::min)(second + 1.0, options.seconds);
+            auto flipTime = (flip + 1) * options.flipInterval;
+            if (flip < flips && flipTime <= next) next = flipTime;
+            Sleep(next - elapsed, options.speed);
+            elapsed = next;
+
+            if (flip < flips && next == flipTime)
+            {
+                for (auto& ch : channels)
+                    ch.input->SetSignalMode(flip % 2 == 0 ? options.flipMode : options.mode);
+                flip++;
+            }
+
+            if (next == second + 1.0)
+            {
+                second++;
+                if (options.jitter > 0) Trace(channels);
+            }
+        }
+        for (auto& ch : channels) Sample(ch, false);
+        allocations = AllocationCount().load(std::memory_order_relaxed) - allocations;
+        deviceAllocations = DeviceAllocationCount().load(std::memory_order_relaxed) - deviceAllocations;
+
+        for (auto& ch : channels)
+        {
+            if (ch.recorder != nullptr) ch.recorder->StopRecording();
+            for (auto& out : ch.outputs)
+            {
+                out.sender->StopSending();
+                if (out.file != nullptr) out.file->Close();
+            }
+            if (ch.timeshift != nullptr) ch.timeshift->Stop();
+            if (ch.exporter != nullptr) ch.exporter->Stop();
+            for (auto reader : ch.readers) reader->Stop();
+            ch.receiver->StopReceiving();
+        }
+
+        // Report
+        uint64_t captured = 0;
+        for (auto& ch : channels) captured += ch.end.captured - ch.begin.captured;
+
+        std::fprintf(stream, "{\n");
+        std::fprintf(stream, "  \"mode\": \"%s\",\n", mode.name);
+        std::fprintf(stream, "  \"width\": %ld,\n", mode.width);
+        std::fprintf(stream, "  \"height\": %ld,\n", mode.height);
+        std::fprintf(stream, "  \"seconds\": %g,\n", options.seconds);
+        std::fprintf(stream, "  \"speed\": %g,\n", options.speed);
+        std::fprintf(stream, "  \"inputClockOffsetPpm\": %g,\n", options.drift);
+        std::fprintf(stream, "  \"modeFlipInterval\": %g,\n", options.flipInterval);
+        std::fprintf(stream, "  \"timeshiftSeconds\": %g,\n", options.timeshift);
+        std::fprintf(stream, "  \"inputJitterMs\": %g,\n", options.jitter);
+        std::fprintf(stream, "  \"nominalFps\": %.3f,\n",
+            static_cast<double>(mode.timeScale) / mode.frameDuration);
+        std::fprintf(stream, "  \"stageTimerCostNs\": %.2f,\n", timerCost);
+        std::fprintf(stream, "  \"conversionWorkersPerChannel\": %d,\n",
+            Receiver::GetConversionWorkers(options.channels));
+        // Allocations of the pipeline (which should be none in the steady
+        // state), and the simulated devices' own
+#if defined(COUNT_HEAP_ALLOCATIONS)
+        auto perFrame = 1 / static_cast<double>((std::max)(captured, uint64_t(1)));
+        std::fprintf(stream, "  \"heapAllocationsPerFrame\": %.3f,\n", allocations * perFrame);
+        std::fprintf(stream, "  \"deviceHeapAllocationsPerFrame\": %.3f,\n", deviceAllocations * perFrame);
+#else
+        (void)allocations;
+        (void)deviceAllocations;
+        std::fprintf(stream, "  \"heapAllocationsPerFrame\": null,\n");
+        std::fprintf(stream, "  \"deviceHeapAllocationsPerFrame\": null,\n");
+#endif
+        std::fprintf(stream, "  \"channels\": [\n");
+        for (size_t i = 0; i < channels.size(); i++)
+        {
+            Report(options, mode, timerCost, channels[i], stream);
+            std::fprintf(stream, i + 1 < channels.size() ? ",\n" : "\n");
+        }
+        std::fprintf(stream, "  ]\n");
+        std::fprintf(stream, "}\n");
+
+        for (auto& ch : channels)
+        {
+            for (auto& out : ch.outputs)
+            {
+                out.device->Release();
+                out.sender->Release();
+                if (out.file != nullptr) out.file->Release();
+            }
+            if (ch.recorder != nullptr) ch.recorder->Release();
+            if (ch.timeshift != nullptr) ch.timeshift->Release();
+            if (ch.exporter != nullptr) ch.exporter->Release();
+            for (auto reader : ch.readers) delete reader;
+            ch.input->Release();
+            ch.receiver->Release();
+        }
+        log->Release();
+    }
+
+private:
+
+    static constexpr double WarmupSeconds = 1;
+
+    // Input side counters sampled at the beginning/end of the measurement
+    struct Counters
+    {
+        uint64_t captured;
+        uint64_t dropped; // Lost to capture thread stalls
+        uint64_t overflows;
+        Receiver::StageStats receiver;
+        uint64_t poolMisses;
+        CaptureAllocator::Stats capture;
+        Receiver::ModeChangeStats modeChanges;
+        Recorder::Stats recorder;
+        Timeshift::Stats timeshift;
+        FrameExport::Stats exporter;
+        FrameExportReader::Stats readers; // Summed over the readers
+    };
+
+    // Output side counters
+    struct OutputCounters
+    {
+        SimulatedOutput::Stats output;
+        Sender::StageStats sender;
+        Sender::UnderrunStats underruns;
+        FileSource::Stats file;
+    };
+
+    struct Output
+    {
+        SimulatedOutput* device;
+        Sender* sender;
+        FileSource* file; // Null when playing out the input
+        OutputCounters begin;
+        OutputCounters end;
+        std::vector<Sender::ControlStats> trace; // Once a second with input jitter
+    };
+
+    // Reader of an export on a thread of its own, looking at every frame
+    // it gets (one byte per cache line) like an analyzer would
+    class ExportReader final
+    {
+    public:
+
+        ExportReader()
+            : quit_(false), level_(0)
+        {
+        }
+
+        bool Start(const char* name)
+        {
+            if (!reader_.Open(name)) return false;
+            thread_ = std::thread(&ExportReader::ReaderLoop, this);
+            return true;
+        }
+
+        void Stop()
+        {
+            quit_.store(true, std::memory_order_release);
+            thread_.join();
+            reader_.Close();
+        }
+
+        FrameExportReader::Stats GetStats() const
+        {
+            return reader_.GetStats();
+        }
+
+    private:
+
+        FrameExportReader reader_;
+        std::thread thread_;
+        std::atomic<bool> quit_;
+        uint64_t level_; // Result of the last intact frame
+
+        void ReaderLoop()
+        {
+            while (!quit_.load(std::memory_order_acquire))
+            {
+                FrameExportReader::Frame frame;
+                if (!reader_.TryGetFrame(frame))
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    continue;
+                }
+
+                auto size = static_cast<size_t>(frame.rowBytes) * frame.height;
+                uint64_t sum = 0;
+                for (size_t i = 0; i < size; i += 64) sum += frame.pixels[i];
+                if (reader_.IsIntact(frame)) level_ = sum;
+            }
+        }
+    };
+
+    struct Channel
+    {
+        SimulatedInput* input;
+        Receiver* receiver;
+        Recorder* recorder; // Null when not recording
+        Timeshift* timeshift; // Null when playing out directly
+        FrameExport* exporter; // Null when not exporting
+        std::vector<ExportReader*> readers;
+        std::vector<Output> outputs;
+        Counters begin;
+        Counters end;
+    };
+
+    static void Trace(std::vector<Channel>& channels)
+    {
+        for (auto& ch : channels)
+            for (auto& out : ch.outputs)
+                out.trace.push_back(out.sender->GetControlStats());
+    }
+
+    static void Sleep(double seconds, double speed)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds / speed));
+    }
+
+    static void Sample(Channel& ch, bool begin)
+    {
+        auto& c = begin ? ch.begin : ch.end;
+        c.captured = ch.input->CountFrames();
+        c.dropped = ch.input->CountDroppedFrames();
+        c.overflows = ch.receiver->CountOverflowedFrames();
+        c.receiver = ch.receiver->GetStageStats();
+        c.poolMisses = ch.receiver->GetPoolStats().misses;
+        c.capture = ch.receiver->GetCaptureAllocatorStats();
+        c.modeChanges = ch.receiver->GetModeChangeStats();
+        if (ch.recorder != nullptr) c.recorder = ch.recorder->GetStats();
+        if (ch.timeshift != nullptr) c.timeshift = ch.timeshift->GetStats();
+        if (ch.exporter != nullptr) c.exporter = ch.exporter->GetStats();
+        c.readers = FrameExportReader::Stats();
+        for (auto reader : ch.readers)
+        {
+            auto stats = reader->GetStats();
+            c.readers.frames += stats.frames;
+            c.readers.skipped += stats.skipped;
+            c.readers.torn += stats.torn;
+        }
+
+        // The longest capture callback (and publication) is tracked from
+        // here on.
+        if (begin)
+        {
+            ch.receiver->ResetStagePeaks();
+            if (ch.exporter != nullptr) ch.exporter->ResetPeak();
+        }
+
+        for (auto& out : ch.outputs)
+        {
+            auto& oc = begin ? out.begin : out.end;
+            oc.output = out.device->GetStats();
+            oc.sender = out.sender->GetStageStats();
+            oc.underruns = out.sender->GetUnderrunStats();
+            if (out.file != nullptr)
+            {
+                oc.file = out.file->GetStats();
+                if (begin) out.file->ResetMinDepth();
+            }
+        }
+    }
+
+    // Microseconds per frame spent in a stage
+    static double PerFrame(
+        const StageTimer::Stats& begin, const StageTimer::Stats& end, uint64_t frames
+    )
+    {
+        if (frames == 0) return 0;
+        return (end.nanoseconds - begin.nanoseconds) / 1000.0 / frames;
+    }
+
+    // Microseconds per measurement
+    static double PerCall(const StageTimer::Stats& begin, const StageTimer::Stats& end)
+    {
+        return PerFrame(begin, end, end.calls - begin.calls);
+    }
+
+    // Nanoseconds taken by a measurement (reading the time stamp counter
+    // twice and updating the counters)
+    static double MeasureTimerCost()
+    {
+        const int count = 1000000;
+        StageTimer timer;
+        auto begin = std::chrono::steady_clock::now();
+        for (auto i = 0; i < count; i++) timer.AddSince(StageTimer::Now());
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+    }
+
+    static void Report(
+        const Options& options, const SimulatedDisplayMode::Info& mode,
+        double timerCost, const Channel& ch, FILE* stream
+    )
+    {
+        auto frameMs = 1000.0 * mode.frameDuration / mode.timeScale;
+
+        auto& b = ch.begin;
+        auto& e = ch.end;
+        auto captured = e.captured - b.captured;
+        auto frames = static_cast<double>((std::max)(captured, uint64_t(1)));
+
+        std::fprintf(stream, "    {\n");
+        std::fprintf(stream, "      \"inputFps\": %.3f,\n", captured / options.seconds);
+        std::fprintf(stream,
+            "      \"frames\": { \"captured\": %llu, \"dropped\": %llu, \"overflows\": %llu },\n",
+            static_cast<unsigned long long>(captured),
+            static_cast<unsigned long long>(e.dropped - b.dropped),
+            static_cast<unsigned long long>(e.overflows - b.overflows));
+        std::fprintf(stream,
+            "      \"cpuPerFrameUs\": { \"capture\": %.2f, \"conversion\": %.2f },\n",
+            PerFrame(b.receiver.capture, e.receiver.capture, captured),
+            PerFrame(b.receiver.conversion, e.receiver.conversion, captured));
+        std::fprintf(stream, "      \"captureCallbackMaxUs\": %.1f,\n",
+            e.receiver.capture.peakNanoseconds / 1000.0);
+        std::fprintf(stream,
+            "      \"allocationsPerFrame\": { \"poolMisses\": %.3f, \"captureFallbacks\": %.3f },\n",
+            (e.poolMisses - b.poolMisses) / frames,
+            (e.capture.fallbacks - b.capture.fallbacks) / frames);
+
+        // Capture buffers: the share the slab served, and the frames handed
+        // on in place (passthrough)
+        auto bufferAllocations = e.capture.allocations - b.capture.allocations;
+        std::fprintf(stream,
+            "      \"captureBuffers\": { \"slots\": %llu, \"allocations\": %llu, "
+            "\"reusePercent\": %.2f, \"handoffsPerFrame\": %.3f },\n",
+            static_cast<unsigned long long>(e.capture.slotCount),
+            static_cast<unsigned long long>(bufferAllocations),
+            bufferAllocations > 0 ?
+                100.0 * (e.capture.reuses - b.capture.reuses) / bufferAllocations : 0.0,
+            (e.capture.handoffs - b.capture.handoffs) / frames);
+
+        // Input format changes: frames lost around them, and the time the
+        // control thread took to reconfigure the input
+        auto& mb = b.modeChanges;
+        auto& me = e.modeChanges;
+        auto changes = me.count - mb.count;
+        std::fprintf(stream,
+            "      \"modeChanges\": { \"count\": %llu, \"skippedFrames\": %llu, "
+            "\"staleFrames\": %llu, \"switchUs\": %.1f },\n",
+            static_cast<unsigned long long>(changes),
+            static_cast<unsigned long long>(me.skippedFrames - mb.skippedFrames),
+            static_cast<unsigned long long>(me.staleFrames - mb.staleFrames),
+            PerFrame(mb.switching, me.switching, changes));
+
+        // Stage measurements taken per captured frame (on both sides) and
+        // what they cost relative to the frame time
+        auto measurements =
+            (e.receiver.capture.calls - b.receiver.capture.calls) +
+            (e.receiver.conversion.calls - b.receiver.conversion.calls);
+        for (auto& out : ch.outputs)
+        {
+            auto& sb = out.begin.sender;
+            auto& se = out.end.sender;
+            measurements +=
+                (se.completion.calls - sb.completion.calls) + (se.pop.calls - sb.pop.calls) +
+                (se.schedule.calls - sb.schedule.calls) + (se.queueWait.calls - sb.queueWait.calls);
+        }
+        std::fprintf(stream,
+            "      \"instrumentation\": { \"measurementsPerFrame\": %.2f, \"overheadPercent\": %.4f },\n",
+            measurements / frames,
+            timerCost * measurements / frames / (frameMs * 1e6) * 100);
+
+        // Disk throughput in real time, and how long the writer had to wait
+        // for the disk (the longest wait is over the whole run)
+        if (ch.recorder != nullptr)
+        {
+            auto& rb = b.recorder;
+            auto& re = e.recorder;
+            auto written = re.frames - rb.frames;
+            std::fprintf(stream,
+                "      \"recording\": { \"frames\": %llu, \"failures\": %llu, "
+                "\"writeMBps\": %.1f, \"slotWaits\": %llu, \"maxSlotWaitMs\": %.2f },\n",
+                static_cast<unsigned long long>(written),
+                static_cast<unsigned long long>(re.failures - rb.failures),
+                (re.bytes - rb.bytes) / 1e6 / (options.seconds / options.speed),
+                static_cast<unsigned long long>(re.waits - rb.waits),
+                re.wait.peakNanoseconds / 1e6);
+        }
+
+        // Timeshift ring: its (fixed) footprint and the frames it couldn't
+        // store or serve
+        if (ch.timeshift != nullptr)
+        {
+            auto& tb = b.timeshift;
+            auto& te = e.timeshift;
+            std::fprintf(stream,
+                "      \"timeshift\": { \"slots\": %llu, \"mappedMB\": %.1f, \"largePages\": %s, "
+                "\"written\": %llu, \"dropped\": %llu, \"misses\": %llu },\n",
+                static_cast<unsigned long long>(te.slotCount),
+                te.slotCount * static_cast<double>(te.slotSize) / 1e6,
+                te.largePages ? "true" : "false",
+                static_cast<unsigned long long>(te.written - tb.written),
+                static_cast<unsigned long long>(te.dropped - tb.dropped),
+                static_cast<unsigned long long>(te.misses - tb.misses));
+        }
+
+        // Shared memory export: the cost of publishing a frame (which
+        // shouldn't depend on the number of readers: the CPU time of the
+        // writer thread, as the wall time includes the time the readers
+        // held the CPU), and the frames the readers got to see (on
+        // average), passed over or saw torn
+        if (ch.exporter != nullptr)
+        {
+            auto& xb = b.exporter;
+            auto& xe = e.exporter;
+            auto readers = (std::max)(ch.readers.size(), size_t(1));
+            std::fprintf(stream,
+                "      \"export\": { \"readers\": %llu, \"published\": %llu, \"dropped\": %llu, "
+                "\"publishUs\": %.2f, \"publishCpuUs\": %.2f, \"publishMaxUs\": %.1f, "
+                "\"framesPerReader\": %.1f, "
+                "\"skipped\": %llu, \"torn\": %llu },\n",
+                static_cast<unsigned long long>(ch.readers.size()),
+                static_cast<unsigned long long>(xe.published - xb.published),
+                static_cast<unsigned long long>(xe.dropped - xb.dropped),
+                PerCall(xb.copy, xe.copy),
+                (xe.cpuNanoseconds - xb.cpuNanoseconds) / 1000.0 /
+                    (std::max)(xe.copy.calls - xb.copy.calls, uint64_t(1)),
+                xe.copy.peakNanoseconds / 1000.0,
+                static_cast<double>(e.readers.frames - b.readers.frames) / readers,
+                static_cast<unsigned long long>(e.readers.skipped - b.readers.skipped),
+                static_cast<unsigned long long>(e.readers.torn - b.readers.torn));
+        }
+
+        // Frame buffers in use at the peak (independent of the output count
+        // as the outputs share the frames)
+        std::fprintf(stream, "      \"frameBuffersHighWater\": %llu,\n",
+            static_cast<unsigned long long>(ch.receiver->GetPoolStats().highWater));
+
+        std::fprintf(stream, "      \"outputs\": [\n");
+        for (size_t i = 0; i < ch.outputs.size(); i++)
+        {
+            auto& out = ch.outputs[i];
+            auto& ob = out.begin.output;
+            auto& oe = out.end.output;
+            auto completed = oe.completed - ob.completed;
+            auto late = oe.displayedLate - ob.displayedLate;
+            auto latency = out.sender->GetLatencyStats();
+            auto drift = out.sender->GetDriftStats();
+            auto& ub = out.begin.underruns;
+            auto& ue = out.end.underruns;
+            auto switches = out.sender->GetSwitchStats();
+
+            std::fprintf(stream, "        {\n");
+            std::fprintf(stream, "          \"fps\": %.3f,\n",
+                (completed + late) / options.seconds);
+            std::fprintf(stream,
+                "          \"frames\": { \"completed\": %llu, \"late\": %llu, "
+                "\"dropped\": %llu, \"underruns\": %llu },\n",
+                static_cast<unsigned long long>(completed),
+                static_cast<unsigned long long>(late),
+                static_cast<unsigned long long>(oe.dropped - ob.dropped),
+                static_cast<unsigned long long>(oe.underruns - ob.underruns));
+            auto& sb = out.begin.sender;
+            auto& se = out.end.sender;
+            std::fprintf(stream, "          \"cpuPerFrameUs\": %.2f,\n",
+                PerCall(sb.completion, se.completion));
+            std::fprintf(stream,
+                "          \"stageUs\": { \"pop\": %.2f, \"schedule\": %.2f, \"queueWait\": %.1f },\n",
+                PerCall(sb.pop, se.pop), PerCall(sb.schedule, se.schedule),
+                PerCall(sb.queueWait, se.queueWait));
+            std::fprintf(stream,
+                "          \"audio\": { \"sampleFrames\": %llu, \"lipSyncChecks\": %llu, "
+                "\"lipSyncMismatches\": %llu, \"maxLipSyncErrorSamples\": %.3f },\n",
+                static_cast<unsigned long long>(oe.audioSampleFrames - ob.audioSampleFrames),
+                static_cast<unsigned long long>(oe.lipSyncChecks - ob.lipSyncChecks),
+                static_cast<unsigned long long>(oe.lipSyncMismatches - ob.lipSyncMismatches),
+                oe.maxLipSyncError);
+
+            // File playout: disk throughput in real time, and how far the
+            // reads stayed ahead of the output (the minimum over the
+            // measurement; starved retrievals found nothing read ahead)
+            if (out.file != nullptr)
+            {
+                auto& fb = out.begin.file;
+                auto& fe = out.end.file;
+                auto retrievals = fe.retrievals - fb.retrievals;
+                std::fprintf(stream,
+                    "          \"filePlayout\": { \"frames\": %llu, \"failures\": %llu, "
+                    "\"readMBps\": %.1f, \"readMs\": %.2f, \"readAheadAvg\": %.2f, "
+                    "\"readAheadMin\": %llu, \"starved\": %llu },\n",
+                    static_cast<unsigned long long>(fe.frames - fb.frames),
+                    static_cast<unsigned long long>(fe.failures - fb.failures),
+                    (fe.bytes - fb.bytes) / 1e6 / (options.seconds / options.speed),
+                    PerCall(fb.read, fe.read) / 1000,
+                    retrievals > 0 ? static_cast<double>(fe.depthSum - fb.depthSum) / retrievals : 0.0,
+                    static_cast<unsigned long long>(fe.minDepth),
+                    static_cast<unsigned long long>(fe.starved - fb.starved));
+            }
+
+            // Slots the input queue had no frame for (the longest one is
+            // over the whole run)
+            std::fprintf(stream,
+                "          \"inputUnderruns\": { \"count\": %llu, \"repeatedSlots\": %llu, "
+                "\"blankSlots\": %llu, \"totalMs\": %.1f, \"longestMs\": %.1f },\n",
+                static_cast<unsigned long long>(ue.count - ub.count),
+                static_cast<unsigned long long>(ue.repeatedSlots - ub.repeatedSlots),
+                static_cast<unsigned long long>(ue.blankSlots - ub.blankSlots),
+                frameMs * (ue.repeatedSlots - ub.repeatedSlots + ue.blankSlots - ub.blankSlots),
+                frameMs * ue.longestSlots);
+
+            // Output mode switches following the input (whole run)
+            std::fprintf(stream,
+                "          \"modeSwitches\": { \"count\": %llu, \"lastMs\": %.1f, \"maxMs\": %.1f },\n",
+                static_cast<unsigned long long>(switches.count),
+                switches.last * 1000.0 / Config::clockTimeScale,
+                switches.max * 1000.0 / Config::clockTimeScale);
+
+            // Drift figures cover the whole run (the depth range the time
+            // since the estimate locked).
+            std::fprintf(stream,
+                "          \"drift\": { \"locked\": %s, \"estimatedPpm\": %.3f, "
+                "\"drops\": %llu, \"driftDrops\": %llu, \"repeats\": %llu, \"driftRepeats\": %llu, "
+                "\"audioCorrections\": %llu, \"depthMin\": %llu, \"depthMax\": %llu },\n",
+                drift.estimate.locked ? "true" : "false", drift.estimate.ppm,
+                static_cast<unsigned long long>(drift.controller.drops),
+                static_cast<unsigned long long>(drift.controller.driftDrops),
+                static_cast<unsigned long long>(drift.controller.repeats),
+                static_cast<unsigned long long>(drift.controller.driftRepeats),
+                static_cast<unsigned long long>(drift.audioCorrections),
+                static_cast<unsigned long long>(drift.controller.minDepth),
+                static_cast<unsigned long long>(drift.controller.maxDepth));
+
+            // How the latency controller settles on the jittery input:
+            // target and depth at the end of every second of the
+            // measurement, with the drops and repeats made during it
+            if (!out.trace.empty())
+            {
+                std::fprintf(stream,
+                    "          \"latencyTrace\": { \"columns\": "
+                    "[ \"second\", \"target\", \"depth\", \"drops\", \"repeats\" ], \"rows\": [");
+                for (size_t t = 0; t < out.trace.size(); t++)
+                {
+                    auto& row = out.trace[t];
+                    auto& prev = out.trace[t > 0 ? t - 1 : 0];
+                    std::fprintf(stream, "%s[%llu, %d, %llu, %llu, %llu]",
+                        t > 0 ? ", " : " ",
+                        static_cast<unsigned long long>(t), row.target,
+                        static_cast<unsigned long long>(row.depth),
+                        static_cast<unsigned long long>(row.drops - prev.drops),
+                        static_cast<unsigned long long>(row.repeats - prev.repeats));
+                }
+                std::fprintf(stream, " ] },\n");
+            }
+
+            std::fprintf(stream,
+                "          \"latencyUs\": { \"samples\": %llu, \"min\": %lld, \"avg\": %lld, "
+                "\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld }\n",
+                static_cast<unsigned long long>(latency.count),
+                latency.min, latency.avg, latency.p50, latency.p90, latency.p99, latency.max);
+            std::fprintf(stream, i + 1 < ch.outputs.size() ? "        },\n" : "        }\n");
+        }
+        std::fprintf(stream, "      ]\n");
+
+        std::fprintf(stream, "    }");
+    }
+};
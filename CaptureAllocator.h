@@ -0,0 +1,347 @@
+#pragma once
+
+#include "Common.h"
+#include "MemoryBackedFrame.h"
+#include "Platform.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Capture buffer allocator backed by a pre-committed, page-aligned slab
+//
+// The driver gets fixed-size slots carved out of a single allocation
+// (optionally using large pages), so capture buffers are reused instead of
+// being allocated per frame, and the whole slab can be locked in memory.
+// Requests that don't fit in the slab fall back to individual allocations.
+//
+// A captured frame in a slab slot can also be handed on as it is (see
+// WrapFrame): a frame viewing the slot keeps the captured frame, and with
+// it the slot, until its last reference is gone. Every slot has a view of
+// its own, so the handoff doesn't allocate either.
+class CaptureAllocator final : public IDeckLinkMemoryAllocator, public FrameRecycler
+{
+public:
+
+    // Usage statistics
+    struct Stats
+    {
+        uint64_t allocations;  // AllocateBuffer calls
+        uint64_t reuses;       // Allocations served from the slab
+        uint64_t fallbacks;    // Allocations that didn't fit in the slab
+        uint64_t handoffs;     // Captured frames handed on without a copy
+        uint64_t commits;      // Commit calls
+        uint64_t decommits;    // Decommit calls
+        size_t outstanding;    // Buffers currently held by the driver
+        size_t slotSize;       // Size of a slab slot in bytes
+        size_t slotCount;      // Number of slots in the slab
+        bool largePages;       // The slab is backed by large pages
+        bool locked;           // The slab is locked in physical memory
+    };
+
+    // Constructor/destructor
+
+    CaptureAllocator(size_t slotCount, bool useLargePages)
+        : refCount_(1), slab_(nullptr), slabSize_(0),
+          slotCount_(slotCount), useLargePages_(useLargePages), stats_()
+    {
+        freeSlots_.reserve(slotCount);
+        views_.resize(slotCount);
+    }
+
+    ~CaptureAllocator()
+    {
+        assert(stats_.outstanding == 0);
+        FreeSlab();
+    }
+
+    // Public methods
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // A frame showing the pixels of a captured frame in place, or nullptr
+    // when its buffer isn't a slab slot (or has a different layout), in
+    // which case the caller has to copy. The captured frame is kept alive
+    // until the returned frame is released.
+    MemoryBackedFrame* WrapFrame(IDeckLinkVideoInputFrame* videoFrame)
+    {
+        void* bytes;
+        if (FAILED(videoFrame->GetBytes(&bytes))) return nullptr;
+
+        auto width = videoFrame->GetWidth();
+        auto height = videoFrame->GetHeight();
+        auto format = videoFrame->GetPixelFormat();
+        if (videoFrame->GetRowBytes() != Utility::GetRowBytes(format, width)) return nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!IsSlabBuffer(bytes)) return nullptr;
+
+            auto& view = views_[(static_cast<uint8_t*>(bytes) - slab_) / stats_.slotSize];
+            assert(view.source == nullptr);
+
+            // Keep this allocator and the captured frame alive while the
+            // view is out.
+            AddRef();
+            videoFrame->AddRef();
+            view.source = videoFrame;
+            stats_.handoffs++;
+
+            // An idle view has no references, so a single AddRef revives
+            // it (as in FramePool).
+            if (view.frame != nullptr &&
+                view.frame->GetWidth() == width &&
+                view.frame->GetHeight() == height &&
+                view.frame->GetPixelFormat() == format)
+            {
+                view.frame->AddRef();
+                return view.frame;
+            }
+
+            // First use of the slot in this format
+            delete view.frame;
+            view.frame = new MemoryBackedFrame(
+                width, height, format, bytes, this, stats_.slotSize
+            );
+            return view.frame;
+        }
+    }
+
+    // IUnknown implementation
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
+    {
+        if (iid == IID_IUnknown)
+        {
+            *ppv = this;
+            AddRef();
+            return S_OK;
+        }
+
+        if (iid == IID_IDeckLinkMemoryAllocator)
+        {
+            *ppv = (IDeckLinkMemoryAllocator*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // IDeckLinkMemoryAllocator implementation
+
+    HRESULT STDMETHODCALLTYPE AllocateBuffer(unsigned int bufferSize, void** allocatedBuffer) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        stats_.allocations++;
+
+        // Rebuild the slab when the buffer size has grown (e.g. after a
+        // format change) and nothing is borrowed from the old one.
+        if (bufferSize > stats_.slotSize && CountSlabBuffersInUse() == 0)
+        {
+            FreeSlab();
+            AllocateSlab(bufferSize);
+        }
+
+        if (bufferSize <= stats_.slotSize && !freeSlots_.empty())
+        {
+            *allocatedBuffer = freeSlots_.back();
+            freeSlots_.pop_back();
+            stats_.reuses++;
+        }
+        else
+        {
+            *allocatedBuffer = Platform::AllocatePages(bufferSize);
+            if (*allocatedBuffer == nullptr) return E_OUTOFMEMORY;
+            fallbackBuffers_.emplace_back(*allocatedBuffer, bufferSize);
+            stats_.fallbacks++;
+        }
+
+        stats_.outstanding++;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE ReleaseBuffer(void* buffer) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (IsSlabBuffer(buffer))
+        {
+            freeSlots_.push_back(buffer);
+        }
+        else
+        {
+            auto it = std::find_if(
+                fallbackBuffers_.begin(), fallbackBuffers_.end(),
+                [buffer](const std::pair<void*, size_t>& b) { return b.first == buffer; }
+            );
+            assert(it != fallbackBuffers_.end());
+            Platform::FreePages(it->first, it->second);
+            fallbackBuffers_.erase(it);
+        }
+
+        stats_.outstanding--;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE Commit() override
+    {
+        // The slab is committed on the first allocation, when the buffer
+        // size is known.
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.commits++;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE Decommit() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.decommits++;
+        if (CountSlabBuffersInUse() == 0) FreeSlab();
+        return S_OK;
+    }
+
+    // FrameRecycler implementation
+
+    void RecycleFrame(MemoryBackedFrame* frame) override
+    {
+        IDeckLinkVideoInputFrame* source;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            void* bytes;
+            frame->GetBytes(&bytes);
+            auto& view = views_[(static_cast<uint8_t*>(bytes) - slab_) / stats_.slotSize];
+            source = view.source;
+            view.source = nullptr;
+        }
+
+        // Give the captured frame (and so the slot) back outside the lock,
+        // as that comes back here through ReleaseBuffer.
+        source->Release();
+
+        // Drop the reference taken in WrapFrame.
+        Release();
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    uint8_t* slab_;
+    size_t slabSize_;
+    size_t slotCount_;
+    bool useLargePages_;
+    std::vector<void*> freeSlots_;
+    std::vector<std::pair<void*, size_t>> fallbackBuffers_; // With their sizes
+    Stats stats_;
+    mutable std::mutex mutex_;
+
+    // View of a slab slot, and the captured frame it's holding on to
+    // (nullptr while the view is idle)
+    struct View
+    {
+        MemoryBackedFrame* frame;
+        IDeckLinkVideoInputFrame* source;
+
+        View()
+            : frame(nullptr), source(nullptr)
+        {
+        }
+    };
+
+    std::vector<View> views_;
+
+    // Slab management (needs the lock)
+
+    bool IsSlabBuffer(void* buffer) const
+    {
+        auto p = static_cast<uint8_t*>(buffer);
+        return slab_ != nullptr && p >= slab_ && p < slab_ + slabSize_;
+    }
+
+    size_t CountSlabBuffersInUse() const
+    {
+        return slab_ == nullptr ? 0 : stats_.slotCount - freeSlots_.size();
+    }
+
+    void AllocateSlab(size_t bufferSize)
+    {
+        // Round the slot size up to a page so every slot is page-aligned.
+        auto page = Platform::GetPageSize();
+        auto slotSize = (bufferSize + page - 1) / page * page;
+
+        // Try large pages first if requested. This needs the "Lock pages in
+        // memory" privilege, so failing here is not an error.
+        auto largePage = useLargePages_ ? Platform::GetLargePageSize() : 0;
+        if (largePage > 0)
+        {
+            auto size = (slotSize * slotCount_ + largePage - 1) / largePage * largePage;
+            slab_ = static_cast<uint8_t*>(Platform::AllocatePages(size, true));
+            if (slab_ != nullptr) slabSize_ = size;
+        }
+
+        stats_.largePages = slab_ != nullptr;
+
+        if (slab_ == nullptr)
+        {
+            slabSize_ = slotSize * slotCount_;
+            slab_ = static_cast<uint8_t*>(Platform::AllocatePages(slabSize_));
+            if (slab_ == nullptr)
+            {
+                slabSize_ = 0;
+                return;
+            }
+        }
+
+        // Pin the slab (large pages are never paged out anyway). This can
+        // fail when the working set is too small; the slab is still usable.
+        stats_.locked = stats_.largePages || Platform::LockPages(slab_, slabSize_);
+
+        stats_.slotSize = slotSize;
+        stats_.slotCount = slotCount_;
+
+        for (auto i = slotCount_; i > 0; i--)
+            freeSlots_.push_back(slab_ + slotSize * (i - 1));
+    }
+
+    void FreeSlab()
+    {
+        if (slab_ == nullptr) return;
+
+        // The views are all idle when no slot is in use.
+        for (auto& view : views_)
+        {
+            assert(view.source == nullptr);
+            delete view.frame;
+            view.frame = nullptr;
+        }
+
+        if (stats_.locked && !stats_.largePages) Platform::UnlockPages(slab_, slabSize_);
+        Platform::FreePages(slab_, slabSize_);
+
+        slab_ = nullptr;
+        slabSize_ = 0;
+        freeSlots_.clear();
+        stats_.slotSize = 0;
+        stats_.slotCount = 0;
+        stats_.largePages = false;
+        stats_.locked = false;
+    }
+};
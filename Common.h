@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cinttypes>
 #include <tuple>
+#include <vector>
 
 // Assert function for COM operations
 void AssertSuccess(HRESULT result)
@@ -15,8 +16,36 @@ void AssertSuccess(HRESULT result)
 class Config
 {
 public:
-    static const BMDTimeScale TimeScale = 60000;
-    static const int preroll = 3;
+    static const BMDDisplayMode outputMode = bmdModeHD1080i5994;
+    static const bool followInputMode = true; // Switch the output to the detected input mode
+    static const int minLatency = 3;     // Output latency range in frames
+    static const int maxLatency = 8;
+    static const int latencyWindow = 60; // Completions observed per decision
+    static const int queueCapacity = 16;
+    static const int framePoolReserve = 8; // Frames preallocated for a new input mode
+    static const int maxOutputs = 8;     // Outputs a receiver can feed
+    static const int conversionWorkers = 0; // Per receiver (zero: hardware threads shared out among the receivers)
+    static const bool passthrough = false;  // Skip the ARGB conversion
+    static const int captureBufferCount = 16; // Capture slab slots (with passthrough, held until played out)
+    static const bool useLargePages = false;
+    static const BMDTimeScale clockTimeScale = 1000000; // Microseconds
+    static const int latencyStatsWindow = 600;
+    static const int eventLogCapacity = 1024;
+    static const int audioChannels = 2;  // 2, 8 or 16 (zero disables audio)
+    static const BMDAudioSampleType audioSampleType = bmdAudioSampleType16bitInteger;
+    static const int audioFrameCapacity = 2048; // Samples per video frame (>= 48000 / 23.976)
+    static const int driftCheckpointInterval = 60; // Frames between drift checkpoints
+    static const int driftCheckpoints = 64;        // Sliding baseline (in checkpoints)
+    static const int driftMinCheckpoints = 10;     // Needed for an estimate
+    static const int audioStretchSlots = 30; // Frames an audio correction is spread over
+    static const int underrunRepeatLimit = 30; // Repeats of the last frame before going blank (zero: blank at once)
+    static const int recorderWrites = 4;    // Overlapped writes in flight
+    static const size_t recorderAlignment = 4096; // Unbuffered I/O granularity (covers 512 and 4K sectors)
+    static const int writerPollInterval = 2;      // Milliseconds between queue checks of idle writer threads
+    static const int timeshiftSpareSlots = 16; // Timeshift slots beyond the delay (frames held by the outputs)
+    static const int readAheadFrames = 8;      // Frames a file source keeps read ahead of the output (at least)
+    static const int exportSlots = 8;          // Shared memory export ring slots (readers more than half behind skip ahead)
+    static const BMDDisplayMode simulatedSignalMode = bmdModeHD1080i5994; // --simulate
 };
 
 // Miscellaneous utilities
@@ -24,10 +53,13 @@ class Utility
 {
 public:
 
-    // Retrieve an input/output pair from the first DeckLink device.
-    static auto RetrieveDeckLinkInputOutput()
+    // Retrieve an input/output pair from every DeckLink device (each
+    // sub-device of a multi-channel card shows up as a separate device).
+    // Devices without both an input and an output are skipped.
+    static auto RetrieveDeckLinkInputOutputs()
     {
-        // Retrieve the first DeckLink device via an iterator.
+        std::vector<std::tuple<IDeckLinkInput*, IDeckLinkOutput*>> pairs;
+
         IDeckLinkIterator* iterator;
         AssertSuccess(CoCreateInstance(
             CLSID_CDeckLinkIterator, nullptr, CLSCTX_ALL,
@@ -35,23 +67,71 @@ public:
         ));
 
         IDeckLink* device;
-        AssertSuccess(iterator->Next(&device));
+        while (iterator->Next(&device) == S_OK)
+        {
+            // Retrieve an input/output interface from the device.
+            IDeckLinkInput* input = nullptr;
+            IDeckLinkOutput* output = nullptr;
+            device->QueryInterface(IID_IDeckLinkInput, reinterpret_cast<void**>(&input));
+            device->QueryInterface(IID_IDeckLinkOutput, reinterpret_cast<void**>(&output));
 
-        // Retrieve an input/output interface from the device.
-        IDeckLinkInput* input;
-        AssertSuccess(device->QueryInterface(
-            IID_IDeckLinkInput, reinterpret_cast<void**>(&input)
-        ));
+            if (input != nullptr && output != nullptr)
+            {
+                pairs.emplace_back(input, output);
+            }
+            else
+            {
+                if (input != nullptr) input->Release();
+                if (output != nullptr) output->Release();
+            }
 
-        IDeckLinkOutput* output;
-        AssertSuccess(device->QueryInterface(
-            IID_IDeckLinkOutput, reinterpret_cast<void**>(&output)
-        ));
+            device->Release();
+        }
 
-        // These references are no longer needed.
         iterator->Release();
-        device->Release();
+        return pairs;
+    }
+
+    // Size of one audio sample frame (all channels) in bytes
+    static long GetAudioSampleFrameBytes()
+    {
+        return Config::audioChannels * (Config::audioSampleType / 8);
+    }
 
-        return std::make_tuple(input, output);
+    // Stream time of the given video frame slot. In the mode's own time
+    // scale every frame is an exact integer number of ticks (1001 / 30000
+    // for 1080i59.94), so the times never drift.
+    static BMDTimeValue GetFrameTime(uint64_t frame, BMDTimeValue frameDuration)
+    {
+        return static_cast<BMDTimeValue>(frame) * frameDuration;
+    }
+
+    // Number of audio samples (at 48 kHz) in the given video frame slot,
+    // following the cadence of rates like 29.97 (1601/1602 samples).
+    static long GetAudioSampleFrameCount(
+        uint64_t frame, BMDTimeValue frameDuration, BMDTimeScale timeScale
+    )
+    {
+        auto begin = static_cast<BMDTimeValue>(frame) * frameDuration * 48000 / timeScale;
+        auto end = static_cast<BMDTimeValue>(frame + 1) * frameDuration * 48000 / timeScale;
+        return static_cast<long>(end - begin);
+    }
+
+    // Calculate the row stride of a frame in the given pixel format.
+    static long GetRowBytes(BMDPixelFormat format, long width)
+    {
+        switch (format)
+        {
+        case bmdFormat8BitYUV:
+            return width * 2;
+        case bmdFormat10BitYUV:
+            // v210 packs 48 pixels into 128 bytes.
+            return (width + 47) / 48 * 128;
+        case bmdFormat10BitRGB:
+            // r210 rows are padded to 64 pixels.
+            return (width + 63) / 64 * 256;
+        default:
+            return width * 4;
+        }
     }
 };
@@ -1,39 +1,470 @@
 #include "Common.h"
+#include "Benchmark.h"
+#include "FileSource.h"
+#include "FrameExport.h"
+#include "Microbenchmark.h"
 #include "Receiver.h"
+#include "Recorder.h"
+#include "SelfTest.h"
 #include "Sender.h"
+#include "SimulatedDevice.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
 
-int main()
+// Default name of the frame export
+static const char* const ExportName = "Local\\DeckLinkTest";
+
+// Count heap allocations for the benchmark. Only in a build with
+// COUNT_HEAP_ALLOCATIONS defined: regular builds keep the standard
+// operator new.
+
+#if defined(COUNT_HEAP_ALLOCATIONS)
+
+void* operator new(std::size_t size)
+{
+    auto& count = SimulatedAllocations::IsDeviceScope() ?
+        Benchmark::DeviceAllocationCount() : Benchmark::AllocationCount();
+    count.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+#endif
+
+// Value of a "--name=value" argument (nullptr for any other argument)
+static const char* GetOption(const char* arg, const char* name)
+{
+    auto length = std::strlen(name);
+    if (std::strncmp(arg, name, length) != 0 || arg[length] != '=') return nullptr;
+    return arg + length + 1;
+}
+
+// Display mode by name (as in the simulated mode table)
+static bool FindMode(const char* name, BMDDisplayMode& mode)
 {
+    SimulatedDisplayMode::Info info;
+    if (!SimulatedDisplayMode::FindByName(name, info))
+    {
+        std::fprintf(stderr, "Unknown mode: %s\n", name);
+        return false;
+    }
+    mode = info.mode;
+    return true;
+}
+
+// Largest frame an input can deliver, from the display modes it lists (or
+// the whole mode table when it can't list them)
+static void GetLargestFrameSize(IDeckLinkInput* input, long& width, long& height)
+{
+    width = height = 0;
+
+    IDeckLinkDisplayModeIterator* iterator;
+    if (SUCCEEDED(input->GetDisplayModeIterator(&iterator)))
+    {
+        IDeckLinkDisplayMode* mode;
+        while (iterator->Next(&mode) == S_OK)
+        {
+            if (mode->GetWidth() * mode->GetHeight() > width * height)
+            {
+                width = mode->GetWidth();
+                height = mode->GetHeight();
+            }
+            mode->Release();
+        }
+        iterator->Release();
+    }
+
+    if (width > 0) return;
+
+    for (auto& info : SimulatedDisplayMode::GetModes())
+    {
+        if (info.width * info.height > width * height)
+        {
+            width = info.width;
+            height = info.height;
+        }
+    }
+}
+
+// Example reader of a frame export (as another process would use it):
+// looks at every frame it can keep up with in place, and reports once a
+// second.
+static int ReadExport(const char* name, double seconds)
+{
+    FrameExportReader reader;
+    if (!reader.Open(name))
+    {
+        std::fprintf(stderr, "Can't open export %s\n", name);
+        return 1;
+    }
+
+    auto end = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+    auto report = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+    FrameExportReader::Frame frame = {};
+    uint64_t level = 0;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        if (!reader.TryGetFrame(frame))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        else
+        {
+            // A stand-in for the analysis: the average byte value, sampled
+            // once per cache line, straight from the shared memory.
+            auto size = static_cast<size_t>(frame.rowBytes) * frame.height;
+            uint64_t sum = 0;
+            for (size_t i = 0; i < size; i += 64) sum += frame.pixels[i];
+
+            // Only trust the result if the frame didn't change meanwhile.
+            if (reader.IsIntact(frame)) level = sum / ((size + 63) / 64);
+        }
+
+        if (std::chrono::steady_clock::now() >= report)
+        {
+            auto stats = reader.GetStats();
+            std::printf(
+                "frame %llu (%ldx%ld, timecode %08x): level %llu, %llu read, %llu skipped, %llu torn\n",
+                static_cast<unsigned long long>(frame.index), frame.width, frame.height,
+                frame.timecode, static_cast<unsigned long long>(level),
+                static_cast<unsigned long long>(stats.frames),
+                static_cast<unsigned long long>(stats.skipped),
+                static_cast<unsigned long long>(stats.torn)
+            );
+            report += std::chrono::seconds(1);
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    // --benchmark [options]: loopback benchmark against simulated devices,
+    // reported as JSON. Options (all optional):
+    //   --mode=<name>          signal mode (default: Config::simulatedSignalMode)
+    //   --seconds=<s>          measured duration in simulated time (10)
+    //   --speed=<x>            simulated clock speed relative to real time (1)
+    //   --channels=<n>         simulated devices running at once (1)
+    //   --outputs=<n>          outputs fed by each input (1)
+    //   --ppm=<ppm>            input clock offset (0)
+    //   --flip-interval=<s>    seconds between signal mode flips (0: none)
+    //   --flip-mode=<name>     mode alternating with the main one (HD720p5994)
+    //   --record=<file>        record every input
+    //   --timeshift=<s>        play the input out with a delay
+    //   --play=<file>          play a recorded file instead of the input
+    //   --export-readers=<n>   export the inputs, with n reader threads
+    //   --jitter=<ms>          delay every input frame by up to this much,
+    //                          tracing the latency controller once a second
+    // --benchmark --scenario=<name>: microbenchmark of a single component
+    // instead (Microbenchmark.h): ringbuffer, v210, conversion-scaling,
+    // eventlog.
+    if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0)
+    {
+        Benchmark::Options options = {};
+        options.mode = Config::simulatedSignalMode;
+        options.seconds = 10;
+        options.speed = 1;
+        options.channels = 1;
+        options.outputs = 1;
+        options.flipMode = bmdModeHD720p5994;
+        options.exportReaders = -1;
+        const char* scenario = nullptr;
+
+        for (auto i = 2; i < argc; i++)
+        {
+            const char* value;
+            if ((value = GetOption(argv[i], "--mode")) != nullptr)
+            {
+                if (!FindMode(value, options.mode)) return 1;
+            }
+            else if ((value = GetOption(argv[i], "--flip-mode")) != nullptr)
+            {
+                if (!FindMode(value, options.flipMode)) return 1;
+            }
+            else if ((value = GetOption(argv[i], "--scenario")) != nullptr)
+                scenario = value;
+            else if ((value = GetOption(argv[i], "--seconds")) != nullptr)
+                options.seconds = std::atof(value);
+            else if ((value = GetOption(argv[i], "--speed")) != nullptr)
+                options.speed = std::atof(value);
+            else if ((value = GetOption(argv[i], "--channels")) != nullptr)
+                options.channels = (std::max)(std::atoi(value), 1);
+            else if ((value = GetOption(argv[i], "--outputs")) != nullptr)
+                options.outputs = (std::max)(std::atoi(value), 1);
+            else if ((value = GetOption(argv[i], "--ppm")) != nullptr)
+                options.drift = std::atof(value);
+            else if ((value = GetOption(argv[i], "--flip-interval")) != nullptr)
+                options.flipInterval = std::atof(value);
+            else if ((value = GetOption(argv[i], "--record")) != nullptr)
+                options.recordPath = value;
+            else if ((value = GetOption(argv[i], "--timeshift")) != nullptr)
+                options.timeshift = std::atof(value);
+            else if ((value = GetOption(argv[i], "--play")) != nullptr)
+                options.playPath = value;
+            else if ((value = GetOption(argv[i], "--export-readers")) != nullptr)
+                options.exportReaders = std::atoi(value);
+            else if ((value = GetOption(argv[i], "--jitter")) != nullptr)
+                options.jitter = (std::max)(std::atof(value), 0.0);
+            else
+            {
+                std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        if (scenario != nullptr)
+        {
+            if (Microbenchmark::Run(scenario, stdout)) return 0;
+            std::fprintf(stderr, "Unknown scenario: %s\n", scenario);
+            return 1;
+        }
+
+        if (options.outputs > Config::maxOutputs) options.outputs = Config::maxOutputs;
+        Benchmark::Run(options, stdout);
+        return 0;
+    }
+
+    // --selftest: correctness checks of the building blocks (SelfTest.h)
+    if (argc > 1 && std::strcmp(argv[1], "--selftest") == 0)
+        return SelfTest::Run(stdout) ? 0 : 1;
+
+    // --read-export [name] [seconds]: read the frames exported by another
+    // instance (see --export).
+    if (argc > 1 && std::strcmp(argv[1], "--read-export") == 0)
+        return ReadExport(
+            argc > 2 ? argv[2] : ExportName, argc > 3 ? std::atof(argv[3]) : 10
+        );
+
+    // --simulate [devices]: run against in-process simulated devices.
+    // --fanout: feed the input of the first device to every output.
+    // --record [file]: record the input of the first device to a file.
+    // --play [file]: play a recorded file on every output (in a loop)
+    // instead of the inputs.
+    // --export [name]: publish the frames of the first input to other
+    // processes (FrameExport.h).
+    auto simulate = 0;
+    auto fanout = false;
+    const char* recordPath = nullptr;
+    const char* playPath = nullptr;
+    const char* exportName = nullptr;
+    for (auto i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--simulate") == 0)
+            simulate = i + 1 < argc && std::isdigit(argv[i + 1][0]) ?
+                (std::max)(std::atoi(argv[++i]), 1) : 1;
+        else if (std::strcmp(argv[i], "--fanout") == 0)
+            fanout = true;
+        else if (std::strcmp(argv[i], "--record") == 0)
+            recordPath = i + 1 < argc ? argv[++i] : "capture.frm";
+        else if (std::strcmp(argv[i], "--play") == 0)
+            playPath = i + 1 < argc ? argv[++i] : "capture.frm";
+        else if (std::strcmp(argv[i], "--export") == 0)
+            exportName = i + 1 < argc ? argv[++i] : ExportName;
+    }
+
     AssertSuccess(CoInitialize(nullptr));
 
-    // Crete receiver/sender instances.
-    auto receiver = new Receiver();
-    auto sender = new Sender();
+    // Input/output pairs of every device (or of the simulated devices)
+    std::vector<std::tuple<IDeckLinkInput*, IDeckLinkOutput*>> devices;
+    if (simulate > 0)
+    {
+        for (auto i = 0; i < simulate; i++)
+            devices.push_back(SimulatedDevice::CreateInputOutput(Config::simulatedSignalMode));
+    }
+    else
+    {
+        devices = Utility::RetrieveDeckLinkInputOutputs();
+    }
+
+    // Largest frame the first input can deliver, for the export slots
+    long exportWidth = 0, exportHeight = 0;
+    if (exportName != nullptr && !devices.empty())
+        GetLargestFrameSize(std::get<0>(devices[0]), exportWidth, exportHeight);
 
-    // Start receiving/sending with the default device.
+    // The event log is shared (lock-free); everything else is per channel.
+    auto log = new EventLog(Config::eventLogCapacity, stdout);
+    std::vector<Receiver*> receivers;
+    std::vector<Sender*> senders;
+    std::vector<FileSource*> files;
+
+    // Start a receiver on each device (only the first one with fan-out)
+    // and a sender on each device. The receivers share out the hardware
+    // threads for conversion.
+    auto receiverCount = fanout ? 1 : static_cast<int>(devices.size());
+    for (size_t i = 0; i < devices.size(); i++)
     {
         IDeckLinkInput* input;
         IDeckLinkOutput* output;
-        std::tie(input, output) = Utility::RetrieveDeckLinkInputOutput();
+        std::tie(input, output) = devices[i];
+
+        auto channel = static_cast<int>(i);
+
+        if (!fanout || i == 0)
+        {
+            auto receiver = new Receiver(
+                log, channel, Receiver::GetConversionWorkers(receiverCount)
+            );
+            receiver->StartReceiving(input);
+            receivers.push_back(receiver);
+        }
 
-        receiver->StartReceiving(input);
-        sender->StartSending(output, receiver);
+        auto sender = new Sender(log, channel);
+        auto file = playPath != nullptr ? new FileSource(true) : nullptr;
+        if (file != nullptr && file->Open(playPath))
+        {
+            sender->StartSending(output, file);
+            files.push_back(file);
+        }
+        else
+        {
+            if (file != nullptr)
+            {
+                std::fprintf(stderr, "Can't play %s\n", playPath);
+                file->Release();
+            }
+            sender->StartSending(output, receivers.back());
+        }
+        senders.push_back(sender);
 
         input->Release();
         output->Release();
     }
 
+    // Record the first input if requested.
+    Recorder* recorder = nullptr;
+    if (recordPath != nullptr && !receivers.empty())
+    {
+        recorder = new Recorder(log, 0);
+        if (!recorder->StartRecording(receivers[0], recordPath))
+        {
+            std::fprintf(stderr, "Can't record to %s\n", recordPath);
+            recorder->Release();
+            recorder = nullptr;
+        }
+    }
+
+    // Export the first input if requested, in slots large enough for any
+    // format it may switch to (the section is committed in the page file,
+    // but only the pages written to take up memory).
+    FrameExport* exporter = nullptr;
+    if (exportName != nullptr && !receivers.empty())
+    {
+        exporter = new FrameExport();
+        auto slotSize = FrameExport::GetSlotSize(
+            exportWidth, exportHeight, Receiver::GetFramePixelFormat()
+        );
+        if (!exporter->Start(receivers[0], exportName, Config::exportSlots, slotSize))
+        {
+            std::fprintf(stderr, "Can't export to %s\n", exportName);
+            exporter->Release();
+            exporter = nullptr;
+        }
+    }
+
     // Wait for user interaction.
-    std::puts("Press return to stop.");
+    std::printf("%d input(s), %d output(s) running. Press return to stop.\n",
+        static_cast<int>(receivers.size()), static_cast<int>(senders.size()));
     (void)std::getchar();
 
-    // Stop receiving/sending.
-    sender->StopSending();
-    receiver->StopReceiving();
+    // Stop recording.
+    if (recorder != nullptr)
+    {
+        recorder->StopRecording();
+        auto stats = recorder->GetStats();
+        std::printf(
+            "Recorded %llu frames (%.1f MB) to %s, %llu failed writes\n",
+            static_cast<unsigned long long>(stats.frames), stats.bytes / 1e6,
+            recordPath, static_cast<unsigned long long>(stats.failures)
+        );
+        recorder->Release();
+    }
+
+    // Stop exporting.
+    if (exporter != nullptr)
+    {
+        exporter->Stop();
+        auto stats = exporter->GetStats();
+        std::printf(
+            "Exported %llu frames to %s, %llu dropped\n",
+            static_cast<unsigned long long>(stats.published), exportName,
+            static_cast<unsigned long long>(stats.dropped)
+        );
+        exporter->Release();
+    }
+
+    // Stop sending.
+    for (size_t i = 0; i < senders.size(); i++)
+    {
+        senders[i]->StopSending();
+
+        // Report the glass-to-glass latency of the last window.
+        auto latency = senders[i]->GetLatencyStats();
+        if (latency.windows > 0)
+            std::printf(
+                "#%d latency (us): min %lld, avg %lld, p99 %lld, max %lld\n",
+                static_cast<int>(i), latency.min, latency.avg, latency.p99, latency.max
+            );
+
+        // Report the clock drift and how it was compensated.
+        auto drift = senders[i]->GetDriftStats();
+        if (drift.estimate.locked)
+            std::printf(
+                "#%d drift: %+.3f ppm (%llu drops, %llu repeats)\n",
+                static_cast<int>(i), drift.estimate.ppm,
+                static_cast<unsigned long long>(drift.controller.drops),
+                static_cast<unsigned long long>(drift.controller.repeats)
+            );
+
+        // Report the slots the input couldn't fill.
+        auto underruns = senders[i]->GetUnderrunStats();
+        if (underruns.count > 0)
+            std::printf(
+                "#%d underruns: %llu (%llu repeated, %llu blank slots, longest %llu)\n",
+                static_cast<int>(i),
+                static_cast<unsigned long long>(underruns.count),
+                static_cast<unsigned long long>(underruns.repeatedSlots),
+                static_cast<unsigned long long>(underruns.blankSlots),
+                static_cast<unsigned long long>(underruns.longestSlots)
+            );
+
+        // Report how quickly the output followed the input mode.
+        auto switches = senders[i]->GetSwitchStats();
+        if (switches.count > 0)
+            std::printf(
+                "#%d mode switches: %llu (last %lld us, max %lld us)\n",
+                static_cast<int>(i), static_cast<unsigned long long>(switches.count),
+                static_cast<long long>(switches.last), static_cast<long long>(switches.max)
+            );
+
+        senders[i]->Release();
+    }
+
+    // Stop playing files.
+    for (auto file : files)
+    {
+        file->Close();
+        file->Release();
+    }
+
+    // Stop receiving.
+    for (auto receiver : receivers)
+    {
+        receiver->StopReceiving();
+        receiver->Release();
+    }
+
+    log->Release();
 
-    // Destroy the instances.
-    receiver->Release();
-    sender->Release();
-    
     return 0;
 }
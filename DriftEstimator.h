@@ -0,0 +1,185 @@
+#pragma once
+
+#include "Common.h"
+#include <cmath>
+#include <vector>
+
+// Clock drift estimator between the input and the output
+//
+// The input and the output run on separate clocks, so the input delivers
+// slightly more or fewer frames than the output consumes. Both rates are
+// measured on the common reference clock (capture timestamps of the input
+// frames and completion timestamps of the output slots) over a long
+// sliding baseline, which gives the drift in parts per million. Frames that
+// were lost on the way (queue overflows, drops) don't disturb the estimate
+// as each timeline counts elapsed frame periods rather than samples.
+class DriftEstimator final
+{
+public:
+
+    struct Stats
+    {
+        bool locked;   // Both baselines are long enough for an estimate
+        double ppm;    // Input rate relative to the output (positive: fast)
+        uint64_t resets; // Timeline discontinuities (signal loss etc.)
+    };
+
+    // Constructor
+
+    DriftEstimator()
+        : period_(0), resets_(0),
+          input_(Config::driftCheckpoints), output_(Config::driftCheckpoints)
+    {
+    }
+
+    // Public methods
+
+    // Start over with the given nominal frame duration (in
+    // Config::clockTimeScale units, the same on both sides).
+    void Reset(double period)
+    {
+        assert(period > 0);
+        period_ = period;
+        input_.Clear();
+        output_.Clear();
+    }
+
+    void AddCaptureTime(BMDTimeValue time)
+    {
+        assert(period_ > 0);
+        if (!input_.Add(time, period_)) resets_++;
+    }
+
+    void AddCompletionTime(BMDTimeValue time)
+    {
+        assert(period_ > 0);
+        if (!output_.Add(time, period_)) resets_++;
+    }
+
+    bool IsLocked() const
+    {
+        return input_.IsLocked() && output_.IsLocked();
+    }
+
+    // Surplus input frames per output slot (negative when the input is
+    // slow), or zero while unlocked
+    double GetDrift() const
+    {
+        if (!IsLocked()) return 0;
+        return output_.GetPeriod() / input_.GetPeriod() - 1;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.locked = IsLocked();
+        stats.ppm = GetDrift() * 1e6;
+        stats.resets = resets_;
+        return stats;
+    }
+
+private:
+
+    // Frame timeline on the reference clock: checkpoints of (time, elapsed
+    // frame periods) taken every Config::driftCheckpointInterval frames.
+    class Timeline
+    {
+    public:
+
+        explicit Timeline(size_t capacity)
+            : checkpoints_(capacity), head_(0), filled_(0),
+              started_(false), last_(0), index_(0), count_(0)
+        {
+        }
+
+        // Add a timestamp. Returns false when it didn't line up with the
+        // previous one and the timeline was restarted.
+        bool Add(BMDTimeValue time, double period)
+        {
+            if (!started_)
+            {
+                Restart(time);
+                return true;
+            }
+
+            // Number of frame periods since the last timestamp. It has to
+            // be close to a whole number, otherwise the stream has jumped.
+            auto elapsed = (time - last_) / period;
+            auto steps = std::llround(elapsed);
+            if (steps < 1 || std::abs(elapsed - steps) > 0.25)
+            {
+                Restart(time);
+                return false;
+            }
+
+            last_ = time;
+            index_ += steps;
+
+            if (++count_ >= Config::driftCheckpointInterval)
+            {
+                count_ = 0;
+                Push(time);
+            }
+            return true;
+        }
+
+        void Clear()
+        {
+            started_ = false;
+            head_ = 0;
+            filled_ = 0;
+        }
+
+        bool IsLocked() const
+        {
+            return filled_ >= static_cast<size_t>(Config::driftMinCheckpoints);
+        }
+
+        // Measured frame period (over the whole baseline)
+        double GetPeriod() const
+        {
+            auto& newest = checkpoints_[(head_ + checkpoints_.size() - 1) % checkpoints_.size()];
+            auto& oldest = checkpoints_[(head_ + checkpoints_.size() - filled_) % checkpoints_.size()];
+            return static_cast<double>(newest.time - oldest.time) / (newest.index - oldest.index);
+        }
+
+    private:
+
+        struct Checkpoint
+        {
+            BMDTimeValue time;
+            int64_t index;
+        };
+
+        std::vector<Checkpoint> checkpoints_;
+        size_t head_;
+        size_t filled_;
+        bool started_;
+        BMDTimeValue last_;
+        int64_t index_;
+        int count_;
+
+        void Restart(BMDTimeValue time)
+        {
+            started_ = true;
+            last_ = time;
+            index_ = 0;
+            count_ = 0;
+            head_ = 0;
+            filled_ = 0;
+            Push(time);
+        }
+
+        void Push(BMDTimeValue time)
+        {
+            checkpoints_[head_] = Checkpoint{ time, index_ };
+            head_ = (head_ + 1) % checkpoints_.size();
+            if (filled_ < checkpoints_.size()) filled_++;
+        }
+    };
+
+    double period_;
+    uint64_t resets_;
+    Timeline input_;
+    Timeline output_;
+};
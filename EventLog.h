@@ -0,0 +1,222 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+// Lock-free structured event log
+//
+// Real-time callbacks write fixed-size binary records into a preallocated
+// ring (multi-producer, bounded, no locks, no allocation). A background
+// thread drains the ring, formats the records and writes them out, so no
+// console or file I/O ever happens on a callback thread. Records that
+// don't fit in the ring are counted and dropped.
+class EventLog final
+{
+public:
+
+    enum class EventType : uint32_t
+    {
+        FrameDisplayedLate,
+        FrameDropped,
+        InputQueueOverflow,
+        LatencyDrop,
+        LatencyRepeat,
+        DriftDrop,
+        DriftRepeat,
+        RecorderWriteFailed
+    };
+
+    // Fixed-size event record
+    struct Event
+    {
+        EventType type;
+        uint32_t channel;     // Receiver/Sender channel index
+        uint32_t inputDepth;  // Frames in the input queue
+        uint32_t outputDepth; // Frames buffered in the output
+        uint64_t frame;       // Frame/slot number
+        int64_t time;         // Steady clock time in microseconds
+    };
+
+    // Constructor/destructor
+
+    EventLog(size_t capacity, FILE* stream)
+        : refCount_(1), stream_(stream), quit_(false),
+          enqueuePos_(0), dequeuePos_(0), lostCount_(0)
+    {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        mask_ = size - 1;
+
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+
+        thread_ = std::thread(&EventLog::DrainLoop, this);
+    }
+
+    ~EventLog()
+    {
+        quit_.store(true, std::memory_order_release);
+        thread_.join();
+    }
+
+    // Public methods
+
+    // Append an event (any thread, lock-free). Returns false when the
+    // ring is full and the event was dropped.
+    bool Write(
+        EventType type, int channel, uint64_t frame,
+        size_t inputDepth, size_t outputDepth
+    )
+    {
+        auto pos = enqueuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while (true)
+        {
+            cell = &cells_[pos & mask_];
+            auto seq = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - pos);
+
+            if (diff == 0)
+            {
+                // The cell is free: try to claim it.
+                if (enqueuePos_.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0)
+            {
+                // The ring is full.
+                lostCount_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+            {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->event.type = type;
+        cell->event.channel = static_cast<uint32_t>(channel);
+        cell->event.inputDepth = static_cast<uint32_t>(inputDepth);
+        cell->event.outputDepth = static_cast<uint32_t>(outputDepth);
+        cell->event.frame = frame;
+        cell->event.time = GetTime();
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Number of events dropped because the ring was full
+    uint64_t CountLostEvents() const
+    {
+        return lostCount_.load(std::memory_order_relaxed);
+    }
+
+    // Reference counting (same semantics as the COM objects)
+
+    ULONG AddRef()
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release()
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+private:
+
+    struct Cell
+    {
+        std::atomic<uint64_t> sequence;
+        Event event;
+    };
+
+    static const size_t CacheLineSize = 64;
+
+    std::atomic<ULONG> refCount_;
+    FILE* stream_;
+    std::atomic<bool> quit_;
+    std::thread thread_;
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+
+    // The producer and consumer positions live on separate cache lines.
+    char pad0_[CacheLineSize];
+    std::atomic<uint64_t> enqueuePos_;
+    char pad1_[CacheLineSize];
+    uint64_t dequeuePos_;
+    std::atomic<uint64_t> lostCount_;
+
+    static int64_t GetTime()
+    {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(
+            steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+    // Consumer side (background thread only)
+
+    bool TryRead(Event& event)
+    {
+        auto cell = &cells_[dequeuePos_ & mask_];
+        auto seq = cell->sequence.load(std::memory_order_acquire);
+        if (seq != dequeuePos_ + 1) return false;
+
+        event = cell->event;
+        cell->sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+        dequeuePos_++;
+        return true;
+    }
+
+    void Format(const Event& e)
+    {
+        static const char* names[] =
+        {
+            "Frame was displayed late",
+            "Frame was dropped",
+            "Input queue overflowed",
+            "Latency controller dropped a frame",
+            "Latency controller repeated a frame",
+            "Drift compensation dropped a frame",
+            "Drift compensation repeated a frame",
+            "Recorder failed to write a frame"
+        };
+
+        std::fprintf(
+            stream_, "[%lld] #%u %s (frame %llu, in %u, out %u)\n",
+            static_cast<long long>(e.time), e.channel, names[static_cast<int>(e.type)],
+            static_cast<unsigned long long>(e.frame), e.inputDepth, e.outputDepth
+        );
+    }
+
+    void DrainLoop()
+    {
+        while (true)
+        {
+            // Read the flag before draining so nothing written before
+            // the destructor was called is missed.
+            auto quit = quit_.load(std::memory_order_acquire);
+
+            Event event;
+            auto any = false;
+            while (TryRead(event))
+            {
+                Format(event);
+                any = true;
+            }
+            if (any) std::fflush(stream_);
+
+            if (quit) return;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+};
@@ -0,0 +1,374 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameFile.h"
+#include "FrameSource.h"
+#include "MemoryBackedFrame.h"
+#include "RingBuffer.h"
+#include "StageTimer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Playout of a frame file (as written by Recorder)
+//
+// A read-ahead thread reads the frames unbuffered, straight into the
+// (page-aligned) memory of a fixed set of frames, and queues up every
+// frame the output doesn't hold (at least Config::readAheadFrames); the
+// output callback only takes frames off that queue and never touches the
+// disk. The frames are created when the file is opened and come back here
+// when the output releases them, so nothing is allocated while playing,
+// unless the format changes within the file (idle frames are replaced as
+// they're reused).
+class FileSource final : public FrameSource, public FrameRecycler
+{
+public:
+
+    struct Stats
+    {
+        uint64_t frames;     // Frames read
+        uint64_t bytes;      // Bytes read (including the sector padding)
+        uint64_t failures;   // Frames lost to read errors
+        uint64_t retrievals; // Frames asked for by the output
+        uint64_t starved;    // Retrievals with nothing read ahead
+        uint64_t depthSum;   // Read-ahead depth summed over the retrievals
+        size_t minDepth;     // Lowest depth seen since ResetMinDepth()
+        StageTimer::Stats read; // Time spent in reads
+    };
+
+    // Constructor/destructor
+
+    // With loop set, playback wraps around at the end of the file.
+    explicit FileSource(bool loop)
+        : refCount_(1), loop_(loop), open_(false), frameCount_(0), audioCompatible_(false),
+          next_(0), quit_(false), created_(0), ready_(PoolSize), frames_(0), bytes_(0),
+          failures_(0), retrievals_(0), starved_(0), depthSum_(0), minDepth_(SIZE_MAX),
+          resetMinDepth_(false)
+    {
+        free_.reserve(PoolSize);
+        audio_ = FrameFile::AllocateBuffer(FrameFile::RoundUp(static_cast<size_t>(
+            Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()
+        )));
+    }
+
+    ~FileSource()
+    {
+        assert(!open_); // The source should have been closed.
+
+        // Every frame has to be back by now (each holds a reference to the
+        // source while it's out).
+        assert(free_.size() == created_);
+        for (auto frame : free_) delete frame;
+        FrameFile::FreeBuffer(audio_);
+    }
+
+    // Public methods
+
+    // Open a file and start reading ahead. Returns false when the file
+    // can't be opened or holds no frame.
+    bool Open(const char* path)
+    {
+        assert(!open_);
+
+        if (!file_.Open(path)) return false;
+        if (file_.CountFrames() == 0)
+        {
+            file_.Close();
+            return false;
+        }
+
+        open_ = true;
+        frameCount_ = file_.CountFrames();
+        audioCompatible_ = file_.HasCompatibleAudio();
+        next_ = 0;
+
+        // Create the frames in the format the file starts with, bringing
+        // them in through the usual recycling path so they're idle (zero
+        // references) like the ones coming back later.
+        FrameFile::Entry entry;
+        if (file_.GetEntry(0, entry))
+        {
+            for (; created_ < PoolSize; created_++)
+            {
+                AddRef();
+                (new MemoryBackedFrame(
+                    entry.width, entry.height, static_cast<BMDPixelFormat>(entry.pixelFormat), this
+                ))->Release();
+            }
+        }
+
+        quit_ = false;
+        reader_ = std::thread(&FileSource::ReaderLoop, this);
+        return true;
+    }
+
+    // Stop reading. The frames read ahead are given up; the ones held by
+    // the output come back whenever it releases them.
+    void Close()
+    {
+        assert(open_);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        signal_.notify_one();
+        reader_.join();
+
+        MemoryBackedFrame* frame;
+        while (ready_.TryPop(frame)) frame->Release();
+
+        file_.Close();
+        open_ = false;
+    }
+
+    // Number of frames in the file
+    uint64_t GetFrameCount() const
+    {
+        return frameCount_;
+    }
+
+    // Start tracking the lowest read-ahead depth over (from the next
+    // retrieval on).
+    void ResetMinDepth()
+    {
+        resetMinDepth_.store(true, std::memory_order_relaxed);
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.frames = frames_.load(std::memory_order_relaxed);
+        stats.bytes = bytes_.load(std::memory_order_relaxed);
+        stats.failures = failures_.load(std::memory_order_relaxed);
+        stats.retrievals = retrievals_.load(std::memory_order_relaxed);
+        stats.starved = starved_.load(std::memory_order_relaxed);
+        stats.depthSum = depthSum_.load(std::memory_order_relaxed);
+        stats.minDepth = minDepth_.load(std::memory_order_relaxed);
+        stats.read = readTimer_.GetStats();
+        return stats;
+    }
+
+    // FrameSource implementation
+
+    bool TryPopFrame(MemoryBackedFrame*& frame) override
+    {
+        // Only the consumer writes these: plain loads and stores.
+        auto depth = ready_.Count();
+        auto minDepth = minDepth_.load(std::memory_order_relaxed);
+        if (resetMinDepth_.exchange(false, std::memory_order_relaxed)) minDepth = SIZE_MAX;
+        if (depth < minDepth) minDepth_.store(depth, std::memory_order_relaxed);
+        retrievals_.store(retrievals_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        depthSum_.store(depthSum_.load(std::memory_order_relaxed) + depth, std::memory_order_relaxed);
+
+        if (ready_.TryPop(frame)) return true;
+
+        starved_.store(starved_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    size_t CountQueuedFrames() override
+    {
+        return ready_.Count();
+    }
+
+    bool IsLive() const override
+    {
+        return false;
+    }
+
+    ULONG AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // FrameRecycler implementation
+
+    void RecycleFrame(MemoryBackedFrame* frame) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(frame);
+        }
+        signal_.notify_one();
+
+        // Drop the reference taken when the frame went out.
+        Release();
+    }
+
+private:
+
+    // Frames read ahead plus the ones the output can hold at once (its
+    // buffer, the last frame kept for underruns and one on the way back)
+    static const size_t PoolSize = Config::readAheadFrames + Config::maxLatency + 2;
+
+    std::atomic<ULONG> refCount_;
+    bool loop_;
+    bool open_;
+    FrameFileReader file_; // Only used by the reader thread while open
+    uint64_t frameCount_;
+    bool audioCompatible_;
+    uint64_t next_;        // Next frame to read (reader thread)
+    uint8_t* audio_;       // Aligned buffer the audio is read into
+    std::thread reader_;
+    std::mutex mutex_;
+    std::condition_variable signal_;
+    bool quit_;
+    size_t created_;       // Frames in existence (under the lock)
+    std::vector<MemoryBackedFrame*> free_; // Idle frames (under the lock)
+    RingBuffer<MemoryBackedFrame*> ready_; // Frames read ahead
+    std::atomic<uint64_t> frames_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> failures_;
+    std::atomic<uint64_t> retrievals_;
+    std::atomic<uint64_t> starved_;
+    std::atomic<uint64_t> depthSum_;
+    std::atomic<size_t> minDepth_;
+    std::atomic<bool> resetMinDepth_;
+    StageTimer readTimer_;
+
+    void ReaderLoop()
+    {
+        while (true)
+        {
+            // Wait for an idle frame to read into, or for room for a new
+            // one. Reading ahead is capped by the frames, not by the queue
+            // (which has room for all).
+            MemoryBackedFrame* frame = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                signal_.wait(lock, [this] {
+                    return quit_ ||
+                        ((!free_.empty() || created_ < PoolSize) && (loop_ || next_ < frameCount_));
+                });
+                if (quit_) break;
+
+                if (!free_.empty())
+                {
+                    frame = free_.back();
+                    free_.pop_back();
+                }
+            }
+
+            if (next_ == frameCount_) next_ = 0;
+
+            FrameFile::Entry entry;
+            if (!file_.GetEntry(next_++, entry))
+            {
+                if (frame != nullptr) Idle(frame);
+                Fail();
+                continue;
+            }
+
+            // An idle frame of another format is replaced.
+            if (frame != nullptr && !Matches(frame, entry))
+            {
+                delete frame;
+                frame = nullptr;
+                std::lock_guard<std::mutex> lock(mutex_);
+                created_--;
+            }
+
+            // Take the frame out (reviving an idle one), and keep the
+            // source alive while it's out.
+            if (frame != nullptr)
+            {
+                frame->AddRef();
+            }
+            else
+            {
+                frame = new MemoryBackedFrame(
+                    entry.width, entry.height, static_cast<BMDPixelFormat>(entry.pixelFormat), this
+                );
+                std::lock_guard<std::mutex> lock(mutex_);
+                created_++;
+            }
+            AddRef();
+
+            if (Read(frame, entry))
+            {
+                frame->SetQueueTime(StageTimer::Now());
+                auto pushed = ready_.TryPush(frame);
+                assert(pushed);
+                (void)pushed;
+            }
+            else
+            {
+                // Back to the idle frames through the recycling path.
+                frame->Release();
+                Fail();
+            }
+        }
+    }
+
+    // Put a frame that never went out back (reader thread).
+    void Idle(MemoryBackedFrame* frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(frame);
+    }
+
+    void Fail()
+    {
+        failures_.fetch_add(1, std::memory_order_relaxed);
+
+        // Don't spin on a failing disk.
+        std::this_thread::sleep_for(std::chrono::milliseconds(Config::writerPollInterval));
+    }
+
+    static bool Matches(MemoryBackedFrame* frame, const FrameFile::Entry& entry)
+    {
+        return
+            frame->GetWidth() == entry.width &&
+            frame->GetHeight() == entry.height &&
+            frame->GetPixelFormat() == static_cast<BMDPixelFormat>(entry.pixelFormat);
+    }
+
+    // Read a frame of the file into a frame of its format (reader thread).
+    bool Read(MemoryBackedFrame* frame, const FrameFile::Entry& entry)
+    {
+        if (FrameFile::GetPixelSize(entry) > frame->GetMemorySize() ||
+            entry.pixelBytes != static_cast<uint32_t>(frame->GetRowBytes() * frame->GetHeight()))
+            return false;
+
+        void* bytes;
+        frame->GetBytes(&bytes);
+
+        auto begin = StageTimer::Now();
+        auto ok = file_.ReadPixels(entry, bytes);
+
+        // The audio comes along when it's in the format the output expects.
+        auto audio = audioCompatible_ &&
+            entry.audioSampleFrames > 0 && entry.audioSampleFrames <= Config::audioFrameCapacity;
+        if (ok && audio) ok = file_.ReadAudio(entry, audio_);
+        readTimer_.AddSince(begin);
+
+        if (!ok) return false;
+
+        if (audio)
+            frame->SetAudio(audio_, entry.audioSampleFrames);
+        else
+            frame->ClearAudio();
+
+        // The capture time stays behind: it's on another clock, and the
+        // output would take it for the latency and the drift of a live
+        // input.
+        frame->SetCaptureTime(-1);
+        frame->SetDisplayMode(static_cast<BMDDisplayMode>(entry.displayMode));
+        frame->SetTimecodeBCD(entry.timecode);
+
+        frames_.fetch_add(1, std::memory_order_relaxed);
+        bytes_.fetch_add(entry.size, std::memory_order_relaxed);
+        return true;
+    }
+};
@@ -0,0 +1,488 @@
+#pragma once
+
+#include "Common.h"
+#include "Platform.h"
+#include "Receiver.h"
+#include "StageTimer.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+// Export of the captured frames to other processes on the host
+//
+// The frames of a receiver are published into a ring of slots in a named
+// shared memory section (page file backed), which any number of local
+// readers (multiviewers, analyzers etc.) can open and look into in place.
+// The producer never waits for the readers, and the readers never write
+// to the section, so the cost of publishing a frame doesn't depend on how
+// many of them there are.
+//
+// Frame #i goes to slot i % N. Each slot has a sequence number (a seqlock)
+// that's odd while the slot is being written and 2 * (i + 1) once frame #i
+// is complete, and the section header has the number of frames published
+// so far. A reader looks up the slot of the frame it wants, checks the
+// sequence number, uses the memory and then checks the sequence number
+// again: if it changed, the frame was overwritten under it (torn) and has
+// to be ignored. Readers that fall behind skip ahead to the newest frame.
+//
+// Layout (all offsets from the start of the section):
+//
+//   0               SharedHeader (one page)
+//   PageSize        slot 0: SlotHeader (one page) | pixels | audio
+//   + slotSize      slot 1 ...
+class FrameExport final
+{
+public:
+
+    static const uint32_t Magic = 0x50584544; // "DEXP"
+    static const uint32_t Version = 1;
+    static const size_t PageSize = 4096;
+
+    // Section header
+    struct SharedHeader
+    {
+        uint32_t magic;           // Written last (the section is ready)
+        uint32_t version;
+        uint32_t slotCount;
+        uint32_t audioChannels;
+        uint32_t audioSampleType; // BMDAudioSampleType
+        uint32_t reserved;
+        uint64_t slotSize;        // Bytes per slot (page multiple)
+        uint64_t audioOffset;     // Offset of the audio in a slot
+        uint8_t padding[24];      // Keeps the counter on a cache line of its own
+        std::atomic<uint64_t> writeCount; // Frames published (the index of the next one)
+    };
+
+    // Frame properties, in the first page of the slot
+    struct SlotHeader
+    {
+        std::atomic<uint64_t> sequence; // 2 * (index + 1) when complete, odd while written
+        int64_t captureTime;      // Config::clockTimeScale units (-1: unknown)
+        int32_t width;
+        int32_t height;
+        int32_t rowBytes;
+        uint32_t pixelFormat;     // BMDPixelFormat
+        uint32_t displayMode;     // BMDDisplayMode
+        uint32_t timecode;        // BMDTimecodeBCD (MemoryBackedFrame::NoTimecode: none)
+        uint32_t generation;      // Input format generation
+        int32_t audioSampleFrames;
+    };
+
+    struct Stats
+    {
+        uint64_t published; // Frames published
+        uint64_t dropped;   // Frames too large for a slot
+        StageTimer::Stats copy; // Time spent publishing (copy into the slot)
+        uint64_t cpuNanoseconds; // ... of which the writer thread ran on a CPU
+    };
+
+    // Constructor/destructor
+
+    FrameExport()
+        : refCount_(1), receiver_(nullptr), queue_(-1), mapping_(nullptr),
+          view_(nullptr), header_(nullptr), quit_(false), dropped_(0), cpuTime_(0)
+    {
+    }
+
+    ~FrameExport()
+    {
+        assert(receiver_ == nullptr); // The export should have been stopped.
+
+        if (view_ != nullptr)
+        {
+            UnmapViewOfFile(view_);
+            CloseHandle(mapping_);
+        }
+    }
+
+    // Public methods
+
+    // Slot size for frames of the given size and format, with the audio
+    // that comes with them
+    static size_t GetSlotSize(long width, long height, BMDPixelFormat format)
+    {
+        auto pixels = static_cast<size_t>(Utility::GetRowBytes(format, width)) * height;
+        return PageSize + RoundUp(pixels) + RoundUp(GetAudioCapacity());
+    }
+
+    // Create the named section with slotCount slots (of GetSlotSize bytes)
+    // and start publishing the frames of a receiver. The name follows the
+    // object namespace rules ("Local\\..." for the session). Returns false
+    // when the section can't be created or already exists (another export
+    // under the same name).
+    bool Start(Receiver* receiver, const char* name, size_t slotCount, size_t slotSize)
+    {
+        assert(receiver_ == nullptr && view_ == nullptr);
+        assert(slotCount >= 2);
+
+        slotSize = RoundUp(slotSize);
+        auto size = PageSize + static_cast<uint64_t>(slotSize) * slotCount;
+
+        mapping_ = CreateFileMappingA(
+            INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), name
+        );
+        if (mapping_ == nullptr) return false;
+        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            CloseHandle(mapping_);
+            mapping_ = nullptr;
+            return false;
+        }
+
+        view_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+        if (view_ == nullptr)
+        {
+            CloseHandle(mapping_);
+            mapping_ = nullptr;
+            return false;
+        }
+
+        // The section comes zeroed: every slot reads as empty (sequence 0).
+        header_ = reinterpret_cast<SharedHeader*>(view_);
+        header_->version = Version;
+        header_->slotCount = static_cast<uint32_t>(slotCount);
+        header_->audioChannels = Config::audioChannels;
+        header_->audioSampleType = Config::audioSampleType;
+        header_->slotSize = slotSize;
+        header_->audioOffset = slotSize - RoundUp(GetAudioCapacity());
+        header_->writeCount.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->magic = Magic;
+
+        // Get our own queue of (shared) frames from the receiver.
+        receiver_ = receiver;
+        receiver_->AddRef();
+        queue_ = receiver_->AttachOutput();
+        assert(queue_ >= 0);
+
+        quit_.store(false, std::memory_order_relaxed);
+        writer_ = std::thread(&FrameExport::WriterLoop, this);
+        return true;
+    }
+
+    // Stop publishing. The section stays until the readers close it too.
+    void Stop()
+    {
+        assert(receiver_ != nullptr);
+
+        quit_.store(true, std::memory_order_release);
+        writer_.join();
+
+        receiver_->DetachOutput(queue_);
+        queue_ = -1;
+        receiver_->Release();
+        receiver_ = nullptr;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.published = header_ != nullptr ?
+            header_->writeCount.load(std::memory_order_relaxed) : 0;
+        stats.dropped = dropped_.load(std::memory_order_relaxed);
+        stats.copy = copyTimer_.GetStats();
+        stats.cpuNanoseconds = cpuTime_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Start tracking the longest publication over.
+    void ResetPeak()
+    {
+        copyTimer_.ResetPeak();
+    }
+
+    // Reference counting (same semantics as the COM objects)
+
+    ULONG AddRef()
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release()
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    Receiver* receiver_;
+    int queue_;
+    HANDLE mapping_;
+    uint8_t* view_;
+    SharedHeader* header_;
+    std::thread writer_;
+    std::atomic<bool> quit_;
+    std::atomic<uint64_t> dropped_;
+    StageTimer copyTimer_;
+    std::atomic<uint64_t> cpuTime_;
+
+    static size_t RoundUp(size_t size)
+    {
+        return (size + PageSize - 1) / PageSize * PageSize;
+    }
+
+    static size_t GetAudioCapacity()
+    {
+        return static_cast<size_t>(Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes());
+    }
+
+    void WriterLoop()
+    {
+        while (!quit_.load(std::memory_order_acquire))
+        {
+            MemoryBackedFrame* frame;
+            if (receiver_->TryPopFrame(queue_, frame))
+            {
+                Publish(frame);
+                frame->Release();
+            }
+            else
+            {
+                // Nothing new: the queue holds several frames, so polling
+                // leaves plenty of headroom.
+                std::this_thread::sleep_for(std::chrono::milliseconds(Config::writerPollInterval));
+            }
+        }
+    }
+
+    // Copy a frame into the next slot and publish it (writer thread).
+    void Publish(MemoryBackedFrame* frame)
+    {
+        auto size = static_cast<size_t>(frame->GetRowBytes()) * frame->GetHeight();
+        if (PageSize + size > header_->audioOffset)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto begin = StageTimer::Now();
+        auto cpuBegin = Platform::GetThreadCpuTime();
+
+        // Only this thread writes the counter: a plain load.
+        auto index = header_->writeCount.load(std::memory_order_relaxed);
+        auto memory = view_ + PageSize + (index % header_->slotCount) * header_->slotSize;
+        auto slot = reinterpret_cast<SlotHeader*>(memory);
+
+        // Mark the slot as being written before touching it, so a reader
+        // still looking at the previous frame finds it torn.
+        slot->sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        void* bytes;
+        frame->GetBytes(&bytes);
+        std::memcpy(memory + PageSize, bytes, size);
+
+        auto audioFrames = frame->GetAudioSampleFrameCount();
+        if (audioFrames > 0)
+            std::memcpy(
+                memory + header_->audioOffset, frame->GetAudioBytes(),
+                static_cast<size_t>(audioFrames * Utility::GetAudioSampleFrameBytes())
+            );
+
+        slot->captureTime = frame->GetCaptureTime();
+        slot->width = frame->GetWidth();
+        slot->height = frame->GetHeight();
+        slot->rowBytes = frame->GetRowBytes();
+        slot->pixelFormat = frame->GetPixelFormat();
+        slot->displayMode = frame->GetDisplayMode();
+        slot->timecode = frame->GetTimecodeBCD();
+        slot->generation = frame->GetGeneration();
+        slot->audioSampleFrames = audioFrames;
+
+        slot->sequence.store(2 * (index + 1), std::memory_order_release);
+        header_->writeCount.store(index + 1, std::memory_order_release);
+
+        // Only this thread adds to the CPU time: plain loads and stores.
+        auto cpu = Platform::GetThreadCpuTime() - cpuBegin;
+        cpuTime_.store(cpuTime_.load(std::memory_order_relaxed) + cpu, std::memory_order_relaxed);
+        copyTimer_.AddSince(begin);
+    }
+};
+
+// Reader side of a frame export (usable from any process)
+//
+// Frames are looked at in place: TryGetFrame gives pointers into the
+// section, and IsIntact tells afterwards whether the frame stayed the same
+// while it was used. Readers only read the section, so they can come and
+// go at any time and never hold up the producer or each other.
+class FrameExportReader final
+{
+public:
+
+    // A frame in the section (valid while the reader is open)
+    struct Frame
+    {
+        uint64_t index;
+        uint64_t sequence;
+        BMDTimeValue captureTime;
+        long width;
+        long height;
+        long rowBytes;
+        BMDPixelFormat pixelFormat;
+        BMDDisplayMode displayMode;
+        BMDTimecodeBCD timecode;
+        long audioSampleFrames;
+        const uint8_t* pixels;
+        const uint8_t* audio;
+    };
+
+    struct Stats
+    {
+        uint64_t frames;  // Frames used intact
+        uint64_t skipped; // Frames passed over (fallen behind or overwritten before a look)
+        uint64_t torn;    // Frames overwritten while being used
+    };
+
+    // Constructor/destructor
+
+    FrameExportReader()
+        : mapping_(nullptr), view_(nullptr), header_(nullptr), next_(0),
+          frames_(0), skipped_(0), torn_(0)
+    {
+    }
+
+    ~FrameExportReader()
+    {
+        if (view_ != nullptr) Close();
+    }
+
+    // Public methods
+
+    // Open an export by name. Reading starts with the next frame published.
+    // Returns false when there's no such export (or it isn't ready yet).
+    bool Open(const char* name)
+    {
+        assert(view_ == nullptr);
+
+        mapping_ = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+        if (mapping_ == nullptr) return false;
+
+        view_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        header_ = reinterpret_cast<const FrameExport::SharedHeader*>(view_);
+        if (view_ == nullptr ||
+            header_->magic != FrameExport::Magic || header_->version != FrameExport::Version)
+        {
+            Close();
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        next_ = header_->writeCount.load(std::memory_order_acquire);
+        return true;
+    }
+
+    void Close()
+    {
+        assert(mapping_ != nullptr);
+
+        if (view_ != nullptr) UnmapViewOfFile(view_);
+        CloseHandle(mapping_);
+        mapping_ = nullptr;
+        view_ = nullptr;
+        header_ = nullptr;
+    }
+
+    uint32_t GetAudioChannelCount() const
+    {
+        return header_->audioChannels;
+    }
+
+    BMDAudioSampleType GetAudioSampleType() const
+    {
+        return static_cast<BMDAudioSampleType>(header_->audioSampleType);
+    }
+
+    // Take the next frame (in order while the reader keeps up, the newest
+    // one once it's more than half the ring behind). Returns false when
+    // there's no new frame, or when the one up next was overwritten
+    // already (counted as skipped; just ask again).
+    bool TryGetFrame(Frame& frame)
+    {
+        auto written = header_->writeCount.load(std::memory_order_acquire);
+        if (written <= next_) return false;
+
+        if (written - next_ > header_->slotCount / 2)
+        {
+            Count(skipped_, written - 1 - next_);
+            next_ = written - 1;
+        }
+
+        auto index = next_++;
+        auto memory = GetSlotMemory(index);
+        auto slot = reinterpret_cast<const FrameExport::SlotHeader*>(memory);
+
+        auto sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * (index + 1))
+        {
+            Count(skipped_, 1);
+            return false;
+        }
+
+        frame.index = index;
+        frame.sequence = sequence;
+        frame.captureTime = slot->captureTime;
+        frame.width = slot->width;
+        frame.height = slot->height;
+        frame.rowBytes = slot->rowBytes;
+        frame.pixelFormat = static_cast<BMDPixelFormat>(slot->pixelFormat);
+        frame.displayMode = static_cast<BMDDisplayMode>(slot->displayMode);
+        frame.timecode = slot->timecode;
+        frame.audioSampleFrames = slot->audioSampleFrames;
+        frame.pixels = memory + FrameExport::PageSize;
+        frame.audio = memory + header_->audioOffset;
+        return true;
+    }
+
+    // Check, after using a frame, that it wasn't overwritten meanwhile.
+    // Whatever was read from it has to be thrown away if not.
+    bool IsIntact(const Frame& frame)
+    {
+        auto slot = reinterpret_cast<const FrameExport::SlotHeader*>(GetSlotMemory(frame.index));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) != frame.sequence)
+        {
+            Count(torn_, 1);
+            return false;
+        }
+
+        Count(frames_, 1);
+        return true;
+    }
+
+    // Can be called from any thread.
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.frames = frames_.load(std::memory_order_relaxed);
+        stats.skipped = skipped_.load(std::memory_order_relaxed);
+        stats.torn = torn_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+
+    HANDLE mapping_;
+    const uint8_t* view_;
+    const FrameExport::SharedHeader* header_;
+    uint64_t next_; // Next frame to take
+    std::atomic<uint64_t> frames_;
+    std::atomic<uint64_t> skipped_;
+    std::atomic<uint64_t> torn_;
+
+    const uint8_t* GetSlotMemory(uint64_t index) const
+    {
+        return view_ + FrameExport::PageSize + (index % header_->slotCount) * header_->slotSize;
+    }
+
+    // Only the reader thread writes the counters: plain loads and stores.
+    static void Count(std::atomic<uint64_t>& counter, uint64_t count)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,500 @@
+#pragma once
+
+#include "Common.h"
+#include "MemoryBackedFrame.h"
+#include <cstring>
+#include <vector>
+
+// Indexed frame file
+//
+// Every part of the file starts on a Config::recorderAlignment boundary,
+// so it can be written and read unbuffered (and mapped) as it is:
+//
+//   header | chunk 0 | frames 0..N-1 | chunk 1 | frames N..2N-1 | ... | directory
+//
+// The header is a single block. An index chunk holds the entries of the
+// next ChunkFrames frames (where the payload is, its format, size and
+// timestamps, the timecode); it's reserved ahead of them and filled in
+// once they've been laid out, together with the offset of the chunk after
+// it. Closing the file appends a directory (the offset of every chunk)
+// and records it in the header. Opening a file takes two reads, and any
+// frame is found with at most one more (its chunk), however long the file
+// is. A file that wasn't closed can still be opened by following the
+// chunks from the first one (its last partial chunk is lost).
+//
+// A payload holds the pixels followed by the audio, each padded to the
+// alignment.
+class FrameFile final
+{
+public:
+
+    static const uint32_t Magic = 0x46544c44;      // "DLTF"
+    static const uint32_t ChunkMagic = 0x4b434843; // "CHCK"
+    static const uint32_t Version = 1;
+    static const uint32_t ChunkFrames = 255;       // 16 KB chunks
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t alignment;
+        uint32_t chunkFrames;
+        uint32_t audioChannels;   // Audio format of the payloads
+        uint32_t audioSampleType;
+        int64_t timeScale;        // Units of the capture times
+        uint64_t frameCount;      // Set on close
+        uint64_t chunkCount;      // Set on close
+        uint64_t directoryOffset; // Set on close (zero: not closed)
+    };
+
+    // Index entry of a frame
+    struct Entry
+    {
+        uint64_t offset;      // Payload position in the file
+        uint32_t size;        // Payload size (padded pixels and audio)
+        uint32_t pixelBytes;  // Pixel data (rowBytes * height)
+        uint32_t pixelFormat; // BMDPixelFormat
+        uint32_t displayMode; // BMDDisplayMode of the signal
+        int32_t width;
+        int32_t height;
+        int32_t rowBytes;
+        int32_t audioSampleFrames;
+        int64_t captureTime;  // Hardware reference time (-1: unknown)
+        uint32_t timecode;    // BCD (MemoryBackedFrame::NoTimecode: none)
+        uint32_t reserved[3];
+    };
+
+    struct ChunkHeader
+    {
+        uint32_t magic;
+        uint32_t count;       // Entries in use
+        uint64_t firstFrame;  // Index of the first entry
+        uint64_t nextOffset;  // Next chunk (zero: none yet)
+        uint64_t reserved[5];
+    };
+
+    static_assert(sizeof(Entry) == 64, "index entries are 64 bytes");
+    static_assert(sizeof(ChunkHeader) == sizeof(Entry), "entries follow the chunk header");
+
+    static size_t GetChunkSize()
+    {
+        return RoundUp(sizeof(ChunkHeader) + ChunkFrames * sizeof(Entry));
+    }
+
+    static size_t RoundUp(size_t size)
+    {
+        return (size + Config::recorderAlignment - 1) /
+            Config::recorderAlignment * Config::recorderAlignment;
+    }
+
+    // Padded size of the pixels and the audio of an entry
+    static size_t GetPixelSize(const Entry& entry)
+    {
+        return RoundUp(entry.pixelBytes);
+    }
+
+    static size_t GetAudioSize(const Entry& entry)
+    {
+        return RoundUp(static_cast<size_t>(
+            entry.audioSampleFrames * Utility::GetAudioSampleFrameBytes()
+        ));
+    }
+
+    // Aligned memory for unbuffered I/O
+    static uint8_t* AllocateBuffer(size_t size)
+    {
+        auto buffer = static_cast<uint8_t*>(VirtualAlloc(
+            nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE
+        ));
+        if (buffer == nullptr) throw std::bad_alloc();
+        return buffer;
+    }
+
+    static void FreeBuffer(uint8_t* buffer)
+    {
+        VirtualFree(buffer, 0, MEM_RELEASE);
+    }
+};
+
+// Writing side of a frame file
+//
+// Lays the frames out and keeps the index; the payloads themselves are
+// written by the caller (Recorder) at the offsets handed out, through
+// GetHandle(). The index, the directory and the header are written here
+// synchronously (a 16 KB chunk every FrameFile::ChunkFrames frames).
+class FrameFileWriter final
+{
+public:
+
+    FrameFileWriter()
+        : file_(INVALID_HANDLE_VALUE), offset_(0), chunkOffset_(0), frameCount_(0)
+    {
+        chunk_ = FrameFile::AllocateBuffer(FrameFile::GetChunkSize());
+        std::memset(&overlapped_, 0, sizeof(overlapped_));
+        overlapped_.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        assert(overlapped_.hEvent != nullptr);
+    }
+
+    ~FrameFileWriter()
+    {
+        assert(file_ == INVALID_HANDLE_VALUE); // The file should have been closed.
+        CloseHandle(overlapped_.hEvent);
+        FrameFile::FreeBuffer(chunk_);
+    }
+
+    FrameFileWriter(const FrameFileWriter&) = delete;
+    FrameFileWriter& operator=(const FrameFileWriter&) = delete;
+
+    // Create a file (replacing an existing one) for unbuffered overlapped
+    // writes. Returns false when it can't be created.
+    bool Create(const char* path)
+    {
+        assert(file_ == INVALID_HANDLE_VALUE);
+
+        file_ = CreateFileA(
+            path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED,
+            nullptr
+        );
+        if (file_ == INVALID_HANDLE_VALUE) return false;
+
+        chunkOffsets_.clear();
+        frameCount_ = 0;
+
+        // The header is rewritten on close; the first chunk follows it.
+        offset_ = Config::recorderAlignment;
+        if (!WriteHeader(0)) return Abandon();
+        BeginChunk();
+        return true;
+    }
+
+    // Lay out the next frame: returns the file offset to write its pixels
+    // to, the audio follows at offset + FrameFile::GetPixelSize(entry).
+    // Returns false when the index couldn't be written (the frame is not
+    // recorded).
+    bool AddFrame(MemoryBackedFrame* frame, FrameFile::Entry& entry)
+    {
+        entry.offset = offset_;
+        entry.pixelBytes = static_cast<uint32_t>(frame->GetRowBytes() * frame->GetHeight());
+        entry.pixelFormat = frame->GetPixelFormat();
+        entry.displayMode = frame->GetDisplayMode();
+        entry.width = frame->GetWidth();
+        entry.height = frame->GetHeight();
+        entry.rowBytes = frame->GetRowBytes();
+        entry.audioSampleFrames = frame->GetAudioSampleFrameCount();
+        entry.captureTime = frame->GetCaptureTime();
+        entry.timecode = frame->GetTimecodeBCD();
+        std::memset(entry.reserved, 0, sizeof(entry.reserved));
+        entry.size = static_cast<uint32_t>(
+            FrameFile::GetPixelSize(entry) + FrameFile::GetAudioSize(entry)
+        );
+
+        auto header = GetChunkHeader();
+        if (header->count == FrameFile::ChunkFrames)
+        {
+            // The chunk is full: the next one goes right here, ahead of
+            // the frames it's going to describe.
+            header->nextOffset = offset_;
+            if (!WriteChunk()) return false;
+            BeginChunk();
+            entry.offset = offset_;
+            header = GetChunkHeader();
+        }
+
+        GetEntries()[header->count++] = entry;
+        offset_ += entry.size;
+        frameCount_++;
+        return true;
+    }
+
+    // Write the last chunk, the directory and the header, and close the
+    // file. All the payload writes have to be done. Returns false when the
+    // file couldn't be completed (it can still be opened by following the
+    // chunks).
+    bool Close()
+    {
+        assert(file_ != INVALID_HANDLE_VALUE);
+
+        auto ok = WriteChunk();
+
+        // Directory: the offsets of the chunks
+        auto directory = offset_;
+        auto size = FrameFile::RoundUp(chunkOffsets_.size() * sizeof(uint64_t));
+        auto buffer = FrameFile::AllocateBuffer(size);
+        std::memcpy(buffer, chunkOffsets_.data(), chunkOffsets_.size() * sizeof(uint64_t));
+        ok = ok && Write(buffer, size, directory);
+        FrameFile::FreeBuffer(buffer);
+
+        ok = ok && WriteHeader(directory);
+
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+        return ok;
+    }
+
+    HANDLE GetHandle() const
+    {
+        return file_;
+    }
+
+    uint64_t CountFrames() const
+    {
+        return frameCount_;
+    }
+
+private:
+
+    HANDLE file_;
+    uint64_t offset_;      // End of the laid out part
+    uint64_t chunkOffset_; // Position of the chunk being filled
+    uint64_t frameCount_;
+    uint8_t* chunk_;       // Chunk being filled
+    std::vector<uint64_t> chunkOffsets_;
+    OVERLAPPED overlapped_;
+
+    FrameFile::ChunkHeader* GetChunkHeader()
+    {
+        return reinterpret_cast<FrameFile::ChunkHeader*>(chunk_);
+    }
+
+    FrameFile::Entry* GetEntries()
+    {
+        return reinterpret_cast<FrameFile::Entry*>(chunk_ + sizeof(FrameFile::ChunkHeader));
+    }
+
+    // Reserve the room for the next chunk at the current offset.
+    void BeginChunk()
+    {
+        std::memset(chunk_, 0, FrameFile::GetChunkSize());
+        auto header = GetChunkHeader();
+        header->magic = FrameFile::ChunkMagic;
+        header->firstFrame = frameCount_;
+
+        chunkOffset_ = offset_;
+        chunkOffsets_.push_back(chunkOffset_);
+        offset_ += FrameFile::GetChunkSize();
+    }
+
+    bool WriteChunk()
+    {
+        return Write(chunk_, FrameFile::GetChunkSize(), chunkOffset_);
+    }
+
+    bool WriteHeader(uint64_t directory)
+    {
+        auto buffer = FrameFile::AllocateBuffer(Config::recorderAlignment);
+        auto header = reinterpret_cast<FrameFile::Header*>(buffer);
+        header->magic = FrameFile::Magic;
+        header->version = FrameFile::Version;
+        header->alignment = static_cast<uint32_t>(Config::recorderAlignment);
+        header->chunkFrames = FrameFile::ChunkFrames;
+        header->audioChannels = Config::audioChannels;
+        header->audioSampleType = Config::audioSampleType;
+        header->timeScale = Config::clockTimeScale;
+        header->frameCount = directory != 0 ? frameCount_ : 0;
+        header->chunkCount = directory != 0 ? chunkOffsets_.size() : 0;
+        header->directoryOffset = directory;
+
+        auto ok = Write(buffer, Config::recorderAlignment, 0);
+        FrameFile::FreeBuffer(buffer);
+        return ok;
+    }
+
+    // Synchronous write of an aligned block
+    bool Write(const void* data, size_t size, uint64_t offset)
+    {
+        overlapped_.Offset = static_cast<DWORD>(offset);
+        overlapped_.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD written;
+        if (!WriteFile(file_, data, static_cast<DWORD>(size), nullptr, &overlapped_) &&
+            GetLastError() != ERROR_IO_PENDING) return false;
+        return GetOverlappedResult(file_, &overlapped_, &written, TRUE) && written == size;
+    }
+
+    bool Abandon()
+    {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+        return false;
+    }
+};
+
+// Reading side of a frame file
+//
+// Keeps the directory and the chunk last looked at in memory, so reading
+// the frames in order only touches the index once per chunk. All reads
+// are unbuffered and positioned (the handle has no current position to
+// keep), from a single thread.
+class FrameFileReader final
+{
+public:
+
+    FrameFileReader()
+        : file_(INVALID_HANDLE_VALUE), frameCount_(0), chunkIndex_(SIZE_MAX), header_()
+    {
+        chunk_ = FrameFile::AllocateBuffer(FrameFile::GetChunkSize());
+    }
+
+    ~FrameFileReader()
+    {
+        if (file_ != INVALID_HANDLE_VALUE) Close();
+        FrameFile::FreeBuffer(chunk_);
+    }
+
+    FrameFileReader(const FrameFileReader&) = delete;
+    FrameFileReader& operator=(const FrameFileReader&) = delete;
+
+    // Open a file and load its directory. Returns false when it can't be
+    // opened or isn't a frame file.
+    bool Open(const char* path)
+    {
+        assert(file_ == INVALID_HANDLE_VALUE);
+
+        file_ = CreateFileA(
+            path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr
+        );
+        if (file_ == INVALID_HANDLE_VALUE) return false;
+
+        auto buffer = FrameFile::AllocateBuffer(Config::recorderAlignment);
+        auto ok = Read(buffer, Config::recorderAlignment, 0);
+        std::memcpy(&header_, buffer, sizeof(header_));
+        FrameFile::FreeBuffer(buffer);
+
+        ok = ok &&
+            header_.magic == FrameFile::Magic &&
+            header_.version == FrameFile::Version &&
+            header_.alignment == Config::recorderAlignment &&
+            header_.chunkFrames == FrameFile::ChunkFrames;
+
+        chunkOffsets_.clear();
+        chunkIndex_ = SIZE_MAX;
+        if (ok) ok = header_.directoryOffset != 0 ? LoadDirectory() : Recover();
+
+        if (!ok)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+        frameCount_ = 0;
+    }
+
+    uint64_t CountFrames() const
+    {
+        return frameCount_;
+    }
+
+    // True when the audio in the file is in the configured format (it's
+    // left out otherwise)
+    bool HasCompatibleAudio() const
+    {
+        return
+            header_.audioChannels == static_cast<uint32_t>(Config::audioChannels) &&
+            header_.audioSampleType == static_cast<uint32_t>(Config::audioSampleType);
+    }
+
+    // Look up the index entry of a frame (reading its chunk unless it's
+    // the one already loaded).
+    bool GetEntry(uint64_t index, FrameFile::Entry& entry)
+    {
+        if (index >= frameCount_) return false;
+
+        auto chunk = static_cast<size_t>(index / FrameFile::ChunkFrames);
+        if (chunk != chunkIndex_)
+        {
+            if (!Read(chunk_, FrameFile::GetChunkSize(), chunkOffsets_[chunk]))
+            {
+                chunkIndex_ = SIZE_MAX;
+                return false;
+            }
+            chunkIndex_ = chunk;
+        }
+
+        auto entries = reinterpret_cast<const FrameFile::Entry*>(chunk_ + sizeof(FrameFile::ChunkHeader));
+        entry = entries[index % FrameFile::ChunkFrames];
+        return true;
+    }
+
+    // Read the pixels of a frame into aligned memory of at least
+    // FrameFile::GetPixelSize(entry) bytes.
+    bool ReadPixels(const FrameFile::Entry& entry, void* memory)
+    {
+        return Read(memory, FrameFile::GetPixelSize(entry), entry.offset);
+    }
+
+    // Read the audio of a frame into aligned memory of at least
+    // FrameFile::GetAudioSize(entry) bytes.
+    bool ReadAudio(const FrameFile::Entry& entry, void* memory)
+    {
+        return Read(
+            memory, FrameFile::GetAudioSize(entry),
+            entry.offset + FrameFile::GetPixelSize(entry)
+        );
+    }
+
+private:
+
+    HANDLE file_;
+    uint64_t frameCount_;
+    std::vector<uint64_t> chunkOffsets_;
+    size_t chunkIndex_; // Chunk in the buffer (SIZE_MAX: none)
+    uint8_t* chunk_;
+    FrameFile::Header header_;
+
+    bool LoadDirectory()
+    {
+        auto count = static_cast<size_t>(header_.chunkCount);
+        auto size = FrameFile::RoundUp(count * sizeof(uint64_t));
+        if (count == 0 || header_.frameCount > count * FrameFile::ChunkFrames) return false;
+
+        auto buffer = FrameFile::AllocateBuffer(size);
+        auto ok = Read(buffer, size, header_.directoryOffset);
+        if (ok)
+        {
+            auto offsets = reinterpret_cast<const uint64_t*>(buffer);
+            chunkOffsets_.assign(offsets, offsets + count);
+            frameCount_ = header_.frameCount;
+        }
+        FrameFile::FreeBuffer(buffer);
+        return ok;
+    }
+
+    // Rebuild the directory of a file that wasn't closed, by following the
+    // chain of the chunks that were completed.
+    bool Recover()
+    {
+        frameCount_ = 0;
+        auto header = reinterpret_cast<const FrameFile::ChunkHeader*>(chunk_);
+        for (uint64_t offset = Config::recorderAlignment; offset != 0; offset = header->nextOffset)
+        {
+            if (!Read(chunk_, FrameFile::GetChunkSize(), offset) ||
+                header->magic != FrameFile::ChunkMagic ||
+                header->count == 0 ||
+                header->firstFrame != frameCount_) break;
+
+            chunkOffsets_.push_back(offset);
+            frameCount_ += header->count;
+        }
+        return true;
+    }
+
+    // Synchronous positioned read of an aligned block
+    bool Read(void* memory, size_t size, uint64_t offset)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD read;
+        return ReadFile(file_, memory, static_cast<DWORD>(size), &read, &overlapped) &&
+            read == size;
+    }
+};
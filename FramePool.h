@@ -0,0 +1,167 @@
+#pragma once
+
+#include "Common.h"
+#include "MemoryBackedFrame.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Pool of recycled frames keyed by (width, height, pixel format)
+class FramePool final : public FrameRecycler
+{
+public:
+
+    // Usage statistics
+    struct Stats
+    {
+        uint64_t hits;       // Acquisitions served from the pool
+        uint64_t misses;     // Acquisitions that allocated a new frame
+        size_t outstanding;  // Frames currently handed out
+        size_t highWater;    // Maximum number of outstanding frames
+    };
+
+    // Constructor/destructor
+
+    FramePool()
+        : refCount_(1), stats_()
+    {
+    }
+
+    ~FramePool()
+    {
+        // All the frames should have been returned.
+        assert(stats_.outstanding == 0);
+        Trim();
+    }
+
+    // Public methods
+
+    MemoryBackedFrame* Acquire(long width, long height, BMDPixelFormat format)
+    {
+        // Keep the pool alive while the frame is out.
+        AddRef();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (++stats_.outstanding > stats_.highWater)
+                stats_.highWater = stats_.outstanding;
+
+            auto& bucket = FindBucket(width, height, format);
+            if (!bucket.frames.empty())
+            {
+                // Reuse an idle frame. Its reference count is zero at
+                // this point, so a single AddRef revives it.
+                auto frame = bucket.frames.back();
+                bucket.frames.pop_back();
+                stats_.hits++;
+                frame->AddRef();
+                return frame;
+            }
+
+            stats_.misses++;
+        }
+
+        // Allocate a new frame outside the lock.
+        return new MemoryBackedFrame(width, height, format, this);
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // Make sure there are at least the given number of idle frames of a
+    // kind, so the first acquisitions in a new format don't allocate.
+    void Reserve(long width, long height, BMDPixelFormat format, size_t count)
+    {
+        size_t idle;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            idle = FindBucket(width, height, format).frames.size();
+        }
+
+        for (; idle < count; idle++)
+        {
+            // Bring the new frame in through the usual recycling path, so
+            // it's idle (zero references) like the others.
+            AddRef();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.outstanding++;
+            }
+            (new MemoryBackedFrame(width, height, format, this))->Release();
+        }
+    }
+
+    // Dispose all the idle frames (e.g. after a format change).
+    void Trim()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& bucket : buckets_)
+        {
+            for (auto frame : bucket.frames) delete frame;
+            bucket.frames.clear();
+        }
+        buckets_.clear();
+    }
+
+    // Reference counting (same semantics as the COM objects)
+
+    ULONG AddRef()
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release()
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // FrameRecycler implementation
+
+    void RecycleFrame(MemoryBackedFrame* frame) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.outstanding--;
+            FindBucket(
+                frame->GetWidth(), frame->GetHeight(), frame->GetPixelFormat()
+            ).frames.push_back(frame);
+        }
+
+        // Drop the reference taken in Acquire.
+        Release();
+    }
+
+private:
+
+    struct Bucket
+    {
+        long width;
+        long height;
+        BMDPixelFormat format;
+        std::vector<MemoryBackedFrame*> frames;
+    };
+
+    std::atomic<ULONG> refCount_;
+    std::vector<Bucket> buckets_;
+    Stats stats_;
+    mutable std::mutex mutex_;
+
+    // Find a bucket for the given key (needs the lock).
+    // There are only a few formats alive at once, so a linear search is fine.
+    Bucket& FindBucket(long width, long height, BMDPixelFormat format)
+    {
+        for (auto& bucket : buckets_)
+            if (bucket.width == width &&
+                bucket.height == height &&
+                bucket.format == format) return bucket;
+
+        buckets_.push_back(Bucket{ width, height, format, {} });
+        return buckets_.back();
+    }
+};
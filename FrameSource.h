@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Common.h"
+#include "MemoryBackedFrame.h"
+
+// Source of the frames a sender plays out
+//
+// Frames are pulled from the output completion callback, so retrieving
+// them must never block: a source prepares its frames ahead (a receiver,
+// a read-ahead thread etc.) and only hands them over here. There is a
+// single consumer per source.
+class FrameSource
+{
+public:
+
+    virtual ~FrameSource() {}
+
+    // Retrieve the next frame if there is one ready. The reference goes
+    // to the caller.
+    virtual bool TryPopFrame(MemoryBackedFrame*& frame) = 0;
+
+    // Number of frames ready to be retrieved
+    virtual size_t CountQueuedFrames() = 0;
+
+    // True when the frames come in at the pace of an input clock, so the
+    // output has to keep the latency and the clock drift in check. Sources
+    // that are read as fast as they're played out (files) aren't live.
+    virtual bool IsLive() const = 0;
+
+    // Reference clock time of the last input format change (in
+    // Config::clockTimeScale units), or -1 if unknown
+    virtual BMDTimeValue GetModeChangeTime() const
+    {
+        return -1;
+    }
+
+    // Reference counting (same semantics as the COM objects)
+    virtual ULONG AddRef() = 0;
+    virtual ULONG Release() = 0;
+};
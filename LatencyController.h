@@ -0,0 +1,220 @@
+#pragma once
+
+#include "Common.h"
+#include <algorithm>
+#include <vector>
+
+// Adaptive latency controller for the output stage
+//
+// Tracks the pipeline depth (input queue + frames buffered in the output)
+// over a sliding window of completions and steers it toward a target
+// latency. The target starts at the minimum, is raised when the output
+// reports late/dropped frames and slowly lowered again after a long run
+// without them, so it settles on the lowest latency that is stable.
+//
+// Once the clock drift between the input and the output has been measured,
+// the controller corrects for it on its own schedule: the surplus (or
+// shortage) of input frames is integrated into a phase, and a frame is
+// dropped or repeated each time it amounts to a whole frame. The depth
+// rules then only act when a whole window agrees (or the output is about to
+// run dry), so queue jitter no longer triggers corrections, and the time of
+// the next repeat is known in advance.
+class LatencyController final
+{
+public:
+
+    enum class Action
+    {
+        Keep,   // Schedule one frame as usual
+        Drop,   // Remove one frame of latency
+        Repeat  // Add one frame of latency
+    };
+
+    // Usage statistics
+    struct Stats
+    {
+        int target;       // Current target latency in frames
+        size_t depth;     // Last observed pipeline depth in frames
+        uint64_t drops;   // Drop decisions
+        uint64_t repeats; // Repeat decisions
+        uint64_t errors;  // Late/dropped completions
+        uint64_t driftDrops;   // ... of which were made for the clock drift
+        uint64_t driftRepeats;
+        size_t minDepth;  // Pipeline depth range while the drift is known
+        size_t maxDepth;
+    };
+
+    // Constructor
+
+    LatencyController(int minTarget, int maxTarget, int window)
+        : minTarget_(minTarget), maxTarget_(maxTarget),
+          window_(static_cast<size_t>(window)), cursor_(0), filled_(0),
+          cleanCount_(0), driftKnown_(false), drift_(0), phase_(0), stats_()
+    {
+        assert(minTarget > 0 && minTarget <= maxTarget && window > 0);
+        history_.resize(window_);
+        stats_.target = minTarget;
+    }
+
+    // Public methods
+
+    int GetTarget() const
+    {
+        return stats_.target;
+    }
+
+    Stats GetStats() const
+    {
+        return stats_;
+    }
+
+    // Set the measured surplus of input frames per output slot.
+    void SetDrift(double drift)
+    {
+        driftKnown_ = true;
+        drift_ = drift;
+    }
+
+    // True when the drift is going to call for a repeat within the given
+    // number of slots.
+    bool IsRepeatDue(int slots) const
+    {
+        return drift_ < 0 && phase_ + drift_ * slots <= -1;
+    }
+
+    // Feed a completion and get the action for the frame scheduled next.
+    // The output buffer count is the one seen by the completion callback,
+    // which doesn't include the slot the completion frees up.
+    Action Update(
+        size_t inputDepth, size_t outputBuffered,
+        BMDOutputFrameCompletionResult result
+    )
+    {
+        // The slot about to be filled counts toward the depth: without it a
+        // pipeline right on the target would look a frame short at every
+        // completion and settle one frame above the target.
+        auto depth = inputDepth + outputBuffered + 1;
+        stats_.depth = depth;
+
+        if (result == bmdOutputFrameDisplayedLate || result == bmdOutputFrameDropped)
+        {
+            // The output couldn't keep up: allow one more frame of latency
+            // and start observing from scratch.
+            stats_.errors++;
+            stats_.target = (std::min)(stats_.target + 1, maxTarget_);
+            cleanCount_ = 0;
+            ClearHistory();
+        }
+        else if (++cleanCount_ >= window_ * RelaxWindows)
+        {
+            // A long clean run: try one frame less.
+            stats_.target = (std::max)(stats_.target - 1, minTarget_);
+            cleanCount_ = 0;
+            ClearHistory();
+        }
+
+        auto target = static_cast<size_t>(stats_.target);
+
+        if (!driftKnown_)
+        {
+            // Below the target the output is about to underrun; act right away.
+            if (depth < target)
+            {
+                stats_.repeats++;
+                ClearHistory();
+                return Action::Repeat;
+            }
+        }
+        else
+        {
+            // The range starts with the first sample.
+            if (stats_.maxDepth == 0) stats_.minDepth = depth;
+            stats_.minDepth = (std::min)(stats_.minDepth, depth);
+            stats_.maxDepth = (std::max)(stats_.maxDepth, depth);
+
+            phase_ += drift_;
+            if (phase_ > MaxPhase) phase_ = MaxPhase;
+            if (phase_ < -MaxPhase) phase_ = -MaxPhase;
+
+            // A whole frame of surplus/shortage has built up from the drift
+            // (unless the queue says otherwise).
+            if (phase_ >= 1 && depth >= target)
+            {
+                phase_ -= 1;
+                stats_.drops++;
+                stats_.driftDrops++;
+                ClearHistory();
+                return Action::Drop;
+            }
+
+            if (phase_ <= -1 && depth <= target)
+            {
+                phase_ += 1;
+                stats_.repeats++;
+                stats_.driftRepeats++;
+                ClearHistory();
+                return Action::Repeat;
+            }
+
+            // Two frames short: the output is about to underrun.
+            if (depth + 1 < target)
+            {
+                stats_.repeats++;
+                ClearHistory();
+                return Action::Repeat;
+            }
+        }
+
+        history_[cursor_] = depth;
+        cursor_ = (cursor_ + 1) % window_;
+        filled_ = (std::min)(filled_ + 1, window_);
+
+        // Only shed latency when it has stayed above the target for the
+        // whole window, so short bursts of jitter are absorbed.
+        if (filled_ == window_ &&
+            *std::min_element(history_.begin(), history_.end()) > target)
+        {
+            stats_.drops++;
+            ClearHistory();
+            return Action::Drop;
+        }
+
+        // The same goes for adding latency once the drift is taken care of.
+        if (driftKnown_ && filled_ == window_ &&
+            *std::max_element(history_.begin(), history_.end()) < target)
+        {
+            stats_.repeats++;
+            ClearHistory();
+            return Action::Repeat;
+        }
+
+        return Action::Keep;
+    }
+
+private:
+
+    // Number of clean windows before the target is lowered
+    static const size_t RelaxWindows = 10;
+
+    // Limit of the drift phase (in frames) while the queue holds back a
+    // correction
+    static constexpr double MaxPhase = 2;
+
+    int minTarget_;
+    int maxTarget_;
+    size_t window_;
+    std::vector<size_t> history_;
+    size_t cursor_;
+    size_t filled_;
+    size_t cleanCount_;
+    bool driftKnown_;
+    double drift_;
+    double phase_; // Surplus frames not corrected yet
+    Stats stats_;
+
+    void ClearHistory()
+    {
+        cursor_ = 0;
+        filled_ = 0;
+    }
+};
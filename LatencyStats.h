@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Common.h"
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+// End-to-end latency statistics over successive windows of frames
+//
+// Samples are pairs of timestamps on a common clock, so the class doesn't
+// care whether they come from the hardware or from a fake clock. The
+// writer collects a window of samples and publishes a summary when the
+// window is full; readers only ever copy the last published summary.
+class LatencyStats final
+{
+public:
+
+    // Summary of a window (in the time scale of the samples)
+    struct Snapshot
+    {
+        uint64_t windows; // Number of windows published so far
+        size_t count;     // Samples in the last window
+        BMDTimeValue min;
+        BMDTimeValue avg;
+        BMDTimeValue p50;
+        BMDTimeValue p90;
+        BMDTimeValue p99;
+        BMDTimeValue max;
+    };
+
+    // Constructor
+
+    explicit LatencyStats(size_t window)
+        : snapshot_()
+    {
+        assert(window > 0);
+        samples_.reserve(window);
+        sorted_.reserve(window);
+    }
+
+    // Public methods
+
+    // Add a sample (writer thread only).
+    void Add(BMDTimeValue captureTime, BMDTimeValue completionTime)
+    {
+        samples_.push_back(completionTime - captureTime);
+        if (samples_.size() == samples_.capacity()) Publish();
+    }
+
+    // Publish a partially filled window (writer thread, or once the
+    // writer has stopped).
+    void Flush()
+    {
+        if (!samples_.empty()) Publish();
+    }
+
+    Snapshot GetSnapshot() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return snapshot_;
+    }
+
+private:
+
+    std::vector<BMDTimeValue> samples_;
+    std::vector<BMDTimeValue> sorted_;
+    Snapshot snapshot_;
+    mutable std::mutex mutex_;
+
+    void Publish()
+    {
+        sorted_.assign(samples_.begin(), samples_.end());
+        std::sort(sorted_.begin(), sorted_.end());
+        samples_.clear();
+
+        BMDTimeValue sum = 0;
+        for (auto value : sorted_) sum += value;
+
+        auto n = sorted_.size();
+        Snapshot snapshot;
+        snapshot.count = n;
+        snapshot.min = sorted_.front();
+        snapshot.avg = sum / static_cast<BMDTimeValue>(n);
+        snapshot.p50 = sorted_[(n * 50 + 99) / 100 - 1];
+        snapshot.p90 = sorted_[(n * 90 + 99) / 100 - 1];
+        snapshot.p99 = sorted_[(n * 99 + 99) / 100 - 1];
+        snapshot.max = sorted_.back();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        snapshot.windows = snapshot_.windows + 1;
+        snapshot_ = snapshot;
+    }
+};
@@ -1,19 +1,224 @@
 #pragma once
 
 #include "Common.h"
+#include "Platform.h"
+#include <algorithm>
 #include <atomic>
+#include <cstring>
+#include <new>
 #include <vector>
 
+class MemoryBackedFrame;
+
+// Interface for objects that take back frames on their final release
+class FrameRecycler
+{
+public:
+    virtual void RecycleFrame(MemoryBackedFrame* frame) = 0;
+};
+
+// Video frame in memory of its own
+//
+// The pixels live in a page-aligned allocation padded to whole pages, so
+// a frame can be handed to unbuffered file I/O as it is (see Recorder).
+// A frame can also be a view of memory owned by someone else (see
+// Timeshift).
 class MemoryBackedFrame final : public IDeckLinkVideoFrame
 {
 public:
 
-    MemoryBackedFrame(long width, long height)
-        : refCount_(1)
+    static const BMDTimecodeBCD NoTimecode = 0xffffffff;
+
+    MemoryBackedFrame(
+        long width, long height,
+        BMDPixelFormat format = bmdFormat8BitARGB,
+        FrameRecycler* recycler = nullptr
+    )
+        : refCount_(1), recycler_(recycler), captureTime_(-1),
+          displayMode_(bmdModeUnknown), generation_(0), queueTime_(0), timecode_(NoTimecode),
+          audioSampleFrames_(0)
+    {
+        width_ = width;
+        height_ = height;
+        format_ = format;
+        rowBytes_ = Utility::GetRowBytes(format, width);
+        pixelWords_ = static_cast<std::size_t>(rowBytes_) * height_ / sizeof(uint32_t);
+        memorySize_ = (pixelWords_ * sizeof(uint32_t) + PageSize - 1) / PageSize * PageSize;
+        memory_ = static_cast<uint32_t*>(Platform::AllocatePages(memorySize_));
+        if (memory_ == nullptr) throw std::bad_alloc();
+        ownsMemory_ = true;
+
+        // Room for the audio that comes with a frame, so attaching it never
+        // allocates.
+        audio_.reserve(static_cast<std::size_t>(
+            Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()
+        ));
+    }
+
+    // View of external pixel memory, which has to outlive the frame. The
+    // memory size is just the pixels unless given (e.g. the whole pages of
+    // a capture buffer, so the view can be written unbuffered).
+    MemoryBackedFrame(
+        long width, long height, BMDPixelFormat format,
+        void* memory, FrameRecycler* recycler, std::size_t memorySize = 0
+    )
+        : refCount_(1), recycler_(recycler), captureTime_(-1),
+          displayMode_(bmdModeUnknown), generation_(0), queueTime_(0), timecode_(NoTimecode),
+          audioSampleFrames_(0)
     {
         width_ = width;
         height_ = height;
-        memory_.resize(static_cast<std::size_t>(width_) * height_);
+        format_ = format;
+        rowBytes_ = Utility::GetRowBytes(format, width);
+        pixelWords_ = static_cast<std::size_t>(rowBytes_) * height_ / sizeof(uint32_t);
+        memorySize_ = (std::max)(pixelWords_ * sizeof(uint32_t), memorySize);
+        memory_ = static_cast<uint32_t*>(memory);
+        ownsMemory_ = false;
+
+        audio_.reserve(static_cast<std::size_t>(
+            Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()
+        ));
+    }
+
+    ~MemoryBackedFrame()
+    {
+        if (ownsMemory_) Platform::FreePages(memory_, memorySize_);
+    }
+
+    // Public methods
+
+    // Size of the pixel memory (rowBytes * height rounded up to pages; as
+    // given for a view)
+    std::size_t GetMemorySize() const
+    {
+        return memorySize_;
+    }
+
+    // Copy the pixels of another frame in the same format.
+    void CopyFrom(IDeckLinkVideoFrame* source)
+    {
+        assert(source->GetPixelFormat() == format_);
+        assert(source->GetWidth() == width_ && source->GetHeight() == height_);
+
+        void* bytes;
+        AssertSuccess(source->GetBytes(&bytes));
+
+        auto src = static_cast<const uint8_t*>(bytes);
+        auto dst = reinterpret_cast<uint8_t*>(memory_);
+        auto srcRowBytes = source->GetRowBytes();
+
+        if (srcRowBytes == rowBytes_)
+        {
+            std::memcpy(dst, src, static_cast<std::size_t>(rowBytes_) * height_);
+        }
+        else
+        {
+            auto size = static_cast<std::size_t>((std::min)(srcRowBytes, rowBytes_));
+            for (long row = 0; row < height_; row++)
+                std::memcpy(dst + rowBytes_ * row, src + srcRowBytes * row, size);
+        }
+    }
+
+    // Hardware reference time of the capture (-1 when unknown)
+    BMDTimeValue GetCaptureTime() const
+    {
+        return captureTime_;
+    }
+
+    void SetCaptureTime(BMDTimeValue time)
+    {
+        captureTime_ = time;
+    }
+
+    // Display mode of the signal the frame was captured from
+    // (bmdModeUnknown when there was no valid signal)
+    BMDDisplayMode GetDisplayMode() const
+    {
+        return displayMode_;
+    }
+
+    void SetDisplayMode(BMDDisplayMode mode)
+    {
+        displayMode_ = mode;
+    }
+
+    // Input format generation the frame belongs to (bumped by the receiver
+    // on every format change)
+    uint32_t GetGeneration() const
+    {
+        return generation_;
+    }
+
+    void SetGeneration(uint32_t generation)
+    {
+        generation_ = generation;
+    }
+
+    // StageTimer::Now() value when the frame was queued for the outputs
+    int64_t GetQueueTime() const
+    {
+        return queueTime_;
+    }
+
+    void SetQueueTime(int64_t time)
+    {
+        queueTime_ = time;
+    }
+
+    // SMPTE timecode of the frame in BCD (NoTimecode when the signal had
+    // none)
+    BMDTimecodeBCD GetTimecodeBCD() const
+    {
+        return timecode_;
+    }
+
+    void SetTimecodeBCD(BMDTimecodeBCD timecode)
+    {
+        timecode_ = timecode;
+    }
+
+    // Audio captured together with the frame (in the configured format)
+    const void* GetAudioBytes() const
+    {
+        return audio_.data();
+    }
+
+    long GetAudioSampleFrameCount() const
+    {
+        return audioSampleFrames_;
+    }
+
+    void SetAudio(const void* data, long sampleFrames)
+    {
+        auto bytes = static_cast<const uint8_t*>(data);
+        auto size = static_cast<std::size_t>(sampleFrames * Utility::GetAudioSampleFrameBytes());
+        audio_.assign(bytes, bytes + size);
+        audioSampleFrames_ = sampleFrames;
+    }
+
+    void ClearAudio()
+    {
+        audio_.clear();
+        audioSampleFrames_ = 0;
+    }
+
+    // Fill the frame with black in its pixel format.
+    void FillBlack()
+    {
+        switch (format_)
+        {
+        case bmdFormat10BitYUV:
+            // Y = 64, Cb = Cr = 512 in the v210 word layout.
+            for (std::size_t i = 0; i < pixelWords_; i++)
+                memory_[i] = (i & 1) ? 0x04080040u : 0x20010200u;
+            break;
+        case bmdFormat8BitYUV:
+            std::fill(memory_, memory_ + pixelWords_, 0x10801080u);
+            break;
+        default:
+            std::fill(memory_, memory_ + pixelWords_, 0u);
+            break;
+        }
     }
 
     // IUnknown implementation
@@ -46,7 +251,14 @@ public:
     ULONG STDMETHODCALLTYPE Release() override
     {
         auto val = refCount_.fetch_sub(1);
-        if (val == 1) delete this;
+        if (val == 1)
+        {
+            // Give the frame back to the recycler if there is one.
+            if (recycler_ != nullptr)
+                recycler_->RecycleFrame(this);
+            else
+                delete this;
+        }
         return val;
     }
 
@@ -64,12 +276,12 @@ public:
 
     long STDMETHODCALLTYPE GetRowBytes() override
     {
-        return width_ * sizeof(uint32_t);
+        return rowBytes_;
     }
 
     BMDPixelFormat STDMETHODCALLTYPE GetPixelFormat() override
     {
-        return bmdFormat8BitARGB;
+        return format_;
     }
 
     BMDFrameFlags STDMETHODCALLTYPE GetFlags() override
@@ -79,7 +291,7 @@ public:
 
     HRESULT STDMETHODCALLTYPE GetBytes(void** buffer)
     {
-        *buffer = memory_.data();
+        *buffer = memory_;
         return S_OK;
     }
 
@@ -95,8 +307,23 @@ public:
 
 private:
 
+    static const std::size_t PageSize = 4096;
+
     std::atomic<ULONG> refCount_;
-    std::vector<uint32_t> memory_;
+    FrameRecycler* recycler_;
+    BMDTimeValue captureTime_;
+    BMDDisplayMode displayMode_;
+    uint32_t generation_;
+    int64_t queueTime_;
+    BMDTimecodeBCD timecode_;
+    uint32_t* memory_;
+    std::size_t pixelWords_;
+    std::size_t memorySize_;
+    bool ownsMemory_;
+    std::vector<uint8_t> audio_;
+    long audioSampleFrames_;
     long width_;
     long height_;
+    long rowBytes_;
+    BMDPixelFormat format_;
 };
\ No newline at end of file
@@ -0,0 +1,415 @@
+#pragma once
+
+#include "Common.h"
+#include "EventLog.h"
+#include "RingBuffer.h"
+#include "StageTimer.h"
+#include "V210Converter.h"
+#include "WorkerPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+//
+// Microbenchmarks of the pipeline building blocks
+//
+// Where the loopback benchmark (Benchmark.h) measures the whole pipeline,
+// these scenarios measure one component in isolation against the
+// alternative it replaced, and write the results as JSON. Run with
+// --benchmark --scenario=<name>.
+//
+class Microbenchmark final
+{
+public:
+
+    // Returns false when there's no such scenario.
+    static bool Run(const char* scenario, FILE* stream)
+    {
+        if (std::strcmp(scenario, "ringbuffer") == 0)
+            RunRingBuffer(stream);
+        else if (std::strcmp(scenario, "v210") == 0)
+            RunV210(stream);
+        else if (std::strcmp(scenario, "conversion-scaling") == 0)
+            RunConversionScaling(stream);
+        else if (std::strcmp(scenario, "eventlog") == 0)
+            RunEventLog(stream);
+        else
+            return false;
+        return true;
+    }
+
+private:
+
+    // The receiver's queue before RingBuffer: a mutex-guarded std::queue
+    template <typename T>
+    class LockedQueue final
+    {
+    public:
+
+        bool TryPush(const T& item)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push(item);
+            return true;
+        }
+
+        bool TryPop(T& item)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.empty()) return false;
+            item = queue_.front();
+            queue_.pop();
+            return true;
+        }
+
+    private:
+
+        std::queue<T> queue_;
+        std::mutex mutex_;
+    };
+
+    // Nanoseconds in a time stamp counter interval
+    static double ToNanoseconds(int64_t ticks)
+    {
+        return ticks / StageTimer::GetTicksPerNanosecond();
+    }
+
+    // Ring buffer vs the locked queue: the cost of a push/pop pair on one
+    // thread, the latency of handing a single item over to a consumer
+    // thread (the capture callback -> output case: the queue is nearly
+    // always empty), and the throughput of streaming items through.
+    static void RunRingBuffer(FILE* stream)
+    {
+        std::fprintf(stream, "{\n");
+        std::fprintf(stream, "  \"scenario\": \"ringbuffer\",\n");
+        std::fprintf(stream, "  \"queues\": [\n");
+        {
+            RingBuffer<int64_t> queue(Config::queueCapacity);
+            MeasureQueue("RingBuffer", queue, stream);
+        }
+        std::fprintf(stream, ",\n");
+        {
+            LockedQueue<int64_t> queue;
+            MeasureQueue("LockedQueue", queue, stream);
+        }
+        std::fprintf(stream, "\n  ]\n");
+        std::fprintf(stream, "}\n");
+    }
+
+    template <typename Queue>
+    static void MeasureQueue(const char* name, Queue& queue, FILE* stream)
+    {
+        const int pairs = 1000000;
+        const int handoffs = 100000;
+        const int streamed = 2000000;
+
+        // Push/pop pairs without contention
+        int64_t item = 0;
+        auto begin = StageTimer::Now();
+        for (auto i = 0; i < pairs; i++)
+        {
+            queue.TryPush(i);
+            queue.TryPop(item);
+        }
+        auto pushPop = ToNanoseconds(StageTimer::Now() - begin) / pairs;
+
+        // Handoff: the producer pushes a time stamp and waits for the
+        // consumer to take it before pushing the next one.
+        std::vector<int64_t> latencies(handoffs);
+        std::atomic<int> taken(0);
+        std::thread consumer([&]()
+        {
+            for (auto i = 0; i < handoffs;)
+            {
+                int64_t stamp;
+                if (queue.TryPop(stamp))
+                {
+                    latencies[i++] = StageTimer::Now() - stamp;
+                    taken.store(i, std::memory_order_release);
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        for (auto i = 0; i < handoffs; i++)
+        {
+            queue.TryPush(StageTimer::Now());
+            while (taken.load(std::memory_order_acquire) <= i) std::this_thread::yield();
+        }
+        consumer.join();
+        std::sort(latencies.begin(), latencies.end());
+        int64_t sum = 0;
+        for (auto l : latencies) sum += l;
+
+        // Streaming: as many items as the consumer takes
+        begin = StageTimer::Now();
+        consumer = std::thread([&]()
+        {
+            for (auto i = 0; i < streamed;)
+            {
+                int64_t value;
+                if (queue.TryPop(value))
+                    i++;
+                else
+                    std::this_thread::yield();
+            }
+        });
+        for (auto i = 0; i < streamed; i++)
+            while (!queue.TryPush(i)) std::this_thread::yield();
+        consumer.join();
+        auto seconds = ToNanoseconds(StageTimer::Now() - begin) / 1e9;
+
+        std::fprintf(stream,
+            "    { \"name\": \"%s\", \"pushPopNs\": %.1f, "
+            "\"handoffNs\": { \"avg\": %.0f, \"p50\": %.0f, \"p99\": %.0f, \"max\": %.0f }, "
+            "\"streamMItemsPerSecond\": %.2f }",
+            name, pushPop,
+            ToNanoseconds(sum) / handoffs,
+            ToNanoseconds(latencies[handoffs / 2]),
+            ToNanoseconds(latencies[handoffs * 99 / 100]),
+            ToNanoseconds(latencies.back()),
+            streamed / seconds / 1e6);
+    }
+
+    // v210 -> ARGB conversion throughput of every kernel the CPU supports
+    // on a single thread, at 1080 and 2160 lines (the content doesn't
+    // matter: the conversion has no data dependent branches).
+    static void RunV210(FILE* stream)
+    {
+        struct Size { long width, height; };
+        const Size sizes[] = { { 1920, 1080 }, { 3840, 2160 } };
+
+        V210Converter converter;
+        auto best = converter.GetKernel();
+
+        std::fprintf(stream, "{\n");
+        std::fprintf(stream, "  \"scenario\": \"v210\",\n");
+        std::fprintf(stream, "  \"results\": [\n");
+        for (size_t s = 0; s < 2; s++)
+        {
+            auto& size = sizes[s];
+            auto srcRowBytes = Utility::GetRowBytes(bmdFormat10BitYUV, size.width);
+            auto dstRowBytes = size.width * 4;
+            std::vector<uint8_t> src(static_cast<size_t>(srcRowBytes) * size.height, 0x55);
+            std::vector<uint8_t> dst(static_cast<size_t>(dstRowBytes) * size.height);
+
+            for (auto k = 0; k <= static_cast<int>(best); k++)
+            {
+                auto kernel = static_cast<V210Converter::Kernel>(k);
+                converter.SetKernel(kernel);
+
+                // Whole frames for at least half a second
+                int64_t frames = 0;
+                auto begin = StageTimer::Now();
+                int64_t elapsed;
+                do
+                {
+                    converter.ConvertRows(
+                        src.data(), srcRowBytes, dst.data(), dstRowBytes,
+                        bmdFormat8BitARGB, size.width, size.height, 0, size.height
+                    );
+                    frames++;
+                    elapsed = StageTimer::Now() - begin;
+                }
+                while (ToNanoseconds(elapsed) < 5e8);
+
+                auto seconds = ToNanoseconds(elapsed) / 1e9;
+                std::fprintf(stream,
+                    "    { \"width\": %ld, \"height\": %ld, \"kernel\": \"%s\", "
+                    "\"msPerFrame\": %.2f, \"mpixPerSecond\": %.1f }%s\n",
+                    size.width, size.height, V210Converter::GetKernelName(kernel),
+                    seconds * 1000 / frames,
+                    static_cast<double>(size.width) * size.height * frames / seconds / 1e6,
+                    s == 1 && k == static_cast<int>(best) ? "" : ",");
+            }
+        }
+        std::fprintf(stream, "  ]\n");
+        std::fprintf(stream, "}\n");
+    }
+
+    // Band-parallel conversion as the receiver runs it (one band per
+    // worker, the best kernel): wall time per frame against the worker
+    // count, up to twice the hardware threads, at 1080 and 2160 lines.
+    // Shows where adding workers stops paying off, and what
+    // oversubscribing the CPU costs.
+    struct ConversionJob
+    {
+        const V210Converter* converter;
+        const uint8_t* src;
+        long srcRowBytes;
+        uint8_t* dst;
+        long dstRowBytes;
+        long width;
+        long height;
+    };
+
+    static void ConvertBand(void* context, int band, int bandCount)
+    {
+        auto job = static_cast<ConversionJob*>(context);
+        job->converter->ConvertRows(
+            job->src, job->srcRowBytes, job->dst, job->dstRowBytes, bmdFormat8BitARGB,
+            job->width, job->height,
+            job->height * band / bandCount, job->height * (band + 1) / bandCount
+        );
+    }
+
+    static void FinishConversion(void*)
+    {
+    }
+
+    static void RunConversionScaling(FILE* stream)
+    {
+        struct Size { long width, height; };
+        const Size sizes[] = { { 1920, 1080 }, { 3840, 2160 } };
+
+        auto threads = static_cast<int>((std::max)(1u, std::thread::hardware_concurrency()));
+        std::vector<int> counts;
+        for (auto n = 1; n <= threads * 2; n *= 2) counts.push_back(n);
+        if (counts.back() != threads * 2) counts.push_back(threads * 2);
+        if (threads * 2 < 4) counts.push_back(4);
+
+        V210Converter converter;
+
+        std::fprintf(stream, "{\n");
+        std::fprintf(stream, "  \"scenario\": \"conversion-scaling\",\n");
+        std::fprintf(stream, "  \"hardwareThreads\": %d,\n", threads);
+        std::fprintf(stream, "  \"kernel\": \"%s\",\n",
+            V210Converter::GetKernelName(converter.GetKernel()));
+        std::fprintf(stream, "  \"results\": [\n");
+        for (size_t s = 0; s < 2; s++)
+        {
+            auto& size = sizes[s];
+            auto srcRowBytes = Utility::GetRowBytes(bmdFormat10BitYUV, size.width);
+            auto dstRowBytes = size.width * 4;
+            std::vector<uint8_t> src(static_cast<size_t>(srcRowBytes) * size.height, 0x55);
+            std::vector<uint8_t> dst(static_cast<size_t>(dstRowBytes) * size.height);
+            ConversionJob job = {
+                &converter, src.data(), srcRowBytes, dst.data(), dstRowBytes,
+                size.width, size.height
+            };
+
+            double single = 0;
+            for (size_t c = 0; c < counts.size(); c++)
+            {
+                WorkerPool workers(counts[c]);
+
+                // Whole frames for at least half a second
+                int64_t frames = 0;
+                auto begin = StageTimer::Now();
+                int64_t elapsed;
+                do
+                {
+                    workers.Dispatch(counts[c], ConvertBand, FinishConversion, &job);
+                    workers.Wait();
+                    frames++;
+                    elapsed = StageTimer::Now() - begin;
+                }
+                while (ToNanoseconds(elapsed) < 5e8);
+
+                auto ms = ToNanoseconds(elapsed) / 1e6 / frames;
+                if (c == 0) single = ms;
+                std::fprintf(stream,
+                    "    { \"width\": %ld, \"height\": %ld, \"workers\": %d, "
+                    "\"msPerFrame\": %.2f, \"speedup\": %.2f }%s\n",
+                    size.width, size.height, counts[c], ms, single / ms,
+                    s == 1 && c + 1 == counts.size() ? "" : ",");
+            }
+        }
+        std::fprintf(stream, "  ]\n");
+        std::fprintf(stream, "}\n");
+    }
+
+    // Callback side cost of logging an event: a write into the ring with
+    // 1, 2 and 4 threads writing at once (in bursts the drain thread keeps
+    // up with, so nothing is lost), a write into a full ring (the event is
+    // dropped), and the fprintf the ring replaced. The records are drained
+    // to a temporary file, and the fprintf goes there too (cheaper than
+    // the console it used to go to).
+    static void RunEventLog(FILE* stream)
+    {
+        const int bursts = 100;
+        const int attempts = 100000;
+        const int threadCounts[] = { 1, 2, 4 };
+        auto sink = std::tmpfile();
+
+        std::fprintf(stream, "{\n");
+        std::fprintf(stream, "  \"scenario\": \"eventlog\",\n");
+        std::fprintf(stream, "  \"capacity\": %d,\n", Config::eventLogCapacity);
+        std::fprintf(stream, "  \"write\": [\n");
+        for (size_t t = 0; t < 3; t++)
+        {
+            auto threads = threadCounts[t];
+            auto perBurst = Config::eventLogCapacity / 4 / threads;
+            auto log = new EventLog(Config::eventLogCapacity, sink);
+
+            // Every thread times its own writes.
+            std::vector<int64_t> ticks(threads);
+            std::vector<std::thread> writers;
+            for (auto i = 0; i < threads; i++)
+            {
+                writers.emplace_back([&, i]()
+                {
+                    for (auto b = 0; b < bursts; b++)
+                    {
+                        auto begin = StageTimer::Now();
+                        for (auto n = 0; n < perBurst; n++)
+                            log->Write(EventLog::EventType::FrameDisplayedLate, i, b * perBurst + n, 2, 3);
+                        ticks[i] += StageTimer::Now() - begin;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(15));
+                    }
+                });
+            }
+            for (auto& writer : writers) writer.join();
+
+            int64_t sum = 0;
+            for (auto tick : ticks) sum += tick;
+            auto writes = static_cast<int64_t>(threads) * bursts * perBurst;
+            std::fprintf(stream,
+                "    { \"threads\": %d, \"writes\": %lld, \"nsPerWrite\": %.1f, \"lost\": %llu }%s\n",
+                threads, static_cast<long long>(writes), ToNanoseconds(sum) / writes,
+                static_cast<unsigned long long>(log->CountLostEvents()),
+                t < 2 ? "," : "");
+            log->Release();
+        }
+        std::fprintf(stream, "  ],\n");
+
+        // Full ring: fill it faster than it's drained, then keep writing.
+        {
+            auto log = new EventLog(Config::eventLogCapacity, sink);
+            for (auto i = 0; i < Config::eventLogCapacity; i++)
+                log->Write(EventLog::EventType::FrameDropped, 0, i, 0, 0);
+            auto lost = log->CountLostEvents();
+            auto begin = StageTimer::Now();
+            for (auto i = 0; i < attempts; i++)
+                log->Write(EventLog::EventType::FrameDropped, 0, i, 0, 0);
+            auto elapsed = StageTimer::Now() - begin;
+            lost = log->CountLostEvents() - lost;
+            std::fprintf(stream,
+                "  \"fullRing\": { \"writes\": %d, \"dropped\": %llu, \"nsPerWrite\": %.1f },\n",
+                attempts, static_cast<unsigned long long>(lost), ToNanoseconds(elapsed) / attempts);
+            log->Release();
+        }
+
+        // The formatted line the callback used to print
+        {
+            auto begin = StageTimer::Now();
+            for (auto i = 0; i < attempts; i++)
+                std::fprintf(sink, "[%lld] #%u %s (frame %llu, in %u, out %u)\n",
+                    static_cast<long long>(i), 0u, "Frame was displayed late",
+                    static_cast<unsigned long long>(i), 2u, 3u);
+            auto elapsed = StageTimer::Now() - begin;
+            std::fprintf(stream, "  \"fprintfNsPerLine\": %.1f\n", ToNanoseconds(elapsed) / attempts);
+        }
+
+        std::fprintf(stream, "}\n");
+        std::fclose(sink);
+    }
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "Common.h"
+#include "StageTimer.h"
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Platform layer of the frame buffer memory
+//
+// Frame buffers (the capture slab, pool frames) are whole pages straight
+// from the OS, optionally large pages, and pinned where possible. This is
+// the only part of the capture/playout path that differs between Windows
+// and POSIX systems. The CPU time of the calling thread (for measurements
+// that mustn't count the time other threads held the CPU) is here too.
+class Platform final
+{
+public:
+
+    static size_t GetPageSize()
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+    // Large page size (zero when the system has none)
+    static size_t GetLargePageSize()
+    {
+#if defined(_WIN32)
+        return GetLargePageMinimum();
+#elif defined(MAP_HUGETLB)
+        return size_t(2) << 20;
+#else
+        return 0;
+#endif
+    }
+
+    // Committed, zero-filled pages (nullptr on failure). Large pages need
+    // a size rounded to GetLargePageSize() and a privilege (Windows) or
+    // reserved huge pages (Linux), so they can fail where small ones
+    // wouldn't.
+    static void* AllocatePages(size_t size, bool largePages = false)
+    {
+#if defined(_WIN32)
+        return VirtualAlloc(
+            nullptr, size,
+            MEM_COMMIT | MEM_RESERVE | (largePages ? MEM_LARGE_PAGES : 0), PAGE_READWRITE
+        );
+#else
+        auto flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_HUGETLB)
+        if (largePages) flags |= MAP_HUGETLB;
+#else
+        if (largePages) return nullptr;
+#endif
+        auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        return memory == MAP_FAILED ? nullptr : memory;
+#endif
+    }
+
+    // Size has to be the one the pages were allocated with.
+    static void FreePages(void* memory, size_t size)
+    {
+#if defined(_WIN32)
+        (void)size;
+        VirtualFree(memory, 0, MEM_RELEASE);
+#else
+        munmap(memory, size);
+#endif
+    }
+
+    // Keep pages resident. This fails when the working set (or the locked
+    // memory limit) is too small; the memory is still usable then.
+    static bool LockPages(void* memory, size_t size)
+    {
+#if defined(_WIN32)
+        return VirtualLock(memory, size) != FALSE;
+#else
+        return mlock(memory, size) == 0;
+#endif
+    }
+
+    static void UnlockPages(void* memory, size_t size)
+    {
+#if defined(_WIN32)
+        VirtualUnlock(memory, size);
+#else
+        munlock(memory, size);
+#endif
+    }
+
+    // CPU time the calling thread has run for, in nanoseconds. On Windows
+    // it's counted in time stamp counter cycles (QueryThreadCycleTime).
+    static uint64_t GetThreadCpuTime()
+    {
+#if defined(_WIN32)
+        ULONG64 cycles;
+        QueryThreadCycleTime(GetCurrentThread(), &cycles);
+        return static_cast<uint64_t>(cycles / StageTimer::GetTicksPerNanosecond());
+#else
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return static_cast<uint64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif
+    }
+};
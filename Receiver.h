@@ -1,33 +1,67 @@
 #pragma once
 
 #include "Common.h"
+#include "CaptureAllocator.h"
+#include "EventLog.h"
+#include "FramePool.h"
+#include "FrameSource.h"
 #include "MemoryBackedFrame.h"
+#include "RingBuffer.h"
+#include "StageTimer.h"
+#include "V210Converter.h"
+#include "WorkerPool.h"
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
-#include <queue>
+#include <thread>
 
 class Receiver final : public IDeckLinkInputCallback
 {
 public:
 
+    // Time spent in the capture callback and in the conversion bands
+    struct StageStats
+    {
+        StageTimer::Stats capture;
+        StageTimer::Stats conversion;
+    };
+
+    // Input format changes
+    struct ModeChangeStats
+    {
+        uint64_t count;          // Format changes (the current generation)
+        uint64_t skippedFrames;  // Frames arrived while switching
+        uint64_t staleFrames;    // Queued frames of an old format discarded
+        StageTimer::Stats switching; // Time spent reconfiguring the input
+    };
+
     // Constructor/destructor
 
-    Receiver()
-        : refCount_(1), input_(nullptr), converter_(nullptr)
+    // The conversion worker count is per receiver (see
+    // GetConversionWorkers).
+    Receiver(EventLog* log, int channel, int conversionWorkers)
+        : refCount_(1), input_(nullptr), log_(log), channel_(channel),
+          overflowCount_(0), displayMode_(bmdModeUnknown), modeChangeTime_(-1),
+          generation_(0), switchPending_(false), skippedCount_(0), staleCount_(0),
+          quit_(false), pendingMode_(bmdModeUnknown),
+          workers_(conversionWorkers),
+          jobSource_(nullptr), jobFrame_(nullptr)
     {
-        // Create a format converter instance.
-        AssertSuccess(CoCreateInstance(
-            CLSID_CDeckLinkVideoConversion, nullptr, CLSCTX_ALL,
-            IID_IDeckLinkVideoConversion, reinterpret_cast<void**>(&converter_)
-        ));
+        log_->AddRef();
+        pool_ = new FramePool();
+        allocator_ = new CaptureAllocator(
+            Config::captureBufferCount, Config::useLargePages
+        );
     }
 
     ~Receiver()
     {
         assert(input_ == nullptr); // The input should have been stopped.
 
-        // Destroy the converter instance.
-        converter_->Release();
+        // The pool stays alive until the last outstanding frame is returned.
+        pool_->Release();
+        allocator_->Release();
+        log_->Release();
     }
 
     // Public methods
@@ -43,12 +77,27 @@ public:
         // Start getting callback from the input object.
         AssertSuccess(input_->SetCallback(this));
 
+        // Let the driver capture into our slab.
+        AssertSuccess(input_->SetVideoInputFrameMemoryAllocator(allocator_));
+
         // Enable the video input with a default video mode
         // (it will be changed by input mode detection).
         AssertSuccess(input_->EnableVideoInput(
             bmdModeNTSC, bmdFormat10BitYUV,
             bmdVideoInputEnableFormatDetection
         ));
+        displayMode_.store(bmdModeNTSC, std::memory_order_relaxed);
+        modeChangeTime_.store(-1, std::memory_order_relaxed);
+
+        // Audio is delivered together with the video frames.
+        if (Config::audioChannels > 0)
+            AssertSuccess(input_->EnableAudioInput(
+                bmdAudioSampleRate48kHz, Config::audioSampleType, Config::audioChannels
+            ));
+
+        // Format changes are carried out on a control thread.
+        quit_ = false;
+        control_ = std::thread(&Receiver::ControlLoop, this);
 
         // Start the input stream.
         AssertSuccess(input_->StartStreams());
@@ -58,37 +107,152 @@ public:
     {
         assert(input_ != nullptr);
 
+        // Let a format change in progress finish and stop the control
+        // thread.
+        {
+            std::lock_guard<std::mutex> lock(controlMutex_);
+            quit_ = true;
+        }
+        controlSignal_.notify_one();
+        control_.join();
+
         // Stop the input stream.
         AssertSuccess(input_->StopStreams());
         AssertSuccess(input_->SetCallback(nullptr));
         AssertSuccess(input_->DisableVideoInput());
+        AssertSuccess(input_->DisableAudioInput());
+        AssertSuccess(input_->SetVideoInputFrameMemoryAllocator(nullptr));
+
+        // Let the in-flight conversion finish.
+        workers_.Wait();
 
         // Dispose all the queued frames.
+        for (auto& output : outputs_) output.Clear();
+
+        // Release the input object.
+        input_->Release();
+        input_ = nullptr;
+    }
+
+    // Conversion workers for each of a number of receivers running at once:
+    // Config::conversionWorkers if set, otherwise the hardware threads shared
+    // out among them (every receiver converts at the same time, once a frame).
+    static int GetConversionWorkers(int receivers)
+    {
+        if (Config::conversionWorkers > 0) return Config::conversionWorkers;
+        auto threads = static_cast<int>((std::max)(1u, std::thread::hardware_concurrency()));
+        return (std::max)(threads / (std::max)(receivers, 1), 1);
+    }
+
+    // Pixel format of the frames in the queue
+    static BMDPixelFormat GetFramePixelFormat()
+    {
+        // Passthrough keeps the captured v210 data as it is.
+        return Config::passthrough ? bmdFormat10BitYUV : bmdFormat8BitARGB;
+    }
+
+    // Start delivering frames to a new output queue. Returns the index
+    // of the queue, or -1 when all of them are in use. Can be called while
+    // receiving; the caller becomes the consumer of the queue.
+    int AttachOutput()
+    {
+        for (auto i = 0; i < Config::maxOutputs; i++)
         {
-            std::lock_guard<std::mutex> lock(mutex_);
-            while (!frameQueue_.empty())
+            auto& output = outputs_[i];
+            auto expected = false;
+            if (output.claimed.compare_exchange_strong(expected, true))
             {
-                frameQueue_.front()->Release();
-                frameQueue_.pop();
+                // Frames left behind by the previous consumer
+                output.Clear();
+                output.active.store(true, std::memory_order_release);
+                return i;
             }
         }
+        return -1;
+    }
 
-        // Release the input object.
-        input_->Release();
-        input_ = nullptr;
+    // Stop delivering frames to an output queue.
+    void DetachOutput(int index)
+    {
+        auto& output = outputs_[index];
+        output.active.store(false, std::memory_order_release);
+        output.Clear();
+        output.claimed.store(false, std::memory_order_release);
+    }
+
+    size_t CountQueuedFrames(int output) const
+    {
+        return outputs_[output].queue.Count();
+    }
+
+    // Number of frames dropped because an output queue was full
+    uint64_t CountOverflowedFrames() const
+    {
+        return overflowCount_.load(std::memory_order_relaxed);
+    }
+
+    // Display mode the input is currently set to
+    BMDDisplayMode GetDisplayMode() const
+    {
+        return displayMode_.load(std::memory_order_relaxed);
+    }
+
+    // Reference clock time (in Config::clockTimeScale units) at which the
+    // last input format change was detected, or -1 if there was none
+    BMDTimeValue GetModeChangeTime() const
+    {
+        return modeChangeTime_.load(std::memory_order_relaxed);
+    }
+
+    ModeChangeStats GetModeChangeStats() const
+    {
+        ModeChangeStats stats;
+        stats.count = generation_.load(std::memory_order_relaxed);
+        stats.skippedFrames = skippedCount_.load(std::memory_order_relaxed);
+        stats.staleFrames = staleCount_.load(std::memory_order_relaxed);
+        stats.switching = switchTimer_.GetStats();
+        return stats;
     }
 
-    size_t CountQueuedFrames() const
+    FramePool::Stats GetPoolStats() const
     {
-        return frameQueue_.size();
+        return pool_->GetStats();
     }
 
-    MemoryBackedFrame* PopFrame()
+    CaptureAllocator::Stats GetCaptureAllocatorStats() const
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto frame = frameQueue_.front();
-        frameQueue_.pop();
-        return frame;
+        return allocator_->GetStats();
+    }
+
+    StageStats GetStageStats() const
+    {
+        StageStats stats;
+        stats.capture = captureTimer_.GetStats();
+        stats.conversion = conversionTimer_.GetStats();
+        return stats;
+    }
+
+    // Start tracking the longest capture callback/conversion over.
+    void ResetStagePeaks()
+    {
+        captureTimer_.ResetPeak();
+        conversionTimer_.ResetPeak();
+    }
+
+    // Retrieve the oldest frame of an output queue. Frames captured before
+    // the last format change are discarded on the way. Returns false when
+    // the queue is empty. Must be called from the consumer of the queue.
+    bool TryPopFrame(int output, MemoryBackedFrame*& frame)
+    {
+        auto& queue = outputs_[output].queue;
+        while (queue.TryPop(frame))
+        {
+            if (frame->GetGeneration() == generation_.load(std::memory_order_acquire))
+                return true;
+            frame->Release();
+            staleCount_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return false;
     }
 
     // IUnknown implementation
@@ -133,15 +297,23 @@ public:
         BMDDetectedVideoInputFormatFlags flags
     ) override
     {
-        // Switch to the notified display mode.
-        input_->PauseStreams();
-        input_->EnableVideoInput(
-            mode->GetDisplayMode(),
-            bmdFormat10BitYUV,
-            bmdVideoInputEnableFormatDetection
-        );
-        input_->FlushStreams();
-        input_->StartStreams();
+        // Note when it happened, so the outputs can measure how long it
+        // takes them to follow.
+        BMDTimeValue time, timeInFrame, ticksPerFrame;
+        if (SUCCEEDED(input_->GetHardwareReferenceClock(
+            Config::clockTimeScale, &time, &timeInFrame, &ticksPerFrame)))
+            modeChangeTime_.store(time, std::memory_order_relaxed);
+
+        // Everything captured so far is in the old format. The switch
+        // itself is left to the control thread, so the driver's callback
+        // thread isn't held up by it.
+        generation_.fetch_add(1, std::memory_order_release);
+        switchPending_.store(true, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(controlMutex_);
+            pendingMode_ = mode->GetDisplayMode();
+        }
+        controlSignal_.notify_one();
         return S_OK;
     }
 
@@ -150,16 +322,72 @@ public:
         IDeckLinkAudioInputPacket* audioPacket
     ) override
     {
+        auto begin = StageTimer::Now();
+
+        // Frames arriving until the input has been switched are in the
+        // wrong format.
+        if (switchPending_.load(std::memory_order_acquire))
+        {
+            skippedCount_.fetch_add(1, std::memory_order_relaxed);
+            captureTimer_.AddSince(begin);
+            return S_OK;
+        }
+
+        // Capture timestamp on the hardware reference clock
+        BMDTimeValue captureTime = -1, duration;
         if (videoFrame != nullptr)
+            videoFrame->GetHardwareReferenceTimestamp(
+                Config::clockTimeScale, &captureTime, &duration
+            );
+
+        if (videoFrame != nullptr && Config::passthrough)
+        {
+            // Push the capture buffer itself to the frame queue (held until
+            // the outputs are done with it). Only a buffer that didn't come
+            // from the slab is copied.
+            auto frame = allocator_->WrapFrame(videoFrame);
+            if (frame == nullptr)
+            {
+                frame = pool_->Acquire(
+                    videoFrame->GetWidth(), videoFrame->GetHeight(),
+                    videoFrame->GetPixelFormat()
+                );
+                frame->CopyFrom(videoFrame);
+            }
+            frame->SetCaptureTime(captureTime);
+            frame->SetDisplayMode(GetFrameDisplayMode(videoFrame));
+            frame->SetTimecodeBCD(GetFrameTimecode(videoFrame));
+            frame->SetGeneration(generation_.load(std::memory_order_relaxed));
+            AttachAudio(frame, audioPacket);
+            PushFrame(frame);
+        }
+        else if (videoFrame != nullptr)
         {
             // Convert and push the arrived frame to the frame queue.
-            auto frame = new MemoryBackedFrame(
-                videoFrame->GetWidth(), videoFrame->GetHeight()
+            auto frame = pool_->Acquire(
+                videoFrame->GetWidth(), videoFrame->GetHeight(),
+                GetFramePixelFormat()
+            );
+            frame->SetCaptureTime(captureTime);
+            frame->SetDisplayMode(GetFrameDisplayMode(videoFrame));
+            frame->SetTimecodeBCD(GetFrameTimecode(videoFrame));
+            frame->SetGeneration(generation_.load(std::memory_order_relaxed));
+            AttachAudio(frame, audioPacket);
+
+            // The previous frame has normally been done long ago.
+            workers_.Wait();
+
+            // Hand the conversion over to the worker pool. The source frame
+            // is kept alive until the last band is done.
+            videoFrame->AddRef();
+            jobSource_ = videoFrame;
+            jobFrame_ = frame;
+            workers_.Dispatch(
+                workers_.GetWorkerCount(), ConvertBand, FinishConversion, this
             );
-            AssertSuccess(converter_->ConvertFrame(videoFrame, frame));
-            std::lock_guard<std::mutex> lock(mutex_);
-            frameQueue_.push(frame);
         }
+
+        captureTimer_.AddSince(begin);
         return S_OK;
     }
 
@@ -167,7 +395,255 @@ private:
 
     std::atomic<ULONG> refCount_;
     IDeckLinkInput* input_;
-    IDeckLinkVideoConversion* converter_;
-    std::queue<MemoryBackedFrame*> frameQueue_;
-    std::mutex mutex_;
+    EventLog* log_;
+    int channel_;
+    V210Converter converter_;
+    FramePool* pool_;
+    CaptureAllocator* allocator_;
+    std::atomic<uint64_t> overflowCount_;
+    std::atomic<BMDDisplayMode> displayMode_;
+    std::atomic<BMDTimeValue> modeChangeTime_;
+    std::atomic<uint32_t> generation_;
+    std::atomic<bool> switchPending_;
+    std::atomic<uint64_t> skippedCount_;
+    std::atomic<uint64_t> staleCount_;
+
+    // Format change handling (control thread)
+    std::thread control_;
+    std::mutex controlMutex_;
+    std::condition_variable controlSignal_;
+    bool quit_;
+    BMDDisplayMode pendingMode_;
+    StageTimer switchTimer_;
+
+    // Per-output frame queue. Every attached output gets a reference to
+    // the same frame, so pixels are never copied for fan-out.
+    struct Output
+    {
+        RingBuffer<MemoryBackedFrame*> queue;
+        std::atomic<bool> claimed; // Owned by a consumer
+        std::atomic<bool> active;  // Being fed by the producer
+
+        Output()
+            : queue(Config::queueCapacity), claimed(false), active(false)
+        {
+        }
+
+        void Clear()
+        {
+            MemoryBackedFrame* frame;
+            while (queue.TryPop(frame)) frame->Release();
+        }
+    };
+
+    Output outputs_[Config::maxOutputs];
+    WorkerPool workers_;
+    IDeckLinkVideoInputFrame* jobSource_;
+    MemoryBackedFrame* jobFrame_;
+    StageTimer captureTimer_;
+    StageTimer conversionTimer_;
+
+    // Conversion job (runs on the worker threads)
+
+    static void ConvertBand(void* context, int band, int bandCount)
+    {
+        auto self = static_cast<Receiver*>(context);
+        auto begin = StageTimer::Now();
+        auto height = self->jobFrame_->GetHeight();
+        self->converter_.ConvertRows(
+            self->jobSource_, self->jobFrame_,
+            height * band / bandCount, height * (band + 1) / bandCount
+        );
+        self->conversionTimer_.AddSince(begin);
+    }
+
+    static void FinishConversion(void* context)
+    {
+        auto self = static_cast<Receiver*>(context);
+        self->jobSource_->Release();
+
+        // Jobs never overlap, so this is still a single producer.
+        self->PushFrame(self->jobFrame_);
+    }
+
+    void ControlLoop()
+    {
+        std::unique_lock<std::mutex> lock(controlMutex_);
+        while (true)
+        {
+            controlSignal_.wait(lock, [this] { return quit_ || pendingMode_ != bmdModeUnknown; });
+            if (quit_) break;
+
+            auto mode = pendingMode_;
+            pendingMode_ = bmdModeUnknown;
+            lock.unlock();
+
+            SwitchMode(mode);
+
+            lock.lock();
+        }
+    }
+
+    // Switch the input to a display mode (control thread).
+    void SwitchMode(BMDDisplayMode mode)
+    {
+        auto begin = StageTimer::Now();
+
+        input_->PauseStreams();
+        input_->EnableVideoInput(
+            mode, bmdFormat10BitYUV, bmdVideoInputEnableFormatDetection
+        );
+        input_->FlushStreams();
+        displayMode_.store(mode, std::memory_order_relaxed);
+
+        // Frames in the old format won't be needed anymore.
+        pool_->Trim();
+
+        input_->StartStreams();
+
+        // Start taking frames again right away, unless another change has
+        // come in meanwhile (it's switched to next).
+        {
+            std::lock_guard<std::mutex> lock(controlMutex_);
+            if (pendingMode_ == bmdModeUnknown)
+                switchPending_.store(false, std::memory_order_release);
+        }
+
+        // Prepare frames in the new format while the input is running.
+        IDeckLinkDisplayMode* info;
+        BMDDisplayModeSupport support;
+        if (SUCCEEDED(input_->DoesSupportVideoMode(
+                mode, bmdFormat10BitYUV, bmdVideoInputFlagDefault, &support, &info
+            )) && info != nullptr)
+        {
+            pool_->Reserve(
+                info->GetWidth(), info->GetHeight(),
+                GetFramePixelFormat(), Config::framePoolReserve
+            );
+            info->Release();
+        }
+
+        switchTimer_.AddSince(begin);
+    }
+
+    // Display mode a captured frame is in (unknown when the input has no
+    // valid signal in the enabled mode)
+    BMDDisplayMode GetFrameDisplayMode(IDeckLinkVideoInputFrame* frame) const
+    {
+        if (frame->GetFlags() & bmdFrameHasNoInputSource) return bmdModeUnknown;
+        return displayMode_.load(std::memory_order_relaxed);
+    }
+
+    // Timecode embedded in a captured frame (RP188, falling back to VITC)
+    static BMDTimecodeBCD GetFrameTimecode(IDeckLinkVideoInputFrame* frame)
+    {
+        IDeckLinkTimecode* timecode;
+        if (frame->GetTimecode(bmdTimecodeRP188Any, &timecode) != S_OK &&
+            frame->GetTimecode(bmdTimecodeVITC, &timecode) != S_OK)
+            return MemoryBackedFrame::NoTimecode;
+
+        auto bcd = timecode->GetBCD();
+        timecode->Release();
+        return bcd;
+    }
+
+    // Copy the audio packet into the frame, so it travels through the
+    // frame queues with its picture and stays in sync.
+    static void AttachAudio(MemoryBackedFrame* frame, IDeckLinkAudioInputPacket* packet)
+    {
+        void* bytes;
+        auto count = packet != nullptr ? packet->GetSampleFrameCount() : 0;
+        if (count > 0 && count <= Config::audioFrameCapacity &&
+            SUCCEEDED(packet->GetBytes(&bytes)))
+            frame->SetAudio(bytes, count);
+        else
+            frame->ClearAudio();
+    }
+
+    void PushFrame(MemoryBackedFrame* frame)
+    {
+        // The outputs measure how long it waits in their queues.
+        frame->SetQueueTime(StageTimer::Now());
+
+        for (auto& output : outputs_)
+        {
+            if (!output.active.load(std::memory_order_acquire)) continue;
+
+            // Drop the frame for this output if its consumer can't keep up.
+            frame->AddRef();
+            if (!output.queue.TryPush(frame))
+            {
+                frame->Release();
+                auto count = overflowCount_.fetch_add(1, std::memory_order_relaxed);
+                log_->Write(
+                    EventLog::EventType::InputQueueOverflow, channel_,
+                    count + 1, output.queue.Count(), 0
+                );
+            }
+        }
+
+        // Let go of the producer's reference.
+        frame->Release();
+    }
+};
+
+// Frames of a receiver, through an output queue of its own
+class ReceiverSource final : public FrameSource
+{
+public:
+
+    // Attach an output queue to the receiver (assert when none is left).
+    explicit ReceiverSource(Receiver* receiver)
+        : refCount_(1), receiver_(receiver)
+    {
+        receiver_->AddRef();
+        queue_ = receiver_->AttachOutput();
+        assert(queue_ >= 0);
+    }
+
+    ~ReceiverSource()
+    {
+        receiver_->DetachOutput(queue_);
+        receiver_->Release();
+    }
+
+    // FrameSource implementation
+
+    bool TryPopFrame(MemoryBackedFrame*& frame) override
+    {
+        return receiver_->TryPopFrame(queue_, frame);
+    }
+
+    size_t CountQueuedFrames() override
+    {
+        return receiver_->CountQueuedFrames(queue_);
+    }
+
+    bool IsLive() const override
+    {
+        return true;
+    }
+
+    BMDTimeValue GetModeChangeTime() const override
+    {
+        return receiver_->GetModeChangeTime();
+    }
+
+    ULONG AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    Receiver* receiver_;
+    int queue_;
 };
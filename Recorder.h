@@ -0,0 +1,317 @@
+#pragma once
+
+#include "Common.h"
+#include "EventLog.h"
+#include "FrameFile.h"
+#include "MemoryBackedFrame.h"
+#include "Receiver.h"
+#include "StageTimer.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+// Frame recorder
+//
+// Takes the frames of a receiver through an output queue of its own (the
+// same way a sender does) and appends them to a frame file (FrameFile.h)
+// on a writer thread, in the queued format (v210 with Config::passthrough)
+// and with their audio and timecode. The capture callback is never held up
+// by the disk: when the recorder falls behind, its queue overflows and the
+// frames are counted by the receiver as usual.
+//
+// The file is opened unbuffered and the pixels are written straight from
+// the frames' own (page-aligned) memory, so they're neither copied nor
+// passed through the system cache (the audio, a few KB, goes through an
+// aligned buffer). Several overlapped writes are kept in flight, each
+// holding a reference to its frame, so the disk always has work queued.
+class Recorder final
+{
+public:
+
+    struct Stats
+    {
+        uint64_t frames;    // Frames written
+        uint64_t bytes;     // Payload bytes written (including the sector padding)
+        uint64_t failures;  // Frames lost to write errors
+        uint64_t waits;     // Times the next write slot was still in flight
+        StageTimer::Stats wait; // Waiting for a write slot to complete
+    };
+
+    // Constructor/destructor
+
+    Recorder(EventLog* log, int channel)
+        : refCount_(1), log_(log), channel_(channel), receiver_(nullptr),
+          queue_(-1), next_(0),
+          quit_(false), frameCount_(0), byteCount_(0), failureCount_(0), waitCount_(0)
+    {
+        log_->AddRef();
+
+        for (auto& slot : slots_)
+        {
+            slot.frame = nullptr;
+            slot.failed = false;
+            slot.audio = FrameFile::AllocateBuffer(FrameFile::RoundUp(static_cast<size_t>(
+                Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()
+            )));
+            for (auto& transfer : slot.writes)
+            {
+                transfer.size = 0;
+                std::memset(&transfer.overlapped, 0, sizeof(transfer.overlapped));
+                transfer.overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+                assert(transfer.overlapped.hEvent != nullptr);
+            }
+        }
+    }
+
+    ~Recorder()
+    {
+        assert(receiver_ == nullptr); // Recording should have been stopped.
+
+        for (auto& slot : slots_)
+        {
+            for (auto& transfer : slot.writes) CloseHandle(transfer.overlapped.hEvent);
+            FrameFile::FreeBuffer(slot.audio);
+        }
+
+        log_->Release();
+    }
+
+    // Public methods
+
+    // Start recording the frames of a receiver to a new file (replacing an
+    // existing one). Returns false when the file can't be created.
+    bool StartRecording(Receiver* receiver, const char* path)
+    {
+        assert(receiver_ == nullptr);
+
+        if (!file_.Create(path)) return false;
+
+        // Get our own queue of (shared) frames from the receiver.
+        receiver_ = receiver;
+        receiver_->AddRef();
+        queue_ = receiver_->AttachOutput();
+        assert(queue_ >= 0);
+
+        quit_.store(false, std::memory_order_relaxed);
+        writer_ = std::thread(&Recorder::WriterLoop, this);
+        return true;
+    }
+
+    // Stop recording. Frames already queued are written before the file
+    // is completed and closed.
+    void StopRecording()
+    {
+        assert(receiver_ != nullptr);
+
+        quit_.store(true, std::memory_order_release);
+        writer_.join();
+
+        // The index is lost (the frames up to the last full chunk can
+        // still be read) if the end of the file can't be written.
+        if (!file_.Close()) Fail();
+
+        receiver_->DetachOutput(queue_);
+        queue_ = -1;
+        receiver_->Release();
+        receiver_ = nullptr;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.frames = frameCount_.load(std::memory_order_relaxed);
+        stats.bytes = byteCount_.load(std::memory_order_relaxed);
+        stats.failures = failureCount_.load(std::memory_order_relaxed);
+        stats.waits = waitCount_.load(std::memory_order_relaxed);
+        stats.wait = waitTimer_.GetStats();
+        return stats;
+    }
+
+    // Reference counting (same semantics as the COM objects)
+
+    ULONG AddRef()
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release()
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+private:
+
+    // Overlapped write request
+    struct Transfer
+    {
+        size_t size; // Zero when not in use
+        OVERLAPPED overlapped;
+    };
+
+    // Overlapped writes of a frame in flight (pixels and audio)
+    struct Slot
+    {
+        MemoryBackedFrame* frame; // Null when the slot is free
+        bool failed;              // A write couldn't be started
+        uint8_t* audio;           // Aligned copy of the audio
+        Transfer writes[2];
+    };
+
+    std::atomic<ULONG> refCount_;
+    EventLog* log_;
+    int channel_;
+    Receiver* receiver_;
+    int queue_;
+    FrameFileWriter file_;
+    Slot slots_[Config::recorderWrites];
+    int next_;
+    std::thread writer_;
+    std::atomic<bool> quit_;
+    std::atomic<uint64_t> frameCount_;
+    std::atomic<uint64_t> byteCount_;
+    std::atomic<uint64_t> failureCount_;
+    std::atomic<uint64_t> waitCount_;
+    StageTimer waitTimer_;
+
+    void WriterLoop()
+    {
+        MemoryBackedFrame* frame;
+
+        while (!quit_.load(std::memory_order_acquire))
+        {
+            if (receiver_->TryPopFrame(queue_, frame))
+            {
+                Write(frame);
+            }
+            else
+            {
+                // Nothing new: the queue holds several frames, so polling
+                // leaves plenty of headroom.
+                std::this_thread::sleep_for(std::chrono::milliseconds(Config::writerPollInterval));
+            }
+        }
+
+        // Write the frames queued by the time of the stop (not the ones
+        // still coming in, or a disk that can't keep up would never let
+        // it finish).
+        for (auto count = receiver_->CountQueuedFrames(queue_);
+             count > 0 && receiver_->TryPopFrame(queue_, frame); count--)
+        {
+            Write(frame);
+        }
+
+        for (auto& slot : slots_) Complete(slot);
+    }
+
+    // Start writing a frame (taking over the reference to it).
+    void Write(MemoryBackedFrame* frame)
+    {
+        auto& slot = slots_[next_];
+        next_ = (next_ + 1) % Config::recorderWrites;
+
+        // The slot can only be reused once its last writes are done.
+        if (slot.frame != nullptr && !IsComplete(slot))
+        {
+            waitCount_.fetch_add(1, std::memory_order_relaxed);
+            auto begin = StageTimer::Now();
+            Complete(slot);
+            waitTimer_.AddSince(begin);
+        }
+        Complete(slot);
+
+        // Lay the frame out (with an entry in the index).
+        FrameFile::Entry entry;
+        if (!file_.AddFrame(frame, entry))
+        {
+            frame->Release();
+            Fail();
+            return;
+        }
+        assert(FrameFile::GetPixelSize(entry) <= frame->GetMemorySize());
+
+        void* bytes;
+        frame->GetBytes(&bytes);
+        slot.frame = frame;
+        auto ok = Start(slot.writes[0], bytes, FrameFile::GetPixelSize(entry), entry.offset);
+
+        auto audioSize = FrameFile::GetAudioSize(entry);
+        if (ok && audioSize > 0)
+        {
+            std::memcpy(
+                slot.audio, frame->GetAudioBytes(),
+                static_cast<size_t>(entry.audioSampleFrames * Utility::GetAudioSampleFrameBytes())
+            );
+            ok = Start(slot.writes[1], slot.audio, audioSize, entry.offset + FrameFile::GetPixelSize(entry));
+        }
+
+        // Completed at once or in flight: either way it's checked when the
+        // slot comes around again.
+        if (!ok)
+        {
+            slot.failed = true;
+            Complete(slot);
+        }
+    }
+
+    // Issue an overlapped write (false when it failed at once).
+    bool Start(Transfer& transfer, const void* data, size_t size, uint64_t offset)
+    {
+        transfer.overlapped.Offset = static_cast<DWORD>(offset);
+        transfer.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        if (!WriteFile(file_.GetHandle(), data, static_cast<DWORD>(size), nullptr, &transfer.overlapped) &&
+            GetLastError() != ERROR_IO_PENDING) return false;
+        transfer.size = size;
+        return true;
+    }
+
+    bool IsComplete(const Slot& slot) const
+    {
+        for (auto& transfer : slot.writes)
+            if (transfer.size > 0 && !HasOverlappedIoCompleted(&transfer.overlapped)) return false;
+        return true;
+    }
+
+    // Wait for the writes of a slot to finish and let go of its frame.
+    void Complete(Slot& slot)
+    {
+        if (slot.frame == nullptr) return;
+
+        auto ok = !slot.failed;
+        uint64_t bytes = 0;
+        for (auto& transfer : slot.writes)
+        {
+            if (transfer.size == 0) continue;
+            DWORD written = 0;
+            ok = GetOverlappedResult(file_.GetHandle(), &transfer.overlapped, &written, TRUE) &&
+                written == transfer.size && ok;
+            bytes += written;
+            transfer.size = 0;
+        }
+
+        if (ok)
+        {
+            frameCount_.fetch_add(1, std::memory_order_relaxed);
+            byteCount_.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        else
+        {
+            Fail();
+        }
+
+        slot.frame->Release();
+        slot.frame = nullptr;
+        slot.failed = false;
+    }
+
+    void Fail()
+    {
+        auto count = failureCount_.fetch_add(1, std::memory_order_relaxed);
+        log_->Write(
+            EventLog::EventType::RecorderWriteFailed, channel_, count + 1,
+            receiver_->CountQueuedFrames(queue_), 0
+        );
+    }
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Bounded single-producer/single-consumer lock-free ring buffer
+//
+// TryPush must only be called from one thread and TryPop from one (other)
+// thread at a time. Capacity is rounded up to a power of two.
+template <typename T>
+class RingBuffer final
+{
+public:
+
+    explicit RingBuffer(size_t capacity)
+        : head_(0), cachedTail_(0), tail_(0), cachedHead_(0)
+    {
+        assert(capacity > 0);
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    // Producer side: returns false when the buffer is full.
+    bool TryPush(const T& item)
+    {
+        auto tail = tail_.load(std::memory_order_relaxed);
+
+        // Only reload the consumer index when the cached one says full.
+        if (tail - cachedHead_ > mask_)
+        {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (tail - cachedHead_ > mask_) return false;
+        }
+
+        slots_[tail & mask_] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: returns false (and leaves item untouched) when empty.
+    bool TryPop(T& item)
+    {
+        auto head = head_.load(std::memory_order_relaxed);
+
+        // Only reload the producer index when the cached one says empty.
+        if (head == cachedTail_)
+        {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (head == cachedTail_) return false;
+        }
+
+        item = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate number of items; exact when called from either side
+    // while the other side is idle.
+    size_t Count() const
+    {
+        auto head = head_.load(std::memory_order_acquire);
+        auto tail = tail_.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    size_t Capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+
+    static const size_t CacheLineSize = 64;
+
+    std::vector<T> slots_;
+    size_t mask_;
+
+    // The consumer and producer indices live on separate cache lines
+    // together with each side's cached copy of the other index.
+    char pad0_[CacheLineSize];
+    std::atomic<size_t> head_;
+    size_t cachedTail_;
+    char pad1_[CacheLineSize];
+    std::atomic<size_t> tail_;
+    size_t cachedHead_;
+    char pad2_[CacheLineSize];
+};
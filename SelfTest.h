@@ -0,0 +1,485 @@
+#pragma once
+
+#include "Common.h"
+#include "CaptureAllocator.h"
+#include "RingBuffer.h"
+#include "SimulatedDevice.h"
+#include "V210Converter.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+//
+// Self test
+//
+// Correctness checks of the building blocks, for what a benchmark run
+// would only show as symptoms (if at all). Every check reports a line,
+// with the details of the first failure; the run fails if any check does.
+// Run with --selftest.
+//
+class SelfTest final
+{
+public:
+
+    static bool Run(FILE* stream)
+    {
+        auto passed = true;
+        passed &= Report(stream, "frameTiming", TestFrameTiming(stream));
+        passed &= Report(stream, "ringBufferTwoThreads", TestRingBuffer(stream));
+        passed &= Report(stream, "v210SimdBitExact", TestV210(stream));
+        passed &= Report(stream, "captureAllocator", TestCaptureAllocator(stream));
+        passed &= Report(stream, "captureStall", TestCaptureStall(stream));
+        std::fprintf(stream, passed ? "All checks passed\n" : "Some checks FAILED\n");
+        return passed;
+    }
+
+private:
+
+    static bool Report(FILE* stream, const char* name, bool passed)
+    {
+        std::fprintf(stream, "%s %s\n", passed ? "ok  " : "FAIL", name);
+        return passed;
+    }
+
+    // Condition within a check (reports it when it doesn't hold)
+    static bool Expect(FILE* stream, bool condition, const char* description)
+    {
+        if (!condition) std::fprintf(stream, "  %s\n", description);
+        return condition;
+    }
+
+    // Output frame times and audio cadence of every mode over millions of
+    // frames (a day of 60p), from the start and from a year in: each frame
+    // time is exactly one frame duration after the last one (no rounding
+    // ever creeps in), and the audio sample counts per frame add up to
+    // exactly the samples in the elapsed time, each within one sample of
+    // the nominal rate.
+    static bool TestFrameTiming(FILE* stream)
+    {
+        const uint64_t frames = 5000000;
+
+        uint64_t checked = 0;
+        for (const auto& mode : SimulatedDisplayMode::GetModes())
+        {
+            auto yearFrames = static_cast<uint64_t>(365LL * 86400 * mode.timeScale / mode.frameDuration);
+            const uint64_t starts[] = { 0, yearFrames };
+
+            // Audio samples per frame at the nominal rate, rounded down
+            auto minSamples = mode.frameDuration * 48000 / mode.timeScale;
+
+            for (auto start : starts)
+            {
+                auto count = start == 0 ? frames : frames / 10;
+                auto expected = Utility::GetFrameTime(start, mode.frameDuration);
+                if (expected != static_cast<BMDTimeValue>(start) * mode.frameDuration)
+                {
+                    std::fprintf(stream, "  %s: frame %llu has time %lld\n", mode.name,
+                        static_cast<unsigned long long>(start), static_cast<long long>(expected));
+                    return false;
+                }
+
+                auto samples = static_cast<BMDTimeValue>(start) * mode.frameDuration * 48000 / mode.timeScale;
+                for (auto i = start; i < start + count; i++)
+                {
+                    auto time = Utility::GetFrameTime(i, mode.frameDuration);
+                    if (time != expected)
+                    {
+                        std::fprintf(stream, "  %s: frame %llu has time %lld, expected %lld\n",
+                            mode.name, static_cast<unsigned long long>(i),
+                            static_cast<long long>(time), static_cast<long long>(expected));
+                        return false;
+                    }
+                    expected += mode.frameDuration;
+
+                    auto slot = Utility::GetAudioSampleFrameCount(i, mode.frameDuration, mode.timeScale);
+                    samples += slot;
+                    auto total = static_cast<BMDTimeValue>(i + 1) * mode.frameDuration * 48000 / mode.timeScale;
+                    if (slot < minSamples || slot > minSamples + 1 || samples != total)
+                    {
+                        std::fprintf(stream,
+                            "  %s: frame %llu has %ld audio samples (%lld in total, expected %lld)\n",
+                            mode.name, static_cast<unsigned long long>(i), slot,
+                            static_cast<long long>(samples), static_cast<long long>(total));
+                        return false;
+                    }
+                }
+                checked += count;
+            }
+        }
+
+        std::fprintf(stream, "  %llu modes, %llu frames\n",
+            static_cast<unsigned long long>(SimulatedDisplayMode::GetModes().size()),
+            static_cast<unsigned long long>(checked));
+        return true;
+    }
+
+    // RingBuffer between a producer and a consumer thread: every item
+    // arrives once, in order and intact, at capacities down to one (where
+    // the indices wrap on every item) and with the two sides racing.
+    static bool TestRingBuffer(FILE* stream)
+    {
+        struct Item
+        {
+            uint64_t sequence;
+            uint64_t check; // ~sequence (a torn copy wouldn't match)
+        };
+
+        const uint64_t count = 1 << 20;
+        const size_t capacities[] = { 1, 2, 3, 16 };
+
+        for (auto capacity : capacities)
+        {
+            RingBuffer<Item> ring(capacity);
+            std::atomic<bool> produced(false);
+
+            std::thread producer([&]()
+            {
+                for (uint64_t i = 0; i < count; i++)
+                {
+                    Item item = { i, ~i };
+                    while (!ring.TryPush(item)) std::this_thread::yield();
+                }
+                produced.store(true, std::memory_order_release);
+            });
+
+            uint64_t expected = 0;
+            auto failure = false;
+            while (expected < count && !failure)
+            {
+                Item item;
+                if (!ring.TryPop(item))
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                if (item.sequence != expected || item.check != ~expected)
+                {
+                    std::fprintf(stream,
+                        "  capacity %llu: got item %llu (check %s), expected %llu\n",
+                        static_cast<unsigned long long>(capacity),
+                        static_cast<unsigned long long>(item.sequence),
+                        item.check == ~item.sequence ? "ok" : "torn",
+                        static_cast<unsigned long long>(expected));
+                    failure = true;
+                }
+                else if (ring.Count() > ring.Capacity())
+                {
+                    std::fprintf(stream, "  capacity %llu: count %llu over capacity\n",
+                        static_cast<unsigned long long>(capacity),
+                        static_cast<unsigned long long>(ring.Count()));
+                    failure = true;
+                }
+                expected++;
+            }
+
+            // After a failure, drain the rest so the producer can finish.
+            Item item;
+            while (!produced.load(std::memory_order_acquire))
+            {
+                while (ring.TryPop(item)) {}
+                std::this_thread::yield();
+            }
+            producer.join();
+            if (failure) return false;
+
+            if (ring.TryPop(item))
+            {
+                std::fprintf(stream, "  capacity %llu: item left over\n",
+                    static_cast<unsigned long long>(capacity));
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Every SIMD kernel the CPU supports against the scalar reference, on
+    // random v210 words (all code values, so clamping is covered), at
+    // every width up to a few SIMD blocks and some odd large ones, with
+    // both coefficient sets and output formats. The pixels right of the
+    // width must be left alone.
+    static bool TestV210(FILE* stream)
+    {
+        const uint32_t guard = 0xdeadbeef;
+        const long heights[] = { 480, 1080 }; // Rec.601, Rec.709
+        const BMDPixelFormat formats[] = { bmdFormat8BitARGB, bmdFormat8BitBGRA };
+        const long rows = 2;
+
+        std::vector<long> widths;
+        for (long w = 1; w <= 100; w++) widths.push_back(w);
+        for (auto w : { 718L, 719L, 1279L, 1919L, 1921L, 2047L, 3839L, 4095L })
+            widths.push_back(w);
+
+        V210Converter reference;
+        reference.SetKernel(V210Converter::Kernel::Scalar);
+        V210Converter simd;
+        auto best = simd.GetKernel();
+
+        std::mt19937 random(1);
+        for (auto width : widths)
+        {
+            auto srcRowBytes = Utility::GetRowBytes(bmdFormat10BitYUV, width);
+            std::vector<uint32_t> src(static_cast<size_t>(srcRowBytes) * rows / 4);
+            for (auto& word : src) word = random();
+
+            // One guard pixel past the width of every row
+            auto dstRowBytes = (width + 1) * 4;
+            std::vector<uint32_t> expected(static_cast<size_t>(width + 1) * rows);
+            std::vector<uint32_t> actual(expected.size());
+
+            for (auto height : heights)
+            {
+                for (auto format : formats)
+                {
+                    std::fill(expected.begin(), expected.end(), guard);
+                    reference.ConvertRows(
+                        reinterpret_cast<const uint8_t*>(src.data()), srcRowBytes,
+                        reinterpret_cast<uint8_t*>(expected.data()), dstRowBytes,
+                        format, width, height, 0, rows
+                    );
+
+                    for (auto k = static_cast<int>(V210Converter::Kernel::SSE41);
+                         k <= static_cast<int>(best); k++)
+                    {
+                        auto kernel = static_cast<V210Converter::Kernel>(k);
+                        simd.SetKernel(kernel);
+                        std::fill(actual.begin(), actual.end(), guard);
+                        simd.ConvertRows(
+                            reinterpret_cast<const uint8_t*>(src.data()), srcRowBytes,
+                            reinterpret_cast<uint8_t*>(actual.data()), dstRowBytes,
+                            format, width, height, 0, rows
+                        );
+
+                        for (size_t i = 0; i < actual.size(); i++)
+                        {
+                            if (actual[i] == expected[i]) continue;
+                            std::fprintf(stream,
+                                "  %s, width %ld, height %ld, %s: pixel %ld of row %ld is %08x, expected %08x\n",
+                                V210Converter::GetKernelName(kernel), width, height,
+                                format == bmdFormat8BitARGB ? "ARGB" : "BGRA",
+                                static_cast<long>(i % (width + 1)), static_cast<long>(i / (width + 1)),
+                                actual[i], expected[i]);
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+
+        std::fprintf(stream, "  kernels checked up to %s, %llu widths\n",
+            V210Converter::GetKernelName(best), static_cast<unsigned long long>(widths.size()));
+        return true;
+    }
+
+    // CaptureAllocator driven the way the driver does (Commit, then
+    // AllocateBuffer/ReleaseBuffer per frame with a few buffers in flight,
+    // Decommit when stopped), through a format change to a larger size,
+    // with more buffers held than there are slots, and with captured
+    // frames (simulated ones) handed on in place.
+    static bool TestCaptureAllocator(FILE* stream)
+    {
+        const size_t slots = 8;
+        const unsigned int hd = Utility::GetRowBytes(bmdFormat10BitYUV, 1920) * 1080;
+        const unsigned int uhd = Utility::GetRowBytes(bmdFormat10BitYUV, 3840) * 2160;
+
+        auto allocator = new CaptureAllocator(slots, false);
+        auto ok = true;
+        allocator->Commit();
+
+        // Steady state: every allocation is served from the slab.
+        void* inFlight[4] = {};
+        for (auto i = 0; i < 10000; i++)
+        {
+            auto& buffer = inFlight[i % 4];
+            if (buffer != nullptr) allocator->ReleaseBuffer(buffer);
+            allocator->AllocateBuffer(hd, &buffer);
+        }
+        auto stats = allocator->GetStats();
+        ok &= Expect(stream, stats.reuses == 10000 && stats.fallbacks == 0,
+            "steady state: not every allocation reused a slot");
+        ok &= Expect(stream, stats.outstanding == 4, "steady state: outstanding count is off");
+
+        // Holding more buffers than slots: the rest fall back.
+        void* held[slots + 2] = {};
+        for (auto& buffer : held) allocator->AllocateBuffer(hd, &buffer);
+        stats = allocator->GetStats();
+        ok &= Expect(stream, stats.fallbacks == 6, "overcommit: expected 6 fallbacks");
+        for (auto& buffer : held) allocator->ReleaseBuffer(buffer);
+        for (auto& buffer : inFlight) allocator->ReleaseBuffer(buffer);
+        ok &= Expect(stream, allocator->GetStats().outstanding == 0, "overcommit: buffers left outstanding");
+
+        // A larger format rebuilds the slab once nothing is in use.
+        void* buffer;
+        allocator->AllocateBuffer(uhd, &buffer);
+        stats = allocator->GetStats();
+        ok &= Expect(stream, stats.slotSize >= uhd && stats.fallbacks == 6,
+            "format change: the slab wasn't rebuilt for the larger size");
+        allocator->ReleaseBuffer(buffer);
+
+        // Handoff: a captured frame viewed in place keeps its slot until
+        // the view is released, and the view is reused for the next one.
+        auto frame = new SimulatedInputFrame(3840, 2160, bmdFormat10BitYUV, bmdFrameFlagDefault, allocator);
+        auto view = allocator->WrapFrame(frame);
+        void* captured;
+        void* viewed = nullptr;
+        frame->GetBytes(&captured);
+        if (view != nullptr) view->GetBytes(&viewed);
+        ok &= Expect(stream, view != nullptr && viewed == captured,
+            "handoff: the captured buffer wasn't viewed in place");
+        frame->Release();
+        ok &= Expect(stream, allocator->GetStats().outstanding == 1,
+            "handoff: the slot was given back while still viewed");
+        if (view != nullptr) view->Release();
+        ok &= Expect(stream, allocator->GetStats().outstanding == 0,
+            "handoff: the slot wasn't given back with the view");
+
+        frame = new SimulatedInputFrame(3840, 2160, bmdFormat10BitYUV, bmdFrameFlagDefault, allocator);
+        auto again = allocator->WrapFrame(frame);
+        frame->Release();
+        ok &= Expect(stream, again != nullptr && again == view,
+            "handoff: the view of the slot wasn't reused");
+        if (again != nullptr) again->Release();
+
+        // Decommit frees the slab when nothing is in use.
+        allocator->Decommit();
+        stats = allocator->GetStats();
+        ok &= Expect(stream, stats.slotCount == 0 && stats.commits == 1 && stats.decommits == 1,
+            "decommit: the slab wasn't freed");
+
+        std::fprintf(stream, "  %llu allocations, %.2f%% reused, %llu handoffs\n",
+            static_cast<unsigned long long>(stats.allocations),
+            100.0 * stats.reuses / stats.allocations,
+            static_cast<unsigned long long>(stats.handoffs));
+        allocator->Release();
+        return ok;
+    }
+
+    // Input callback holding up the capture thread once, recording the
+    // frames it gets (frame index from the stream time, and how long after
+    // its time each one arrived)
+    class StallingCallback final : public IDeckLinkInputCallback
+    {
+    public:
+
+        struct Arrival
+        {
+            BMDTimeValue index;
+            BMDTimeValue lateness; // Microseconds
+        };
+
+        StallingCallback(IDeckLinkInput* input, size_t frames, size_t stallAt, double stall)
+            : input_(input), stallAt_(stallAt), stall_(stall), count_(0)
+        {
+            arrivals_.resize(frames);
+        }
+
+        size_t Count() const
+        {
+            return count_.load(std::memory_order_acquire);
+        }
+
+        const std::vector<Arrival>& GetArrivals() const
+        {
+            return arrivals_;
+        }
+
+        HRESULT STDMETHODCALLTYPE VideoInputFrameArrived(
+            IDeckLinkVideoInputFrame* frame, IDeckLinkAudioInputPacket*
+        ) override
+        {
+            auto i = count_.load(std::memory_order_relaxed);
+            if (i == arrivals_.size()) return S_OK;
+
+            BMDTimeValue time, duration, hardwareTime, now, timeInFrame, ticksPerFrame;
+            frame->GetStreamTime(&time, &duration, 1000000);
+            frame->GetHardwareReferenceTimestamp(1000000, &hardwareTime, &duration);
+            input_->GetHardwareReferenceClock(1000000, &now, &timeInFrame, &ticksPerFrame);
+            arrivals_[i].index = time / duration;
+            arrivals_[i].lateness = now - hardwareTime;
+            count_.store(i + 1, std::memory_order_release);
+
+            if (i == stallAt_)
+                std::this_thread::sleep_for(std::chrono::duration<double>(stall_));
+            return S_OK;
+        }
+
+        HRESULT STDMETHODCALLTYPE VideoInputFormatChanged(
+            BMDVideoInputFormatChangedEvents, IDeckLinkDisplayMode*, BMDDetectedVideoInputFormatFlags
+        ) override
+        {
+            return S_OK;
+        }
+
+        // Lives on the stack of the test
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, LPVOID* ppv) override
+        {
+            *ppv = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+        ULONG STDMETHODCALLTYPE Release() override { return 1; }
+
+    private:
+
+        IDeckLinkInput* input_;
+        size_t stallAt_;
+        double stall_;
+        std::vector<Arrival> arrivals_;
+        std::atomic<size_t> count_;
+    };
+
+    // The simulated input after the capture thread stalled for ten frame
+    // periods: the frames whose time passed are skipped (one gap in the
+    // stream time, as long as the dropped count says) rather than
+    // delivered back to back, so none arrives more than a period late.
+    static bool TestCaptureStall(FILE* stream)
+    {
+        const size_t frames = 30;
+        const size_t stallAt = 10;
+        const BMDTimeValue period = 40000; // HD1080p25 in microseconds
+
+        auto input = new SimulatedInput(SimulatedClock(), bmdModeHD1080p25);
+        StallingCallback callback(input, frames, stallAt, period * 10 / 1e6);
+        input->SetCallback(&callback);
+        input->EnableVideoInput(bmdModeHD1080p25, bmdFormat10BitYUV, bmdVideoInputFlagDefault);
+        input->StartStreams();
+        while (callback.Count() < frames)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        input->StopStreams();
+        auto dropped = input->CountDroppedFrames();
+        input->SetCallback(nullptr);
+        input->Release();
+
+        auto& arrivals = callback.GetArrivals();
+        BMDTimeValue skipped = 0;
+        BMDTimeValue latest = 0;
+        size_t gaps = 0;
+        for (size_t i = 0; i < frames; i++)
+        {
+            if (i > 0 && arrivals[i].index != arrivals[i - 1].index + 1)
+            {
+                skipped += arrivals[i].index - arrivals[i - 1].index - 1;
+                gaps++;
+            }
+            latest = (std::max)(latest, arrivals[i].lateness);
+        }
+
+        auto ok = true;
+        ok &= Expect(stream, gaps == 1 && skipped >= 9,
+            "the frames missed in the stall weren't skipped in one go");
+        ok &= Expect(stream, static_cast<uint64_t>(skipped) == dropped,
+            "the dropped count doesn't match the gap in the stream time");
+        ok &= Expect(stream, latest < period,
+            "frames arrived more than a period late (delivered back to back)");
+        std::fprintf(stream, "  %lld frames skipped, %llu dropped, latest arrival %.1f ms\n",
+            static_cast<long long>(skipped), static_cast<unsigned long long>(dropped),
+            latest / 1000.0);
+        return ok;
+    }
+};
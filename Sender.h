@@ -1,71 +1,247 @@
 #pragma once
 
 #include "Common.h"
+#include "AudioStretcher.h"
+#include "DriftEstimator.h"
+#include "EventLog.h"
+#include "FrameSource.h"
+#include "LatencyController.h"
+#include "LatencyStats.h"
 #include "Receiver.h"
+#include "StageTimer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class Sender final : public IDeckLinkVideoOutputCallback
 {
 public:
 
+    // Time spent in the output stages: the whole completion callback, and
+    // within it retrieving frames and scheduling them. The queue wait is
+    // how long frames sat in the input queue.
+    struct StageStats
+    {
+        StageTimer::Stats completion;
+        StageTimer::Stats pop;
+        StageTimer::Stats schedule;
+        StageTimer::Stats queueWait;
+    };
+
+    // Clock drift compensation results
+    struct DriftStats
+    {
+        DriftEstimator::Stats estimate;
+        LatencyController::Stats controller;
+        uint64_t audioCorrections; // Drops/repeats smoothed over by the audio
+    };
+
+    // Input queue underruns: runs of slots with no new frame to send
+    struct UnderrunStats
+    {
+        uint64_t count;         // Underruns started
+        uint64_t repeatedSlots; // Slots filled with the last frame again
+        uint64_t blankSlots;    // Slots filled with the blank frame
+        uint64_t longestSlots;  // Length of the longest underrun
+    };
+
+    // Latency controller state as of the last completion
+    struct ControlStats
+    {
+        int target;       // Target latency in frames
+        size_t depth;     // Observed pipeline depth in frames
+        uint64_t drops;
+        uint64_t repeats;
+    };
+
+    // Output mode switches following the input (times from the detection
+    // of the change to the first frame out in the new mode, in
+    // Config::clockTimeScale units)
+    struct SwitchStats
+    {
+        uint64_t count;
+        BMDTimeValue last;
+        BMDTimeValue max;
+    };
+
     // Constructor/destructor
 
-    Sender()
-        : refCount_(1), output_(nullptr), receiver_(nullptr), frameCount_(0)
+    Sender(EventLog* log, int channel)
+        : refCount_(1), output_(nullptr), source_(nullptr), log_(log), channel_(channel), mode_(bmdModeUnknown), blank_(nullptr), last_(nullptr),
+          frameCount_(0), frameDuration_(0), timeScale_(0),
+          latency_(Config::minLatency, Config::maxLatency, Config::latencyWindow),
+          latencyStats_(Config::latencyStatsWindow),
+          repeatPending_(false), audioCorrections_(0), measuredCaptureTime_(-1),
+          underrunSlots_(0), underrunCount_(0), repeatedSlots_(0), blankSlots_(0),
+          longestUnderrun_(0), controlTarget_(0), controlDepth_(0), controlDrops_(0),
+          controlRepeats_(0), stopped_(false), quit_(false), switchFrame_(nullptr), switching_(false),
+          switchStart_(-1), measureSwitch_(false), switchCount_(0),
+          lastSwitchTime_(0), maxSwitchTime_(0)
     {
-        blank_ = new MemoryBackedFrame(1920, 1080);
+        log_->AddRef();
     }
 
     ~Sender()
     {
         // The output should have been stopped.
         assert(output_ == nullptr);
-        assert(receiver_ == nullptr);
+        assert(source_ == nullptr);
+        assert(last_ == nullptr);
 
         // Release the internal objects.
-        blank_->Release();
+        if (blank_ != nullptr) blank_->Release();
+        log_->Release();
     }
 
     // Public methods
 
-    void StartSending(IDeckLinkOutput* output, Receiver* receiver)
+    // Send the frames of a source (a receiver, a timeshift ring, a file).
+    void StartSending(
+        IDeckLinkOutput* output, FrameSource* source,
+        BMDDisplayMode displayMode = Config::outputMode
+    )
     {
         assert(output_ == nullptr);
 
         // Start depending the external objects.
         output_ = output;
         output_->AddRef();
-        receiver_ = receiver;
-        receiver_->AddRef();
+        source_ = source;
+        source_->AddRef();
 
         // Start getting callback from the output object.
         AssertSuccess(output_->SetScheduledFrameCompletionCallback(this));
 
-        // Enable video output with 1080i59.94.
-        AssertSuccess(output_->EnableVideoOutput(
-            bmdModeHD1080i5994, bmdVideoOutputFlagDefault
-        ));
+        // Enable the output in the given mode.
+        EnableOutput(displayMode);
+        measuredCaptureTime_ = -1;
 
-        // Prerolling with blank frames.
-        for (auto i = 0; i < Config::preroll; i++) ScheduleFrame(blank_);
+        // Prerolling with blank frames up to the target latency.
+        if (Config::audioChannels > 0) AssertSuccess(output_->BeginAudioPreroll());
+        for (auto i = 0; i < latency_.GetTarget(); i++) ScheduleFrame(blank_, nullptr);
+        if (Config::audioChannels > 0) AssertSuccess(output_->EndAudioPreroll());
 
         // Start scheduled playback.
-        AssertSuccess(output_->StartScheduledPlayback(0, 1, 1));
+        AssertSuccess(output_->StartScheduledPlayback(0, timeScale_, 1));
+
+        // Mode switches are carried out on a control thread, as the output
+        // can't be stopped from its own callback.
+        if (Config::followInputMode)
+        {
+            quit_ = false;
+            control_ = std::thread(&Sender::ControlLoop, this);
+        }
+    }
+
+    // Send the frames of a receiver (through an output queue of our own).
+    void StartSending(
+        IDeckLinkOutput* output, Receiver* receiver,
+        BMDDisplayMode displayMode = Config::outputMode
+    )
+    {
+        auto source = new ReceiverSource(receiver);
+        StartSending(output, source, displayMode);
+        source->Release();
     }
 
     void StopSending()
     {
+        // Let a switch in progress finish and stop the control thread.
+        if (control_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(controlMutex_);
+                quit_ = true;
+            }
+            controlSignal_.notify_one();
+            control_.join();
+
+            if (switchFrame_ != nullptr) switchFrame_->Release();
+            switchFrame_ = nullptr;
+        }
+
         // Stop the output stream.
-        output_->StopScheduledPlayback(0, nullptr, 1);
+        StopPlayback();
         output_->SetScheduledFrameCompletionCallback(nullptr);
         output_->DisableVideoOutput();
+        if (Config::audioChannels > 0) output_->DisableAudioOutput();
+
+        // Publish the samples of the last (partial) window.
+        latencyStats_.Flush();
+
+        // Give the last frame back to the receiver's pool.
+        SetLastFrame(nullptr);
 
         // Release the external objects.
-        receiver_->Release();
-        receiver_ = nullptr;
+        source_->Release();
+        source_ = nullptr;
         output_->Release();
         output_ = nullptr;
     }
 
+    // Glass-to-glass latency (in Config::clockTimeScale units)
+    LatencyStats::Snapshot GetLatencyStats() const
+    {
+        return latencyStats_.GetSnapshot();
+    }
+
+    // Drift estimate and the corrections made for it (read once the
+    // output has stopped)
+    DriftStats GetDriftStats() const
+    {
+        DriftStats stats;
+        stats.estimate = drift_.GetStats();
+        stats.controller = latency_.GetStats();
+        stats.audioCorrections = audioCorrections_;
+        return stats;
+    }
+
+    // Underruns of the input queue (can be read at any time)
+    UnderrunStats GetUnderrunStats() const
+    {
+        UnderrunStats stats;
+        stats.count = underrunCount_.load(std::memory_order_relaxed);
+        stats.repeatedSlots = repeatedSlots_.load(std::memory_order_relaxed);
+        stats.blankSlots = blankSlots_.load(std::memory_order_relaxed);
+        stats.longestSlots = longestUnderrun_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Latency controller state (can be read at any time)
+    ControlStats GetControlStats() const
+    {
+        ControlStats stats;
+        stats.target = controlTarget_.load(std::memory_order_relaxed);
+        stats.depth = controlDepth_.load(std::memory_order_relaxed);
+        stats.drops = controlDrops_.load(std::memory_order_relaxed);
+        stats.repeats = controlRepeats_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Mode switches (can be read at any time)
+    SwitchStats GetSwitchStats() const
+    {
+        SwitchStats stats;
+        stats.count = switchCount_.load(std::memory_order_relaxed);
+        stats.last = lastSwitchTime_.load(std::memory_order_relaxed);
+        stats.max = maxSwitchTime_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Time spent in the output stages (can be read at any time)
+    StageStats GetStageStats() const
+    {
+        StageStats stats;
+        stats.completion = outputTimer_.GetStats();
+        stats.pop = popTimer_.GetStats();
+        stats.schedule = scheduleTimer_.GetStats();
+        stats.queueWait = queueWaitTimer_.GetStats();
+        return stats;
+    }
+
     // IUnknown implementation
 
     HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
@@ -107,44 +283,177 @@ public:
         BMDOutputFrameCompletionResult result
     ) override
     {
+        // The output is being restarted in another mode; the old frames
+        // are being flushed.
+        if (switching_.load(std::memory_order_acquire)) return S_OK;
+
+        // The playback is stopping: nothing to measure or to schedule.
+        if (result == bmdOutputFrameFlushed) return S_OK;
+
+        auto begin = StageTimer::Now();
+
+        unsigned int buffered;
+        AssertSuccess(output_->GetBufferedVideoFrameCount(&buffered));
+        auto queued = source_->CountQueuedFrames();
+
+        // Leave the reporting to the log thread.
         if (result == bmdOutputFrameDisplayedLate)
-            std::printf("Frame %p was displayed late.\n", completedFrame);
+            log_->Write(EventLog::EventType::FrameDisplayedLate, channel_, frameCount_, queued, buffered);
 
         if (result == bmdOutputFrameDropped)
-            std::printf("Frame %p was dropped.\n", completedFrame);
+            log_->Write(EventLog::EventType::FrameDropped, channel_, frameCount_, queued, buffered);
+
+        // Measure the end-to-end latency of captured frames, and the output
+        // clock from the completion of every displayed slot. All frames
+        // scheduled here are MemoryBackedFrames. A frame shown more than
+        // once (repeats, underruns) is measured at its first showing.
+        auto captureTime =
+            static_cast<MemoryBackedFrame*>(completedFrame)->GetCaptureTime();
+        BMDTimeValue completionTime;
+        if (result != bmdOutputFrameDropped && result != bmdOutputFrameFlushed &&
+            SUCCEEDED(output_->GetFrameCompletionReferenceTimestamp(
+                completedFrame, Config::clockTimeScale, &completionTime)))
+        {
+            drift_.AddCompletionTime(completionTime);
+            if (captureTime >= 0 && captureTime != measuredCaptureTime_)
+            {
+                latencyStats_.Add(captureTime, completionTime);
+                measuredCaptureTime_ = captureTime;
+            }
+
+            // The first slot after a switch shows the frame that triggered it.
+            if (measureSwitch_)
+            {
+                measureSwitch_ = false;
+                if (switchStart_ >= 0) AddSwitchTime(completionTime - switchStart_);
+            }
+        }
 
-        // Skip a single frame when DisplayedLate was detected.
-        if (result == bmdOutputFrameDisplayedLate)
+        // Skip a time slot when DisplayedLate was detected, so the
+        // following frames are scheduled ahead of the output again.
+        if (result == bmdOutputFrameDisplayedLate) frameCount_++;
+
+        // Ask the latency controller what to do with this slot. A source
+        // that isn't live is read as fast as it's played out: its frames
+        // are simply sent one per slot.
+        if (drift_.IsLocked()) latency_.SetDrift(drift_.GetDrift());
+        auto before = latency_.GetStats();
+        auto action = source_->IsLive() ?
+            latency_.Update(queued, buffered, result) : LatencyController::Action::Keep;
+        auto after = latency_.GetStats();
+        controlTarget_.store(after.target, std::memory_order_relaxed);
+        controlDepth_.store(after.depth, std::memory_order_relaxed);
+        controlDrops_.store(after.drops, std::memory_order_relaxed);
+        controlRepeats_.store(after.repeats, std::memory_order_relaxed);
+
+        if (action == LatencyController::Action::Drop)
+            log_->Write(
+                after.driftDrops != before.driftDrops ?
+                    EventLog::EventType::DriftDrop : EventLog::EventType::LatencyDrop,
+                channel_, frameCount_, queued, buffered
+            );
+
+        if (action == LatencyController::Action::Repeat)
+            log_->Write(
+                after.driftRepeats != before.driftRepeats ?
+                    EventLog::EventType::DriftRepeat : EventLog::EventType::LatencyRepeat,
+                channel_, frameCount_, queued, buffered
+            );
+
+        // Start slowing the audio down ahead of a repeat the drift is about
+        // to call for, so there's sound to play over the repeated slot.
+        if (Config::audioChannels > 0 && !repeatPending_ &&
+            latency_.IsRepeatDue(Config::audioStretchSlots))
         {
-            if (receiver_->CountQueuedFrames() > 1)
-                receiver_->PopFrame()->Release();
-            frameCount_++;
+            stretcher_.Adjust(-GetSlotSampleFrames(), Config::audioStretchSlots);
+            repeatPending_ = true;
         }
 
-        if (receiver_->CountQueuedFrames() == 0)
+        MemoryBackedFrame* frame;
+
+        if (action == LatencyController::Action::Drop)
         {
-            // Send a blank frame when no frame is available in the input queue.
-            ScheduleFrame(blank_);
+            // Drop a queued frame if there is more than one, otherwise
+            // let the output buffer shrink by not scheduling this time.
+            if (source_->CountQueuedFrames() > 1 && PopFrame(frame))
+            {
+                if (frame->GetCaptureTime() >= 0) drift_.AddCaptureTime(frame->GetCaptureTime());
+                DropAudio(frame);
+                frame->Release();
+            }
+            else
+            {
+                outputTimer_.AddSince(begin);
+                return S_OK;
+            }
         }
-        else
+
+        // A repeat schedules the next frame twice. When the drift announced
+        // it, the audio held back since then plays over the second one.
+        auto repeat = action == LatencyController::Action::Repeat ? 2 : 1;
+        auto planned = repeat == 2 && repeatPending_;
+        if (planned) audioCorrections_++;
+
+        if (PopFrame(frame))
         {
-            // Retrieve a frame from the input queue and send it.
-            auto frame = receiver_->PopFrame();
-            ScheduleFrame(frame);
+            // The input has switched to another mode: hand the frame over
+            // to the control thread, which restarts the output with it.
+            if (Config::followInputMode &&
+                frame->GetDisplayMode() != bmdModeUnknown &&
+                frame->GetDisplayMode() != mode_)
+            {
+                RequestSwitch(frame);
+                outputTimer_.AddSince(begin);
+                return S_OK;
+            }
+
+            if (frame->GetCaptureTime() >= 0) drift_.AddCaptureTime(frame->GetCaptureTime());
+
+            // Send the frame retrieved from the input queue. The picture
+            // only goes out as it is when it matches the output resolution
+            // (the blank frame takes its place otherwise), but its audio
+            // goes out either way, with the first slot. The second slot of
+            // an unannounced repeat gets silence.
+            auto match = Matches(frame);
+            for (auto i = 0; i < repeat; i++)
+            {
+                ScheduleFrame(match ? frame : blank_, i == 0 ? frame : nullptr);
+                if (planned) repeatPending_ = false;
+            }
+
+            // Keep it for the case the queue runs dry.
+            underrunSlots_ = 0;
+            SetLastFrame(match ? frame : nullptr);
             frame->Release();
         }
+        else
+        {
+            // Nothing new in the input queue: show the last frame again
+            // (without sound) rather than flashing black.
+            for (auto i = 0; i < repeat; i++)
+            {
+                ScheduleFrame(GetUnderrunFrame(), nullptr);
+                if (planned) repeatPending_ = false;
+            }
+        }
 
         #if false
         unsigned int num;
         output_->GetBufferedVideoFrameCount(&num);
-        std::printf("(in, out) = (%lld, %d)\n", receiver_->CountQueuedFrames(), num);
+        std::printf("(in, out) = (%lld, %d)\n", source_->CountQueuedFrames(), num);
         #endif
 
+        outputTimer_.AddSince(begin);
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE ScheduledPlaybackHasStopped() override
     {
+        {
+            std::lock_guard<std::mutex> lock(stopMutex_);
+            stopped_ = true;
+        }
+        stopSignal_.notify_all();
         return S_OK;
     }
 
@@ -152,15 +461,312 @@ private:
 
     std::atomic<ULONG> refCount_;
     IDeckLinkOutput* output_;
-    Receiver* receiver_;
+    FrameSource* source_;
+    EventLog* log_;
+    int channel_;
+    BMDDisplayMode mode_;
     MemoryBackedFrame* blank_;
+    MemoryBackedFrame* last_; // Last frame sent from the input queue
     uint64_t frameCount_;
+    BMDTimeValue frameDuration_;
+    BMDTimeScale timeScale_;
+    LatencyController latency_;
+    LatencyStats latencyStats_;
+    StageTimer outputTimer_;
+    StageTimer popTimer_;
+    StageTimer scheduleTimer_;
+    StageTimer queueWaitTimer_;
+    std::vector<uint8_t> silence_;
+    DriftEstimator drift_;
+    AudioStretcher stretcher_;
+    bool repeatPending_; // Audio is being held back for a repeat
+    uint64_t audioCorrections_;
+    BMDTimeValue measuredCaptureTime_;
+
+    // Underrun state (current run) and counters
+    int underrunSlots_;
+    std::atomic<uint64_t> underrunCount_;
+    std::atomic<uint64_t> repeatedSlots_;
+    std::atomic<uint64_t> blankSlots_;
+    std::atomic<uint64_t> longestUnderrun_;
+
+    // Copy of the latency controller state for GetControlStats
+    std::atomic<int> controlTarget_;
+    std::atomic<size_t> controlDepth_;
+    std::atomic<uint64_t> controlDrops_;
+    std::atomic<uint64_t> controlRepeats_;
+
+    // Set by ScheduledPlaybackHasStopped
+    bool stopped_;
+    std::mutex stopMutex_;
+    std::condition_variable stopSignal_;
+
+    // Mode switching (the control thread only touches the output while
+    // switching_ keeps the callback out)
+    std::thread control_;
+    std::mutex controlMutex_;
+    std::condition_variable controlSignal_;
+    bool quit_;
+    MemoryBackedFrame* switchFrame_; // First frame in the new mode
+    std::atomic<bool> switching_;
+    BMDTimeValue switchStart_;       // Detection of the input change
+    bool measureSwitch_;
+    std::atomic<uint64_t> switchCount_;
+    std::atomic<BMDTimeValue> lastSwitchTime_;
+    std::atomic<BMDTimeValue> maxSwitchTime_;
+
+    // Enable the video (and audio) output in a mode and set up everything
+    // that depends on it.
+    void EnableOutput(BMDDisplayMode displayMode)
+    {
+        AssertSuccess(output_->EnableVideoOutput(
+            displayMode, bmdVideoOutputFlagDefault
+        ));
+        mode_ = displayMode;
+
+        // Retrieve the exact frame rate and the size of the mode.
+        {
+            BMDDisplayModeSupport support;
+            IDeckLinkDisplayMode* mode;
+            AssertSuccess(output_->DoesSupportVideoMode(
+                displayMode, Receiver::GetFramePixelFormat(),
+                bmdVideoOutputFlagDefault, &support, &mode
+            ));
+            AssertSuccess(mode->GetFrameRate(&frameDuration_, &timeScale_));
+            drift_.Reset(static_cast<double>(frameDuration_) * Config::clockTimeScale / timeScale_);
+
+            // Blank frame matching the output mode
+            if (blank_ != nullptr) blank_->Release();
+            blank_ = new MemoryBackedFrame(
+                mode->GetWidth(), mode->GetHeight(), Receiver::GetFramePixelFormat()
+            );
+            blank_->FillBlack();
+
+            mode->Release();
+        }
+
+        // Timestamped audio output: the samples of each frame are scheduled
+        // at the same stream time as its picture.
+        if (Config::audioChannels > 0)
+        {
+            AssertSuccess(output_->EnableAudioOutput(
+                bmdAudioSampleRate48kHz, Config::audioSampleType,
+                Config::audioChannels, bmdAudioOutputStreamTimestamped
+            ));
+            silence_.assign(static_cast<std::size_t>(
+                Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()
+            ), 0);
+            stretcher_.Clear();
+            repeatPending_ = false;
+        }
+
+        // The stream time starts over, with nothing to repeat.
+        frameCount_ = 0;
+        underrunSlots_ = 0;
+        SetLastFrame(nullptr);
+    }
 
-    void ScheduleFrame(MemoryBackedFrame* frame)
+    // True when a frame can go out as it is in the current mode.
+    bool Matches(MemoryBackedFrame* frame) const
     {
-        auto time = static_cast<BMDTimeValue>(Config::TimeScale * 2 * frameCount_ / 59.94);
-        auto duration = static_cast<BMDTimeValue>(Config::TimeScale * 2 / 59.94);
-        output_->ScheduleVideoFrame(frame, time, duration, Config::TimeScale);
+        return
+            frame->GetWidth() == blank_->GetWidth() &&
+            frame->GetHeight() == blank_->GetHeight();
+    }
+
+    // Pass a frame in a new mode to the control thread (callback thread).
+    // The callback stays out until the output has been restarted.
+    void RequestSwitch(MemoryBackedFrame* frame)
+    {
+        switching_.store(true, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(controlMutex_);
+            switchFrame_ = frame;
+        }
+        controlSignal_.notify_one();
+    }
+
+    void ControlLoop()
+    {
+        std::unique_lock<std::mutex> lock(controlMutex_);
+        while (true)
+        {
+            controlSignal_.wait(lock, [this] { return quit_ || switchFrame_ != nullptr; });
+            if (quit_) break;
+
+            auto frame = switchFrame_;
+            switchFrame_ = nullptr;
+            lock.unlock();
+
+            SwitchMode(frame);
+            frame->Release();
+
+            lock.lock();
+        }
+    }
+
+    // Restart the output in the mode of the given frame, keeping the
+    // source and the controllers as they are.
+    void SwitchMode(MemoryBackedFrame* frame)
+    {
+        // Only a change the source knows the time of is timed (a delayed
+        // one was detected long ago).
+        switchStart_ = source_->GetModeChangeTime();
+
+        // Stop the output (flushing what's left of the old mode).
+        StopPlayback();
+        if (Config::audioChannels > 0) output_->DisableAudioOutput();
+        output_->DisableVideoOutput();
+
+        EnableOutput(frame->GetDisplayMode());
+
+        // Preroll with the new frame in the first slot, so it goes out as
+        // soon as the playback starts, and hold it up to the target latency.
+        if (Config::audioChannels > 0) AssertSuccess(output_->BeginAudioPreroll());
+        auto picture = Matches(frame) ? frame : blank_;
+        ScheduleFrame(picture, frame);
+        for (auto i = 1; i < latency_.GetTarget(); i++) ScheduleFrame(picture, nullptr);
+        if (Config::audioChannels > 0) AssertSuccess(output_->EndAudioPreroll());
+        if (picture == frame) SetLastFrame(frame);
+
+        measureSwitch_ = true;
+        switchCount_.fetch_add(1, std::memory_order_relaxed);
+
+        // Let the callback back in before the first completion.
+        switching_.store(false, std::memory_order_release);
+        AssertSuccess(output_->StartScheduledPlayback(0, timeScale_, 1));
+    }
+
+    // Stop the scheduled playback and wait until the output says it has
+    // stopped. The driver flushes the frames left and reports the stop
+    // asynchronously, and the output mustn't be disabled before that.
+    void StopPlayback()
+    {
+        BOOL running = FALSE;
+        output_->IsScheduledPlaybackRunning(&running);
+        if (!running) return;
+
+        {
+            std::lock_guard<std::mutex> lock(stopMutex_);
+            stopped_ = false;
+        }
+        output_->StopScheduledPlayback(0, nullptr, timeScale_);
+
+        // Don't hang on a device that has gone away.
+        std::unique_lock<std::mutex> lock(stopMutex_);
+        stopSignal_.wait_for(lock, std::chrono::seconds(1), [this] { return stopped_; });
+    }
+
+    void AddSwitchTime(BMDTimeValue time)
+    {
+        lastSwitchTime_.store(time, std::memory_order_relaxed);
+        if (time > maxSwitchTime_.load(std::memory_order_relaxed))
+            maxSwitchTime_.store(time, std::memory_order_relaxed);
+    }
+
+    // Retrieve the next frame from the source (timed).
+    bool PopFrame(MemoryBackedFrame*& frame)
+    {
+        auto begin = StageTimer::Now();
+        auto popped = source_->TryPopFrame(frame);
+        popTimer_.AddSince(begin);
+        if (popped) queueWaitTimer_.AddSince(frame->GetQueueTime());
+        return popped;
+    }
+
+    void SetLastFrame(MemoryBackedFrame* frame)
+    {
+        if (frame != nullptr) frame->AddRef();
+        if (last_ != nullptr) last_->Release();
+        last_ = frame;
+    }
+
+    // Picture for a slot the input queue has nothing for: the last frame
+    // again (the same object, no copy) up to Config::underrunRepeatLimit
+    // slots, then the blank frame.
+    MemoryBackedFrame* GetUnderrunFrame()
+    {
+        if (underrunSlots_++ == 0) underrunCount_.fetch_add(1, std::memory_order_relaxed);
+
+        auto length = static_cast<uint64_t>(underrunSlots_);
+        if (length > longestUnderrun_.load(std::memory_order_relaxed))
+            longestUnderrun_.store(length, std::memory_order_relaxed);
+
+        if (last_ != nullptr && underrunSlots_ <= Config::underrunRepeatLimit)
+        {
+            repeatedSlots_.fetch_add(1, std::memory_order_relaxed);
+            return last_;
+        }
+
+        blankSlots_.fetch_add(1, std::memory_order_relaxed);
+        return blank_;
+    }
+
+    // Audio sample frames in the next slot
+    long GetSlotSampleFrames() const
+    {
+        return Utility::GetAudioSampleFrameCount(frameCount_, frameDuration_, timeScale_);
+    }
+
+    // Hand the audio of a frame over to the stretcher (silence when it
+    // has none).
+    void PushAudio(const MemoryBackedFrame* frame)
+    {
+        if (frame->GetAudioSampleFrameCount() > 0)
+            stretcher_.Push(frame->GetAudioBytes(), frame->GetAudioSampleFrameCount());
+        else
+            stretcher_.PushSilence(GetSlotSampleFrames());
+    }
+
+    // Keep the audio of a dropped frame and squeeze it into the following
+    // slots. A repeat being prepared is called off, as the two cancel out.
+    void DropAudio(const MemoryBackedFrame* frame)
+    {
+        if (Config::audioChannels == 0) return;
+
+        auto before = stretcher_.CountBuffered();
+        PushAudio(frame);
+        stretcher_.Adjust(stretcher_.CountBuffered() - before, Config::audioStretchSlots);
+        repeatPending_ = false;
+        audioCorrections_++;
+    }
+
+    // Schedule a picture and the audio of the given frame (silence when
+    // it's null or has no audio) in the next slot.
+    void ScheduleFrame(MemoryBackedFrame* frame, const MemoryBackedFrame* audio)
+    {
+        auto begin = StageTimer::Now();
+
+        // Exact integer ticks in the mode's own time scale (no drift)
+        auto time = Utility::GetFrameTime(frameCount_, frameDuration_);
+        output_->ScheduleVideoFrame(frame, time, frameDuration_, timeScale_);
+
+        if (Config::audioChannels > 0)
+        {
+            const void* samples = silence_.data();
+            auto count = GetSlotSampleFrames();
+
+            if (stretcher_.IsAdjusting() || stretcher_.CountBuffered() > 0)
+            {
+                // Around a correction the audio goes through the stretcher,
+                // until the adjustment is done and the rest has been played
+                // out (unless it's being held back for a repeat).
+                if (audio != nullptr) PushAudio(audio);
+                samples = stretcher_.Pull(count, !stretcher_.IsAdjusting() && !repeatPending_);
+            }
+            else if (audio != nullptr && audio->GetAudioSampleFrameCount() > 0)
+            {
+                samples = audio->GetAudioBytes();
+                count = audio->GetAudioSampleFrameCount();
+            }
+
+            unsigned int written;
+            output_->ScheduleAudioSamples(
+                const_cast<void*>(samples), count, time, timeScale_, &written
+            );
+        }
+
         frameCount_++;
+        scheduleTimer_.AddSince(begin);
     }
 };
\ No newline at end of file
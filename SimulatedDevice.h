@@ -0,0 +1,1715 @@
+#pragma once
+
+#include "Common.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+//
+// In-process simulation of a DeckLink input/output pair
+//
+// The input generates frames at the rate of the signal mode and delivers
+// them through IDeckLinkInputCallback (including format detection); the
+// output displays scheduled frames on its own frame clock and reports
+// completed/late/dropped/flushed results through the completion callback.
+// Both run on a shared simulated clock that can be sped up relative to
+// real time, so the whole pipeline can be exercised without hardware.
+//
+
+// Simulated reference clock
+class SimulatedClock
+{
+public:
+
+    explicit SimulatedClock(double speed = 1)
+        : origin_(std::chrono::steady_clock::now()), speed_(speed)
+    {
+    }
+
+    // Simulated time in seconds
+    double Now() const
+    {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - origin_;
+        return elapsed.count() * speed_;
+    }
+
+    // Sleep until the given simulated time (at most maxWait real seconds).
+    void SleepUntil(double time, double maxWait = 0.01) const
+    {
+        auto wait = (std::min)((time - Now()) / speed_, maxWait);
+        if (wait > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+
+    static BMDTimeValue ToTicks(double seconds, BMDTimeScale timeScale)
+    {
+        return static_cast<BMDTimeValue>(seconds * timeScale);
+    }
+
+private:
+
+    std::chrono::steady_clock::time_point origin_;
+    double speed_;
+};
+
+// Attribution of heap allocations
+//
+// A driver takes its frame and packet objects from pools of its own; the
+// simulation just allocates them. Those allocations are made in a device
+// scope, so a heap allocation counter (see Benchmark) can tell them apart
+// from the ones made by the application.
+class SimulatedAllocations final
+{
+public:
+
+    class Scope final
+    {
+    public:
+
+        explicit Scope(bool device = true)
+            : previous_(Device())
+        {
+            Device() = device;
+        }
+
+        ~Scope()
+        {
+            Device() = previous_;
+        }
+
+    private:
+
+        bool previous_;
+    };
+
+    // Whether the calling thread is allocating for the simulated device
+    static bool IsDeviceScope()
+    {
+        return Device();
+    }
+
+private:
+
+    static bool& Device()
+    {
+        static thread_local bool device = false;
+        return device;
+    }
+};
+
+// Display mode description
+class SimulatedDisplayMode final : public IDeckLinkDisplayMode
+{
+public:
+
+    struct Info
+    {
+        BMDDisplayMode mode;
+        const char* name; // Enum name without the bmdMode prefix
+        long width;
+        long height;
+        BMDTimeValue frameDuration;
+        BMDTimeScale timeScale;
+        BMDFieldDominance dominance;
+    };
+
+    // Look up a mode. Returns false for unknown modes.
+    static bool Find(BMDDisplayMode mode, Info& info)
+    {
+        for (const auto& entry : GetTable())
+        {
+            if (entry.mode == mode)
+            {
+                info = entry;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Look up a mode by name ("HD1080i5994", "4K2160p60" etc.).
+    static bool FindByName(const char* name, Info& info)
+    {
+        for (const auto& entry : GetTable())
+        {
+            if (std::strcmp(entry.name, name) == 0)
+            {
+                info = entry;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Every mode the simulation supports
+    static const std::vector<Info>& GetModes()
+    {
+        return GetTable();
+    }
+
+    explicit SimulatedDisplayMode(const Info& info)
+        : refCount_(1), info_(info)
+    {
+    }
+
+    // IUnknown implementation
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
+    {
+        if (iid == IID_IUnknown || iid == IID_IDeckLinkDisplayMode)
+        {
+            *ppv = (IDeckLinkDisplayMode*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // IDeckLinkDisplayMode implementation
+
+    HRESULT STDMETHODCALLTYPE GetName(BSTR* name) override
+    {
+        return E_NOTIMPL;
+    }
+
+    BMDDisplayMode STDMETHODCALLTYPE GetDisplayMode() override
+    {
+        return info_.mode;
+    }
+
+    long STDMETHODCALLTYPE GetWidth() override
+    {
+        return info_.width;
+    }
+
+    long STDMETHODCALLTYPE GetHeight() override
+    {
+        return info_.height;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetFrameRate(BMDTimeValue* frameDuration, BMDTimeScale* timeScale) override
+    {
+        *frameDuration = info_.frameDuration;
+        *timeScale = info_.timeScale;
+        return S_OK;
+    }
+
+    BMDFieldDominance STDMETHODCALLTYPE GetFieldDominance() override
+    {
+        return info_.dominance;
+    }
+
+    BMDDisplayModeFlags STDMETHODCALLTYPE GetFlags() override
+    {
+        return info_.height < 720 ?
+            bmdDisplayModeColorspaceRec601 : bmdDisplayModeColorspaceRec709;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    Info info_;
+
+    static const std::vector<Info>& GetTable()
+    {
+        static const std::vector<Info> table =
+        {
+            { bmdModeNTSC, "NTSC", 720, 486, 1001, 30000, bmdLowerFieldFirst },
+            { bmdModeNTSC2398, "NTSC2398", 720, 486, 1001, 24000, bmdLowerFieldFirst },
+            { bmdModePAL, "PAL", 720, 576, 1000, 25000, bmdUpperFieldFirst },
+            { bmdModeNTSCp, "NTSCp", 720, 486, 1001, 60000, bmdProgressiveFrame },
+            { bmdModePALp, "PALp", 720, 576, 1000, 50000, bmdProgressiveFrame },
+            { bmdModeHD1080p2398, "HD1080p2398", 1920, 1080, 1001, 24000, bmdProgressiveFrame },
+            { bmdModeHD1080p24, "HD1080p24", 1920, 1080, 1000, 24000, bmdProgressiveFrame },
+            { bmdModeHD1080p25, "HD1080p25", 1920, 1080, 1000, 25000, bmdProgressiveFrame },
+            { bmdModeHD1080p2997, "HD1080p2997", 1920, 1080, 1001, 30000, bmdProgressiveFrame },
+            { bmdModeHD1080p30, "HD1080p30", 1920, 1080, 1000, 30000, bmdProgressiveFrame },
+            { bmdModeHD1080p50, "HD1080p50", 1920, 1080, 1000, 50000, bmdProgressiveFrame },
+            { bmdModeHD1080p5994, "HD1080p5994", 1920, 1080, 1001, 60000, bmdProgressiveFrame },
+            { bmdModeHD1080p6000, "HD1080p6000", 1920, 1080, 1000, 60000, bmdProgressiveFrame },
+            { bmdModeHD1080i50, "HD1080i50", 1920, 1080, 1000, 25000, bmdUpperFieldFirst },
+            { bmdModeHD1080i5994, "HD1080i5994", 1920, 1080, 1001, 30000, bmdUpperFieldFirst },
+            { bmdModeHD1080i6000, "HD1080i6000", 1920, 1080, 1000, 30000, bmdUpperFieldFirst },
+            { bmdModeHD720p50, "HD720p50", 1280, 720, 1000, 50000, bmdProgressiveFrame },
+            { bmdModeHD720p5994, "HD720p5994", 1280, 720, 1001, 60000, bmdProgressiveFrame },
+            { bmdModeHD720p60, "HD720p60", 1280, 720, 1000, 60000, bmdProgressiveFrame },
+            { bmdMode2k2398, "2k2398", 2048, 1556, 1001, 24000, bmdProgressiveSegmentedFrame },
+            { bmdMode2k24, "2k24", 2048, 1556, 1000, 24000, bmdProgressiveSegmentedFrame },
+            { bmdMode2k25, "2k25", 2048, 1556, 1000, 25000, bmdProgressiveSegmentedFrame },
+            { bmdMode2kDCI2398, "2kDCI2398", 2048, 1080, 1001, 24000, bmdProgressiveFrame },
+            { bmdMode2kDCI24, "2kDCI24", 2048, 1080, 1000, 24000, bmdProgressiveFrame },
+            { bmdMode2kDCI25, "2kDCI25", 2048, 1080, 1000, 25000, bmdProgressiveFrame },
+            { bmdMode2kDCI2997, "2kDCI2997", 2048, 1080, 1001, 30000, bmdProgressiveFrame },
+            { bmdMode2kDCI30, "2kDCI30", 2048, 1080, 1000, 30000, bmdProgressiveFrame },
+            { bmdMode2kDCI50, "2kDCI50", 2048, 1080, 1000, 50000, bmdProgressiveFrame },
+            { bmdMode2kDCI5994, "2kDCI5994", 2048, 1080, 1001, 60000, bmdProgressiveFrame },
+            { bmdMode2kDCI60, "2kDCI60", 2048, 1080, 1000, 60000, bmdProgressiveFrame },
+            { bmdMode4K2160p2398, "4K2160p2398", 3840, 2160, 1001, 24000, bmdProgressiveFrame },
+            { bmdMode4K2160p24, "4K2160p24", 3840, 2160, 1000, 24000, bmdProgressiveFrame },
+            { bmdMode4K2160p25, "4K2160p25", 3840, 2160, 1000, 25000, bmdProgressiveFrame },
+            { bmdMode4K2160p2997, "4K2160p2997", 3840, 2160, 1001, 30000, bmdProgressiveFrame },
+            { bmdMode4K2160p30, "4K2160p30", 3840, 2160, 1000, 30000, bmdProgressiveFrame },
+            { bmdMode4K2160p50, "4K2160p50", 3840, 2160, 1000, 50000, bmdProgressiveFrame },
+            { bmdMode4K2160p5994, "4K2160p5994", 3840, 2160, 1001, 60000, bmdProgressiveFrame },
+            { bmdMode4K2160p60, "4K2160p60", 3840, 2160, 1000, 60000, bmdProgressiveFrame },
+            { bmdMode4kDCI2398, "4kDCI2398", 4096, 2160, 1001, 24000, bmdProgressiveFrame },
+            { bmdMode4kDCI24, "4kDCI24", 4096, 2160, 1000, 24000, bmdProgressiveFrame },
+            { bmdMode4kDCI25, "4kDCI25", 4096, 2160, 1000, 25000, bmdProgressiveFrame },
+            { bmdMode4kDCI2997, "4kDCI2997", 4096, 2160, 1001, 30000, bmdProgressiveFrame },
+            { bmdMode4kDCI30, "4kDCI30", 4096, 2160, 1000, 30000, bmdProgressiveFrame },
+            { bmdMode4kDCI50, "4kDCI50", 4096, 2160, 1000, 50000, bmdProgressiveFrame },
+            { bmdMode4kDCI5994, "4kDCI5994", 4096, 2160, 1001, 60000, bmdProgressiveFrame },
+            { bmdMode4kDCI60, "4kDCI60", 4096, 2160, 1000, 60000, bmdProgressiveFrame },
+            { bmdMode8K4320p2398, "8K4320p2398", 7680, 4320, 1001, 24000, bmdProgressiveFrame },
+            { bmdMode8K4320p24, "8K4320p24", 7680, 4320, 1000, 24000, bmdProgressiveFrame },
+            { bmdMode8K4320p25, "8K4320p25", 7680, 4320, 1000, 25000, bmdProgressiveFrame },
+            { bmdMode8K4320p2997, "8K4320p2997", 7680, 4320, 1001, 30000, bmdProgressiveFrame },
+            { bmdMode8K4320p30, "8K4320p30", 7680, 4320, 1000, 30000, bmdProgressiveFrame },
+            { bmdMode8K4320p50, "8K4320p50", 7680, 4320, 1000, 50000, bmdProgressiveFrame },
+            { bmdMode8K4320p5994, "8K4320p5994", 7680, 4320, 1001, 60000, bmdProgressiveFrame },
+            { bmdMode8K4320p60, "8K4320p60", 7680, 4320, 1000, 60000, bmdProgressiveFrame },
+            { bmdMode8kDCI2398, "8kDCI2398", 8192, 4320, 1001, 24000, bmdProgressiveFrame },
+            { bmdMode8kDCI24, "8kDCI24", 8192, 4320, 1000, 24000, bmdProgressiveFrame },
+            { bmdMode8kDCI25, "8kDCI25", 8192, 4320, 1000, 25000, bmdProgressiveFrame },
+            { bmdMode8kDCI2997, "8kDCI2997", 8192, 4320, 1001, 30000, bmdProgressiveFrame },
+            { bmdMode8kDCI30, "8kDCI30", 8192, 4320, 1000, 30000, bmdProgressiveFrame },
+            { bmdMode8kDCI50, "8kDCI50", 8192, 4320, 1000, 50000, bmdProgressiveFrame },
+            { bmdMode8kDCI5994, "8kDCI5994", 8192, 4320, 1001, 60000, bmdProgressiveFrame },
+            { bmdMode8kDCI60, "8kDCI60", 8192, 4320, 1000, 60000, bmdProgressiveFrame },
+        };
+        return table;
+    }
+};
+
+// Frame index stamps used to check lip-sync on the output side
+//
+// The input stamps the index of each captured frame (plus one, so zero
+// means "no stamp") into the first row of the picture (32 six-pixel
+// blocks, black or white) and into the first sample of its audio (with
+// the complement in the second channel, so audio that has been resampled
+// on the way doesn't read as a stamp). The output reads both back and
+// compares them.
+class SimulatedStamp
+{
+public:
+
+    static const long Width = 32 * 6;
+
+    static void WriteV210(void* row, uint32_t value)
+    {
+        auto words = static_cast<uint32_t*>(row);
+        for (auto bit = 0; bit < 32; bit++)
+        {
+            uint32_t y = (value >> bit) & 1 ? 940 : 64;
+            words[bit * 4 + 0] = 512 | (y << 10) | (512 << 20);
+            words[bit * 4 + 1] = y | (512 << 10) | (y << 20);
+            words[bit * 4 + 2] = 512 | (y << 10) | (512 << 20);
+            words[bit * 4 + 3] = y | (512 << 10) | (y << 20);
+        }
+    }
+
+    // Read the stamp from an 8-bit ARGB or v210 frame (zero if none).
+    static uint32_t ReadVideo(IDeckLinkVideoFrame* frame)
+    {
+        void* bytes;
+        if (frame->GetWidth() < Width || FAILED(frame->GetBytes(&bytes))) return 0;
+
+        auto format = frame->GetPixelFormat();
+        uint32_t value = 0;
+        for (auto bit = 0; bit < 32; bit++)
+        {
+            bool set;
+            if (format == bmdFormat10BitYUV)
+                set = ((static_cast<uint32_t*>(bytes)[bit * 4 + 2] >> 10) & 0x3ff) > 502;
+            else if (format == bmdFormat8BitARGB)
+                set = static_cast<uint8_t*>(bytes)[(bit * 6 + 3) * 4 + 2] > 128;
+            else
+                return 0;
+            if (set) value |= 1u << bit;
+        }
+        return value;
+    }
+
+    static void WriteAudio(void* samples, BMDAudioSampleType type, uint32_t value)
+    {
+        if (type == bmdAudioSampleType16bitInteger)
+            *static_cast<int16_t*>(samples) = static_cast<int16_t>(value & 0x7fff);
+        else
+            *static_cast<int32_t*>(samples) = static_cast<int32_t>(value & 0x7fffffff);
+    }
+
+    static uint32_t ReadAudio(const void* samples, BMDAudioSampleType type)
+    {
+        if (type == bmdAudioSampleType16bitInteger)
+            return static_cast<uint32_t>(*static_cast<const int16_t*>(samples));
+        else
+            return static_cast<uint32_t>(*static_cast<const int32_t*>(samples));
+    }
+
+    // Stamp the first sample frame (two channels or more).
+    static void WriteAudioStamp(void* samples, BMDAudioSampleType type, uint32_t value)
+    {
+        WriteAudio(samples, type, value);
+        WriteAudio(static_cast<uint8_t*>(samples) + type / 8, type, ~value);
+    }
+
+    // Read the stamp from the first sample frame (zero if none).
+    static uint32_t ReadAudioStamp(const void* samples, BMDAudioSampleType type)
+    {
+        auto mask = type == bmdAudioSampleType16bitInteger ? 0x7fffu : 0x7fffffffu;
+        auto value = ReadAudio(samples, type);
+        auto check = ReadAudio(static_cast<const uint8_t*>(samples) + type / 8, type);
+        return check == (~value & mask) ? value : 0;
+    }
+};
+
+// Captured frame delivered by the simulated input
+class SimulatedInputFrame final : public IDeckLinkVideoInputFrame
+{
+public:
+
+    SimulatedInputFrame(
+        long width, long height, BMDPixelFormat format, BMDFrameFlags flags,
+        IDeckLinkMemoryAllocator* allocator
+    )
+        : refCount_(1), width_(width), height_(height), format_(format),
+          flags_(flags), allocator_(allocator), buffer_(nullptr),
+          streamTime_(0), hardwareTime_(0), frameDuration_(0), timeScale_(1)
+    {
+        rowBytes_ = Utility::GetRowBytes(format, width);
+        auto size = static_cast<unsigned int>(rowBytes_ * height);
+
+        // Use the application's allocator when it installed one.
+        if (allocator_ != nullptr)
+        {
+            SimulatedAllocations::Scope application(false);
+            allocator_->AddRef();
+            AssertSuccess(allocator_->AllocateBuffer(size, &buffer_));
+        }
+        else
+        {
+            buffer_ = new uint8_t[size];
+        }
+    }
+
+    ~SimulatedInputFrame()
+    {
+        if (allocator_ != nullptr)
+        {
+            allocator_->ReleaseBuffer(buffer_);
+            allocator_->Release();
+        }
+        else
+        {
+            delete[] static_cast<uint8_t*>(buffer_);
+        }
+    }
+
+    void SetTiming(
+        BMDTimeValue streamTime, BMDTimeValue frameDuration,
+        BMDTimeScale timeScale, double hardwareTime
+    )
+    {
+        streamTime_ = streamTime;
+        frameDuration_ = frameDuration;
+        timeScale_ = timeScale;
+        hardwareTime_ = hardwareTime;
+    }
+
+    // IUnknown implementation
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
+    {
+        if (iid == IID_IUnknown || iid == IID_IDeckLinkVideoFrame)
+        {
+            *ppv = (IDeckLinkVideoFrame*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        if (iid == IID_IDeckLinkVideoInputFrame)
+        {
+            *ppv = (IDeckLinkVideoInputFrame*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // IDeckLinkVideoFrame implementation
+
+    long STDMETHODCALLTYPE GetWidth() override
+    {
+        return width_;
+    }
+
+    long STDMETHODCALLTYPE GetHeight() override
+    {
+        return height_;
+    }
+
+    long STDMETHODCALLTYPE GetRowBytes() override
+    {
+        return rowBytes_;
+    }
+
+    BMDPixelFormat STDMETHODCALLTYPE GetPixelFormat() override
+    {
+        return format_;
+    }
+
+    BMDFrameFlags STDMETHODCALLTYPE GetFlags() override
+    {
+        return flags_;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetBytes(void** buffer) override
+    {
+        *buffer = buffer_;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetTimecode(BMDTimecodeFormat format, IDeckLinkTimecode** timecode) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetAncillaryData(IDeckLinkVideoFrameAncillary** ancillary) override
+    {
+        return E_NOTIMPL;
+    }
+
+    // IDeckLinkVideoInputFrame implementation
+
+    HRESULT STDMETHODCALLTYPE GetStreamTime(
+        BMDTimeValue* frameTime, BMDTimeValue* frameDuration, BMDTimeScale timeScale
+    ) override
+    {
+        *frameTime = streamTime_ * timeScale / timeScale_;
+        *frameDuration = frameDuration_ * timeScale / timeScale_;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetHardwareReferenceTimestamp(
+        BMDTimeScale timeScale, BMDTimeValue* frameTime, BMDTimeValue* frameDuration
+    ) override
+    {
+        *frameTime = SimulatedClock::ToTicks(hardwareTime_, timeScale);
+        *frameDuration = frameDuration_ * timeScale / timeScale_;
+        return S_OK;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    long width_;
+    long height_;
+    long rowBytes_;
+    BMDPixelFormat format_;
+    BMDFrameFlags flags_;
+    IDeckLinkMemoryAllocator* allocator_;
+    void* buffer_;
+    BMDTimeValue streamTime_;
+    double hardwareTime_;
+    BMDTimeValue frameDuration_;
+    BMDTimeScale timeScale_;
+};
+
+// Audio packet delivered together with a simulated frame
+class SimulatedAudioPacket final : public IDeckLinkAudioInputPacket
+{
+public:
+
+    SimulatedAudioPacket(
+        long sampleFrames, long sampleFrameBytes,
+        BMDTimeValue packetTime, BMDTimeScale timeScale
+    )
+        : refCount_(1), sampleFrames_(sampleFrames),
+          bytes_(static_cast<std::size_t>(sampleFrames * sampleFrameBytes)),
+          packetTime_(packetTime), timeScale_(timeScale)
+    {
+    }
+
+    void* GetData()
+    {
+        return bytes_.data();
+    }
+
+    // IUnknown implementation
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
+    {
+        if (iid == IID_IUnknown || iid == IID_IDeckLinkAudioInputPacket)
+        {
+            *ppv = (IDeckLinkAudioInputPacket*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // IDeckLinkAudioInputPacket implementation
+
+    long STDMETHODCALLTYPE GetSampleFrameCount() override
+    {
+        return sampleFrames_;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetBytes(void** buffer) override
+    {
+        *buffer = bytes_.data();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetPacketTime(BMDTimeValue* packetTime, BMDTimeScale timeScale) override
+    {
+        *packetTime = packetTime_ * timeScale / timeScale_;
+        return S_OK;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    long sampleFrames_;
+    std::vector<uint8_t> bytes_;
+    BMDTimeValue packetTime_;
+    BMDTimeScale timeScale_;
+};
+
+// Simulated video input
+class SimulatedInput final : public IDeckLinkInput
+{
+public:
+
+    // Constructor/destructor
+
+    SimulatedInput(const SimulatedClock& clock, BMDDisplayMode signalMode)
+        : refCount_(1), clock_(clock), signalMode_(signalMode),
+          clockOffset_(0), jitter_(0), callback_(nullptr), allocator_(nullptr),
+          enabled_(false), mode_(bmdModeUnknown), format_(bmdFormat10BitYUV),
+          flags_(bmdVideoInputFlagDefault), audioChannels_(0),
+          audioSampleType_(bmdAudioSampleType16bitInteger),
+          running_(false), paused_(false), quit_(false), frameCount_(0),
+          droppedCount_(0)
+    {
+    }
+
+    ~SimulatedInput()
+    {
+        StopStreams();
+        if (callback_ != nullptr) callback_->Release();
+        if (allocator_ != nullptr) allocator_->Release();
+    }
+
+    // Simulation controls
+
+    // Change the incoming signal (e.g. to simulate a mode switch upstream).
+    void SetSignalMode(BMDDisplayMode mode)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        signalMode_ = mode;
+    }
+
+    // Make the input clock run fast/slow by the given parts per million.
+    void SetClockOffset(double ppm)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clockOffset_ = ppm;
+    }
+
+    // Deliver every frame late by a random time of up to the given number
+    // of milliseconds (like a driver or a bus under load). The frame
+    // timestamps stay on the frame boundaries.
+    void SetJitter(double milliseconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jitter_ = milliseconds / 1000;
+    }
+
+    // Number of frames delivered to the callback
+    uint64_t CountFrames() const
+    {
+        return frameCount_.load(std::memory_order_relaxed);
+    }
+
+    // Number of frames lost to stalls of the capture thread (frame times
+    // that had passed by the time it ran again)
+    uint64_t CountDroppedFrames() const
+    {
+        return droppedCount_.load(std::memory_order_relaxed);
+    }
+
+    // IUnknown implementation
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
+    {
+        if (iid == IID_IUnknown || iid == IID_IDeckLinkInput)
+        {
+            *ppv = (IDeckLinkInput*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // IDeckLinkInput implementation
+
+    HRESULT STDMETHODCALLTYPE DoesSupportVideoMode(
+        BMDDisplayMode displayMode, BMDPixelFormat pixelFormat,
+        BMDVideoInputFlags flags, BMDDisplayModeSupport* result,
+        IDeckLinkDisplayMode** resultDisplayMode
+    ) override
+    {
+        SimulatedDisplayMode::Info info;
+        auto found = SimulatedDisplayMode::Find(displayMode, info);
+        if (result != nullptr)
+            *result = found ? bmdDisplayModeSupported : bmdDisplayModeNotSupported;
+        if (resultDisplayMode != nullptr)
+            *resultDisplayMode = found ? new SimulatedDisplayMode(info) : nullptr;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDisplayModeIterator(IDeckLinkDisplayModeIterator** iterator) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback* previewCallback) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE EnableVideoInput(
+        BMDDisplayMode displayMode, BMDPixelFormat pixelFormat, BMDVideoInputFlags flags
+    ) override
+    {
+        SimulatedDisplayMode::Info info;
+        if (!SimulatedDisplayMode::Find(displayMode, info)) return E_INVALIDARG;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        enabled_ = true;
+        mode_ = displayMode;
+        format_ = pixelFormat;
+        flags_ = flags;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE DisableVideoInput() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enabled_ = false;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetAvailableVideoFrameCount(unsigned int* availableFrameCount) override
+    {
+        *availableFrameCount = 0;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetVideoInputFrameMemoryAllocator(IDeckLinkMemoryAllocator* theAllocator) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (theAllocator != nullptr) theAllocator->AddRef();
+        if (allocator_ != nullptr) allocator_->Release();
+        allocator_ = theAllocator;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE EnableAudioInput(
+        BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType, unsigned int channelCount
+    ) override
+    {
+        if (sampleRate != bmdAudioSampleRate48kHz) return E_INVALIDARG;
+        if (channelCount != 2 && channelCount != 8 && channelCount != 16) return E_INVALIDARG;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        audioChannels_ = channelCount;
+        audioSampleType_ = sampleType;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE DisableAudioInput() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        audioChannels_ = 0;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetAvailableAudioSampleFrameCount(unsigned int* availableSampleFrameCount) override
+    {
+        *availableSampleFrameCount = 0;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE StartStreams() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!enabled_) return E_FAIL;
+
+        // Resuming after PauseStreams (possibly from inside the callback).
+        if (running_)
+        {
+            paused_ = false;
+            return S_OK;
+        }
+
+        // The driver commits the application's allocator before streaming
+        // (and decommits it when stopped).
+        if (allocator_ != nullptr) allocator_->Commit();
+
+        running_ = true;
+        paused_ = false;
+        quit_ = false;
+        thread_ = std::thread(&SimulatedInput::CaptureLoop, this);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE StopStreams() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) return S_OK;
+            quit_ = true;
+        }
+
+        // Must not be called from the callback thread (same as the driver).
+        thread_.join();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+        if (allocator_ != nullptr) allocator_->Decommit();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE PauseStreams() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_ = true;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE FlushStreams() override
+    {
+        // Frames are delivered as soon as they are captured; nothing to flush.
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetCallback(IDeckLinkInputCallback* theCallback) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (theCallback != nullptr) theCallback->AddRef();
+        if (callback_ != nullptr) callback_->Release();
+        callback_ = theCallback;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetHardwareReferenceClock(
+        BMDTimeScale desiredTimeScale, BMDTimeValue* hardwareTime,
+        BMDTimeValue* timeInFrame, BMDTimeValue* ticksPerFrame
+    ) override
+    {
+        *hardwareTime = SimulatedClock::ToTicks(clock_.Now(), desiredTimeScale);
+        *timeInFrame = 0;
+        *ticksPerFrame = 0;
+        return S_OK;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    SimulatedClock clock_;
+    BMDDisplayMode signalMode_;
+    double clockOffset_;
+    double jitter_; // Maximum delivery delay in seconds
+    IDeckLinkInputCallback* callback_;
+    IDeckLinkMemoryAllocator* allocator_;
+    bool enabled_;
+    BMDDisplayMode mode_;
+    BMDPixelFormat format_;
+    BMDVideoInputFlags flags_;
+    unsigned int audioChannels_;
+    BMDAudioSampleType audioSampleType_;
+    bool running_;
+    bool paused_;
+    bool quit_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::atomic<uint64_t> frameCount_;
+    std::atomic<uint64_t> droppedCount_;
+
+    // Test pattern for the current mode
+    std::vector<uint8_t> pattern_;
+    BMDDisplayMode patternMode_;
+
+    // Fill pattern_ with 75% color bars in v210.
+    void BuildPattern(const SimulatedDisplayMode::Info& info)
+    {
+        // Y, Cb, Cr of white, yellow, cyan, green, magenta, red, blue
+        static const uint32_t bars[7][3] =
+        {
+            { 721, 512, 512 }, { 674, 176, 543 }, { 581, 589, 176 },
+            { 534, 253, 207 }, { 251, 771, 817 }, { 204, 435, 848 },
+            { 111, 848, 481 }
+        };
+
+        auto rowBytes = Utility::GetRowBytes(bmdFormat10BitYUV, info.width);
+        pattern_.assign(static_cast<size_t>(rowBytes) * info.height, 0);
+
+        // Build a single row and replicate it.
+        auto row = reinterpret_cast<uint32_t*>(pattern_.data());
+        for (long x = 0; x < info.width; x += 6)
+        {
+            uint32_t y[6], cb[3], cr[3];
+            for (auto i = 0; i < 6; i++)
+            {
+                auto bar = (std::min)((x + i) * 7 / info.width, 6L);
+                y[i] = bars[bar][0];
+                if (i % 2 == 0)
+                {
+                    cb[i / 2] = bars[bar][1];
+                    cr[i / 2] = bars[bar][2];
+                }
+            }
+            auto words = row + x / 6 * 4;
+            words[0] = cb[0] | (y[0] << 10) | (cr[0] << 20);
+            words[1] = y[1] | (cb[1] << 10) | (y[2] << 20);
+            words[2] = cr[1] | (y[3] << 10) | (cb[2] << 20);
+            words[3] = y[4] | (cr[2] << 10) | (y[5] << 20);
+        }
+
+        for (long i = 1; i < info.height; i++)
+            std::memcpy(pattern_.data() + rowBytes * i, pattern_.data(), rowBytes);
+
+        patternMode_ = info.mode;
+    }
+
+    void CaptureLoop()
+    {
+        // The stream clock starts on the next frame boundary.
+        auto origin = clock_.Now();
+        BMDDisplayMode notifiedMode = bmdModeUnknown;
+        uint64_t index = 0;
+
+        // Frame boundaries are counted from the last change of the period
+        // (signal mode or clock offset), so a change doesn't shift them.
+        uint64_t originIndex = 0;
+        double lastPeriod = 0;
+        patternMode_ = bmdModeUnknown;
+
+        // Delivery delay of the current frame (jitter)
+        std::mt19937 random(1);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        auto delayIndex = ~uint64_t(0);
+        double delay = 0;
+
+        while (true)
+        {
+            IDeckLinkInputCallback* callback;
+            IDeckLinkMemoryAllocator* allocator;
+            SimulatedDisplayMode::Info signal, enabled;
+            BMDPixelFormat format;
+            BMDVideoInputFlags flags;
+            unsigned int audioChannels;
+            BMDAudioSampleType audioSampleType;
+            bool paused;
+            double period;
+            double jitter;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (quit_) break;
+                SimulatedDisplayMode::Find(signalMode_, signal);
+                SimulatedDisplayMode::Find(mode_, enabled);
+                format = format_;
+                flags = flags_;
+                audioChannels = audioChannels_;
+                audioSampleType = audioSampleType_;
+                paused = paused_ || !enabled_;
+                jitter = jitter_;
+                callback = callback_;
+                allocator = allocator_;
+                if (callback != nullptr) callback->AddRef();
+                if (allocator != nullptr) allocator->AddRef();
+
+                // The frame period follows the signal, on the input clock.
+                period = static_cast<double>(signal.frameDuration) /
+                    signal.timeScale / (1 + clockOffset_ * 1e-6);
+            }
+
+            if (period != lastPeriod)
+            {
+                origin += lastPeriod * (index - originIndex);
+                originIndex = index;
+                lastPeriod = period;
+            }
+
+            if (delayIndex != index)
+            {
+                delay = jitter * uniform(random);
+                delayIndex = index;
+            }
+
+            // Wait for the next frame boundary (and the delivery delay).
+            auto due = origin + period * (index - originIndex + 1);
+            auto now = clock_.Now();
+
+            // After a stall (the thread wasn't scheduled in time) the
+            // frames whose time has passed are gone, like on a device with
+            // no buffer to spare: skip to the current frame boundary
+            // instead of delivering them back to back. The gap shows in
+            // the stream time and the frame stamps.
+            if (now >= due + delay + period)
+            {
+                auto missed = static_cast<uint64_t>((now - due - delay) / period);
+                if (!paused && callback != nullptr)
+                    droppedCount_.fetch_add(missed, std::memory_order_relaxed);
+                index += missed;
+                due = origin + period * (index - originIndex + 1);
+            }
+
+            if (now < due + delay)
+            {
+                clock_.SleepUntil(due + delay);
+            }
+            else if (!paused && callback != nullptr)
+            {
+                if (signal.mode != enabled.mode &&
+                    (flags & bmdVideoInputEnableFormatDetection) &&
+                    notifiedMode != signal.mode)
+                {
+                    // Report the new signal format once.
+                    notifiedMode = signal.mode;
+                    SimulatedDisplayMode* mode;
+                    {
+                        SimulatedAllocations::Scope device;
+                        mode = new SimulatedDisplayMode(signal);
+                    }
+                    callback->VideoInputFormatChanged(
+                        bmdVideoInputDisplayModeChanged, mode,
+                        bmdDetectedVideoInputYCbCr422
+                    );
+                    mode->Release();
+                }
+                else
+                {
+                    // Deliver a frame in the enabled mode. When it doesn't
+                    // match the signal, the frame is flagged as having no
+                    // input source (and left empty).
+                    auto valid = signal.mode == enabled.mode;
+                    SimulatedInputFrame* frame;
+                    {
+                        SimulatedAllocations::Scope device;
+                        frame = new SimulatedInputFrame(
+                            enabled.width, enabled.height, format,
+                            valid ? bmdFrameFlagDefault : bmdFrameHasNoInputSource,
+                            allocator
+                        );
+                    }
+
+                    if (valid && format == bmdFormat10BitYUV)
+                    {
+                        if (patternMode_ != enabled.mode) BuildPattern(enabled);
+                        void* bytes;
+                        frame->GetBytes(&bytes);
+                        std::memcpy(bytes, pattern_.data(), pattern_.size());
+                        SimulatedStamp::WriteV210(bytes, static_cast<uint32_t>(index + 1));
+                    }
+
+                    auto streamTime = Utility::GetFrameTime(index, enabled.frameDuration);
+                    frame->SetTiming(
+                        streamTime, enabled.frameDuration, enabled.timeScale, due
+                    );
+
+                    // The audio of the frame period (following the 48 kHz
+                    // cadence), a ramp stamped with the frame index.
+                    SimulatedAudioPacket* audio = nullptr;
+                    if (audioChannels > 0)
+                    {
+                        auto count = Utility::GetAudioSampleFrameCount(
+                            index, enabled.frameDuration, enabled.timeScale
+                        );
+                        auto sampleBytes = static_cast<long>(audioSampleType / 8);
+                        {
+                            SimulatedAllocations::Scope device;
+                            audio = new SimulatedAudioPacket(
+                                count, sampleBytes * audioChannels, streamTime, enabled.timeScale
+                            );
+                        }
+                        auto data = static_cast<uint8_t*>(audio->GetData());
+                        for (long i = 0; i < count; i++)
+                            for (unsigned int ch = 0; ch < audioChannels; ch++)
+                                SimulatedStamp::WriteAudio(
+                                    data + (i * audioChannels + ch) * sampleBytes,
+                                    audioSampleType, static_cast<uint32_t>(i * 16 + ch)
+                                );
+                        if (valid) SimulatedStamp::WriteAudioStamp(
+                            data, audioSampleType, static_cast<uint32_t>(index + 1)
+                        );
+                    }
+
+                    callback->VideoInputFrameArrived(frame, audio);
+                    frame->Release();
+                    if (audio != nullptr) audio->Release();
+                    frameCount_.fetch_add(1, std::memory_order_relaxed);
+                }
+                index++;
+            }
+            else
+            {
+                // Paused or no callback: the clock keeps running.
+                index++;
+            }
+
+            if (callback != nullptr) callback->Release();
+            if (allocator != nullptr) allocator->Release();
+        }
+    }
+};
+
+// Simulated video output
+class SimulatedOutput final : public IDeckLinkOutput
+{
+public:
+
+    // Completion statistics
+    struct Stats
+    {
+        uint64_t completed;
+        uint64_t displayedLate;
+        uint64_t dropped;
+        uint64_t flushed;
+        uint64_t underruns; // Frame slots with nothing to display
+        uint64_t audioSampleFrames; // Audio scheduled
+        uint64_t lipSyncChecks;     // Displayed frames checked against their audio
+        uint64_t lipSyncMismatches; // ... whose audio came from another frame
+        double maxLipSyncError;     // Worst audio/video offset in samples
+    };
+
+    // Constructor/destructor
+
+    explicit SimulatedOutput(const SimulatedClock& clock)
+        : refCount_(1), clock_(clock), clockOffset_(0), callback_(nullptr),
+          enabled_(false), playing_(false), quit_(false),
+          startTime_(0), onAir_(nullptr), onAirResult_(bmdOutputFrameCompleted),
+          completing_(), audioChannels_(0),
+          audioSampleType_(bmdAudioSampleType16bitInteger), stats_()
+    {
+        mode_.mode = bmdModeUnknown;
+        scheduled_.reserve(64);
+        audioBlocks_.reserve(64);
+        completions_.reserve(64);
+    }
+
+    ~SimulatedOutput()
+    {
+        StopScheduledPlayback(0, nullptr, 1);
+        DisableVideoOutput();
+        if (callback_ != nullptr) callback_->Release();
+    }
+
+    // Simulation controls
+
+    // Make the output clock run fast/slow by the given parts per million.
+    void SetClockOffset(double ppm)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clockOffset_ = ppm;
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // IUnknown implementation
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID* ppv) override
+    {
+        if (iid == IID_IUnknown || iid == IID_IDeckLinkOutput)
+        {
+            *ppv = (IDeckLinkOutput*)this;
+            AddRef();
+            return S_OK;
+        }
+
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // IDeckLinkOutput implementation
+
+    HRESULT STDMETHODCALLTYPE DoesSupportVideoMode(
+        BMDDisplayMode displayMode, BMDPixelFormat pixelFormat,
+        BMDVideoOutputFlags flags, BMDDisplayModeSupport* result,
+        IDeckLinkDisplayMode** resultDisplayMode
+    ) override
+    {
+        SimulatedDisplayMode::Info info;
+        auto found = SimulatedDisplayMode::Find(displayMode, info);
+        if (result != nullptr)
+            *result = found ? bmdDisplayModeSupported : bmdDisplayModeNotSupported;
+        if (resultDisplayMode != nullptr)
+            *resultDisplayMode = found ? new SimulatedDisplayMode(info) : nullptr;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDisplayModeIterator(IDeckLinkDisplayModeIterator** iterator) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback* previewCallback) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE EnableVideoOutput(BMDDisplayMode displayMode, BMDVideoOutputFlags flags) override
+    {
+        SimulatedDisplayMode::Info info;
+        if (!SimulatedDisplayMode::Find(displayMode, info)) return E_INVALIDARG;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (playing_) return E_FAIL;
+        enabled_ = true;
+        mode_ = info;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE DisableVideoOutput() override
+    {
+        std::vector<IDeckLinkVideoFrame*> frames;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (playing_) return E_FAIL;
+            enabled_ = false;
+            for (auto& entry : scheduled_) frames.push_back(entry.frame);
+            scheduled_.clear();
+            if (onAir_ != nullptr) frames.push_back(onAir_);
+            onAir_ = nullptr;
+        }
+        for (auto frame : frames) frame->Release();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetVideoOutputFrameMemoryAllocator(IDeckLinkMemoryAllocator* theAllocator) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateVideoFrame(
+        int width, int height, int rowBytes, BMDPixelFormat pixelFormat,
+        BMDFrameFlags flags, IDeckLinkMutableVideoFrame** outFrame
+    ) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateAncillaryData(
+        BMDPixelFormat pixelFormat, IDeckLinkVideoFrameAncillary** outBuffer
+    ) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE DisplayVideoFrameSync(IDeckLinkVideoFrame* theFrame) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE ScheduleVideoFrame(
+        IDeckLinkVideoFrame* theFrame, BMDTimeValue displayTime,
+        BMDTimeValue displayDuration, BMDTimeScale timeScale
+    ) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!enabled_) return E_FAIL;
+
+        // Keep the list sorted by display time (normally an append).
+        Scheduled entry = { theFrame, displayTime * mode_.timeScale / timeScale };
+        auto it = scheduled_.end();
+        while (it != scheduled_.begin() && (it - 1)->time > entry.time) --it;
+        scheduled_.insert(it, entry);
+
+        theFrame->AddRef();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback* theCallback) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (theCallback != nullptr) theCallback->AddRef();
+        if (callback_ != nullptr) callback_->Release();
+        callback_ = theCallback;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetBufferedVideoFrameCount(unsigned int* bufferedFrameCount) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *bufferedFrameCount = static_cast<unsigned int>(scheduled_.size());
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE EnableAudioOutput(
+        BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType,
+        unsigned int channelCount, BMDAudioOutputStreamType streamType
+    ) override
+    {
+        if (sampleRate != bmdAudioSampleRate48kHz) return E_INVALIDARG;
+        if (channelCount != 2 && channelCount != 8 && channelCount != 16) return E_INVALIDARG;
+
+        // Only timestamped streams are simulated.
+        if (streamType != bmdAudioOutputStreamTimestamped) return E_NOTIMPL;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        audioChannels_ = channelCount;
+        audioSampleType_ = sampleType;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE DisableAudioOutput() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        audioChannels_ = 0;
+        audioBlocks_.clear();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE WriteAudioSamplesSync(
+        void* buffer, unsigned int sampleFrameCount, unsigned int* sampleFramesWritten
+    ) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE BeginAudioPreroll() override
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE EndAudioPreroll() override
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE ScheduleAudioSamples(
+        void* buffer, unsigned int sampleFrameCount, BMDTimeValue streamTime,
+        BMDTimeScale timeScale, unsigned int* sampleFramesWritten
+    ) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (audioChannels_ == 0) return E_FAIL;
+
+        // Only the position and the stamp of the block are kept.
+        AudioBlock block;
+        block.time = static_cast<double>(streamTime) / timeScale;
+        block.sampleFrames = sampleFrameCount;
+        block.stamp = sampleFrameCount > 0 ?
+            SimulatedStamp::ReadAudioStamp(buffer, audioSampleType_) : 0;
+        audioBlocks_.push_back(block);
+
+        stats_.audioSampleFrames += sampleFrameCount;
+        if (sampleFramesWritten != nullptr) *sampleFramesWritten = sampleFrameCount;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetBufferedAudioSampleFrameCount(unsigned int* bufferedSampleFrameCount) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        unsigned int count = 0;
+        for (auto& block : audioBlocks_) count += block.sampleFrames;
+        *bufferedSampleFrameCount = count;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE FlushBufferedAudioSamples() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        audioBlocks_.clear();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetAudioCallback(IDeckLinkAudioOutputCallback* theCallback) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE StartScheduledPlayback(
+        BMDTimeValue playbackStartTime, BMDTimeScale timeScale, double playbackSpeed
+    ) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!enabled_ || playing_) return E_FAIL;
+
+        playing_ = true;
+        quit_ = false;
+        startTime_ = playbackStartTime * mode_.timeScale / timeScale;
+        thread_ = std::thread(&SimulatedOutput::PlaybackLoop, this);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE StopScheduledPlayback(
+        BMDTimeValue stopPlaybackAtTime, BMDTimeValue* actualStopTime, BMDTimeScale timeScale
+    ) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!playing_) return S_OK;
+            quit_ = true;
+        }
+
+        // Must not be called from the callback thread (same as the driver).
+        thread_.join();
+
+        IDeckLinkVideoOutputCallback* callback;
+        std::vector<Scheduled> flushed;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            playing_ = false;
+            flushed.swap(scheduled_);
+            stats_.flushed += flushed.size();
+            callback = callback_;
+            if (callback != nullptr) callback->AddRef();
+        }
+
+        // Flush whatever hasn't been displayed.
+        for (auto& entry : flushed)
+        {
+            if (callback != nullptr)
+                callback->ScheduledFrameCompleted(entry.frame, bmdOutputFrameFlushed);
+            entry.frame->Release();
+        }
+
+        if (callback != nullptr)
+        {
+            callback->ScheduledPlaybackHasStopped();
+            callback->Release();
+        }
+
+        if (actualStopTime != nullptr) *actualStopTime = stopPlaybackAtTime;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE IsScheduledPlaybackRunning(BOOL* active) override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *active = playing_;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetScheduledStreamTime(
+        BMDTimeScale desiredTimeScale, BMDTimeValue* streamTime, double* playbackSpeed
+    ) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetReferenceStatus(BMDReferenceStatus* referenceStatus) override
+    {
+        return E_NOTIMPL;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetHardwareReferenceClock(
+        BMDTimeScale desiredTimeScale, BMDTimeValue* hardwareTime,
+        BMDTimeValue* timeInFrame, BMDTimeValue* ticksPerFrame
+    ) override
+    {
+        *hardwareTime = SimulatedClock::ToTicks(clock_.Now(), desiredTimeScale);
+        *timeInFrame = 0;
+        *ticksPerFrame = 0;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetFrameCompletionReferenceTimestamp(
+        IDeckLinkVideoFrame* theFrame, BMDTimeScale desiredTimeScale,
+        BMDTimeValue* frameCompletionTimestamp
+    ) override
+    {
+        // Only valid for the frame being completed right now (which is how
+        // it's used from the completion callback).
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (theFrame != completing_.frame) return E_FAIL;
+        *frameCompletionTimestamp =
+            SimulatedClock::ToTicks(completing_.time, desiredTimeScale);
+        return S_OK;
+    }
+
+private:
+
+    struct Scheduled
+    {
+        IDeckLinkVideoFrame* frame;
+        BMDTimeValue time; // In the mode's time scale
+    };
+
+    struct Completion
+    {
+        IDeckLinkVideoFrame* frame;
+        BMDOutputFrameCompletionResult result;
+    };
+
+    struct AudioBlock
+    {
+        double time; // Stream time in seconds
+        unsigned int sampleFrames;
+        uint32_t stamp;
+    };
+
+    struct Completing
+    {
+        IDeckLinkVideoFrame* frame;
+        double time;
+    };
+
+    std::atomic<ULONG> refCount_;
+    SimulatedClock clock_;
+    double clockOffset_;
+    IDeckLinkVideoOutputCallback* callback_;
+    SimulatedDisplayMode::Info mode_;
+    bool enabled_;
+    bool playing_;
+    bool quit_;
+    BMDTimeValue startTime_;
+    std::vector<Scheduled> scheduled_;
+    IDeckLinkVideoFrame* onAir_;
+    BMDOutputFrameCompletionResult onAirResult_;
+    std::vector<Completion> completions_; // Used by the playback thread only
+    Completing completing_;
+    unsigned int audioChannels_;
+    BMDAudioSampleType audioSampleType_;
+    std::vector<AudioBlock> audioBlocks_;
+    Stats stats_;
+    std::thread thread_;
+    mutable std::mutex mutex_;
+
+    // Compare the frame going on air with the audio scheduled at its time
+    // (needs the lock).
+    void CheckLipSync(const Scheduled& video)
+    {
+        auto time = static_cast<double>(video.time) / mode_.timeScale;
+        auto frameTime = static_cast<double>(mode_.frameDuration) / mode_.timeScale;
+
+        // Audio blocks before this frame have been played out.
+        size_t played = 0;
+        while (played < audioBlocks_.size() &&
+               audioBlocks_[played].time < time - frameTime / 2) played++;
+        audioBlocks_.erase(audioBlocks_.begin(), audioBlocks_.begin() + played);
+
+        if (audioBlocks_.empty()) return;
+        auto& audio = audioBlocks_.front();
+
+        // Only frames and audio that both carry a stamp can be compared
+        // (blank frames and repeated slots don't).
+        auto mask = audioSampleType_ == bmdAudioSampleType16bitInteger ? 0x7fffu : 0x7fffffffu;
+        auto stamp = SimulatedStamp::ReadVideo(video.frame) & mask;
+        if (stamp == 0 || audio.stamp == 0) return;
+
+        // Offset between the two in samples, including whole frames when
+        // the audio belongs to another frame.
+        auto frames = static_cast<double>(static_cast<int32_t>(stamp - audio.stamp));
+        auto error = std::abs((time - audio.time - frames * frameTime) * 48000);
+
+        stats_.lipSyncChecks++;
+        if (stamp != audio.stamp) stats_.lipSyncMismatches++;
+        stats_.maxLipSyncError = (std::max)(stats_.maxLipSyncError, error);
+    }
+
+    void PlaybackLoop()
+    {
+        auto origin = clock_.Now();
+
+        for (uint64_t tick = 0;; tick++)
+        {
+            double period;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (quit_) return;
+                period = static_cast<double>(mode_.frameDuration) /
+                    mode_.timeScale / (1 + clockOffset_ * 1e-6);
+            }
+
+            // Wait for the frame boundary (checking for stop regularly).
+            auto due = origin + period * tick;
+            while (clock_.Now() < due)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (quit_) return;
+                }
+                clock_.SleepUntil(due);
+            }
+
+            IDeckLinkVideoOutputCallback* callback;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                // The frame that was on air until now has completed.
+                completions_.clear();
+                if (onAir_ != nullptr)
+                    completions_.push_back(Completion{ onAir_, onAirResult_ });
+                onAir_ = nullptr;
+
+                // Pick the frame for this slot. Frames whose slot has
+                // passed are shown late if nothing else is due, otherwise
+                // they are dropped.
+                auto slot = startTime_ + static_cast<BMDTimeValue>(tick) * mode_.frameDuration;
+                auto end = slot + mode_.frameDuration;
+                size_t count = 0;
+                while (count < scheduled_.size() && scheduled_[count].time < end) count++;
+
+                if (count > 0)
+                {
+                    auto& last = scheduled_[count - 1];
+                    onAir_ = last.frame;
+                    onAirResult_ = last.time < slot ?
+                        bmdOutputFrameDisplayedLate : bmdOutputFrameCompleted;
+
+                    for (size_t i = 0; i + 1 < count; i++)
+                        completions_.push_back(Completion{ scheduled_[i].frame, bmdOutputFrameDropped });
+
+                    CheckLipSync(last);
+
+                    scheduled_.erase(scheduled_.begin(), scheduled_.begin() + count);
+                }
+                else
+                {
+                    stats_.underruns++;
+                }
+
+                for (auto& c : completions_)
+                {
+                    if (c.result == bmdOutputFrameCompleted) stats_.completed++;
+                    if (c.result == bmdOutputFrameDisplayedLate) stats_.displayedLate++;
+                    if (c.result == bmdOutputFrameDropped) stats_.dropped++;
+                }
+
+                callback = callback_;
+                if (callback != nullptr) callback->AddRef();
+            }
+
+            for (auto& c : completions_)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    completing_.frame = c.frame;
+                    completing_.time = due;
+                }
+                if (callback != nullptr) callback->ScheduledFrameCompleted(c.frame, c.result);
+                c.frame->Release();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                completing_.frame = nullptr;
+            }
+
+            if (callback != nullptr) callback->Release();
+        }
+    }
+};
+
+// Factory for a simulated input/output pair sharing a clock
+class SimulatedDevice
+{
+public:
+
+    static auto CreateInputOutput(BMDDisplayMode signalMode, double speed = 1)
+    {
+        SimulatedClock clock(speed);
+        auto input = new SimulatedInput(clock, signalMode);
+        auto output = new SimulatedOutput(clock);
+        return std::make_tuple(input, output);
+    }
+
+    // One input feeding several outputs, all on the same clock
+    static auto CreateInputOutputs(
+        BMDDisplayMode signalMode, int outputCount, double speed = 1
+    )
+    {
+        SimulatedClock clock(speed);
+        auto input = new SimulatedInput(clock, signalMode);
+        std::vector<SimulatedOutput*> outputs;
+        for (auto i = 0; i < outputCount; i++)
+            outputs.push_back(new SimulatedOutput(clock));
+        return std::make_tuple(input, outputs);
+    }
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+// Accumulated time spent in a pipeline stage
+//
+// Timestamps are read from the CPU time stamp counter (invariant on any
+// CPU this runs on), which only takes a few nanoseconds. Every thread adds
+// its measurements to a counter cell of its own on a separate cache line,
+// so the hot path has no locked instructions and threads never contend.
+// The cells are summed up when the totals are read, which can be done at
+// any time (a snapshot may be off by the sample in flight). The longest
+// single measurement is tracked as well, since the last ResetPeak().
+class StageTimer final
+{
+public:
+
+    struct Stats
+    {
+        uint64_t calls;       // Number of measurements
+        uint64_t nanoseconds; // Total time spent in the stage
+        uint64_t peakNanoseconds; // Longest measurement since ResetPeak()
+
+        // Difference from an earlier snapshot (for periodic sampling)
+        Stats Since(const Stats& earlier) const
+        {
+            Stats stats;
+            stats.calls = calls - earlier.calls;
+            stats.nanoseconds = nanoseconds - earlier.nanoseconds;
+            stats.peakNanoseconds = peakNanoseconds;
+            return stats;
+        }
+    };
+
+    StageTimer()
+        : epoch_(1)
+    {
+        // Place the cells on cache line boundaries within the storage.
+        auto address = reinterpret_cast<uintptr_t>(storage_);
+        address = (address + CacheLineSize - 1) & ~static_cast<uintptr_t>(CacheLineSize - 1);
+        cells_ = reinterpret_cast<Cell*>(address);
+        for (auto i = 0; i <= MaxThreads; i++) new (&cells_[i]) Cell();
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    // Current time stamp counter value (for the begin/end of a measurement)
+    static int64_t Now()
+    {
+        return static_cast<int64_t>(__rdtsc());
+    }
+
+    // Add the time elapsed since the given Now() value.
+    void AddSince(int64_t begin)
+    {
+        auto ticks = static_cast<uint64_t>(Now() - begin);
+        auto index = GetThreadIndex();
+
+        if (index < MaxThreads)
+        {
+            // Only this thread writes to the cell: plain loads and stores.
+            auto& cell = cells_[index];
+            cell.calls.store(cell.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            cell.ticks.store(cell.ticks.load(std::memory_order_relaxed) + ticks, std::memory_order_relaxed);
+
+            // The peak starts over when the epoch has moved on.
+            auto epoch = epoch_.load(std::memory_order_relaxed);
+            if (cell.epoch.load(std::memory_order_relaxed) != epoch)
+            {
+                cell.epoch.store(epoch, std::memory_order_relaxed);
+                cell.peak.store(ticks, std::memory_order_relaxed);
+            }
+            else if (ticks > cell.peak.load(std::memory_order_relaxed))
+            {
+                cell.peak.store(ticks, std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            // More threads than cells: the rest share the last one (not
+            // included in the peak).
+            auto& overflow = cells_[MaxThreads];
+            overflow.calls.fetch_add(1, std::memory_order_relaxed);
+            overflow.ticks.fetch_add(ticks, std::memory_order_relaxed);
+        }
+    }
+
+    // Start tracking the longest measurement over.
+    void ResetPeak()
+    {
+        epoch_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Stats GetStats() const
+    {
+        uint64_t calls = cells_[MaxThreads].calls.load(std::memory_order_relaxed);
+        uint64_t ticks = cells_[MaxThreads].ticks.load(std::memory_order_relaxed);
+        uint64_t peak = 0;
+        auto epoch = epoch_.load(std::memory_order_relaxed);
+        for (auto i = 0; i < MaxThreads; i++)
+        {
+            auto& cell = cells_[i];
+            calls += cell.calls.load(std::memory_order_relaxed);
+            ticks += cell.ticks.load(std::memory_order_relaxed);
+            if (cell.epoch.load(std::memory_order_relaxed) == epoch)
+                peak = (std::max)(peak, cell.peak.load(std::memory_order_relaxed));
+        }
+
+        Stats stats;
+        stats.calls = calls;
+        stats.nanoseconds = static_cast<uint64_t>(ticks / GetTicksPerNanosecond());
+        stats.peakNanoseconds = static_cast<uint64_t>(peak / GetTicksPerNanosecond());
+        return stats;
+    }
+
+    // Time stamp counter rate, measured once against the steady clock
+    static double GetTicksPerNanosecond()
+    {
+        static const double rate = Calibrate();
+        return rate;
+    }
+
+private:
+
+    static const int MaxThreads = 128;
+    static const size_t CacheLineSize = 64;
+
+    // Counters of a thread, a cache line of their own
+    struct alignas(CacheLineSize) Cell
+    {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> ticks;
+        std::atomic<uint64_t> peak;
+        std::atomic<uint32_t> epoch;
+        char pad[CacheLineSize - 3 * sizeof(uint64_t) - sizeof(uint32_t)];
+
+        Cell()
+            : calls(0), ticks(0), peak(0), epoch(0)
+        {
+        }
+    };
+
+    // Cells of the threads and the overflow one after them. The timers are
+    // members of heap objects, and new ignores over-alignment before
+    // C++17, so the cells are aligned by hand within a line to spare.
+    char storage_[(MaxThreads + 2) * CacheLineSize];
+    Cell* cells_;
+    std::atomic<uint32_t> epoch_;
+
+    // Thread indices given back by threads that have exited
+    struct IndexPool
+    {
+        std::mutex mutex;
+        std::vector<int> free;
+        int next;
+
+        IndexPool()
+            : next(0)
+        {
+            free.reserve(MaxThreads);
+        }
+    };
+
+    static IndexPool& GetIndexPool()
+    {
+        static IndexPool pool;
+        return pool;
+    }
+
+    // Index of a thread, taken on its first measurement and given back
+    // when it exits, so that threads coming and going (conversion workers,
+    // export readers) don't use the cells up.
+    class ThreadIndex final
+    {
+    public:
+
+        ThreadIndex()
+        {
+            auto& pool = GetIndexPool();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (pool.free.empty())
+            {
+                value = pool.next++;
+            }
+            else
+            {
+                value = pool.free.back();
+                pool.free.pop_back();
+            }
+        }
+
+        ~ThreadIndex()
+        {
+            auto& pool = GetIndexPool();
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.free.push_back(value);
+        }
+
+        int value;
+    };
+
+    // Small process-wide index of the calling thread. The cell of an index
+    // is only ever written by one thread at a time: the mutex orders the
+    // last writes of an exited thread before the first of the next one.
+    static int GetThreadIndex()
+    {
+        thread_local ThreadIndex index;
+        return index.value;
+    }
+
+    static double Calibrate()
+    {
+        using namespace std::chrono;
+        auto t0 = steady_clock::now();
+        auto c0 = Now();
+        std::this_thread::sleep_for(milliseconds(20));
+        auto c1 = Now();
+        auto t1 = steady_clock::now();
+        return static_cast<double>(c1 - c0) / duration_cast<nanoseconds>(t1 - t0).count();
+    }
+};
@@ -0,0 +1,537 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameSource.h"
+#include "MemoryBackedFrame.h"
+#include "Receiver.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Timeshift (delay) ring of captured frames
+//
+// Holds the last N frames of a receiver in fixed-size slots of a single
+// mapping, so playing the input out seconds to minutes late takes a
+// bounded amount of memory decided up front. The mapping is backed by a
+// file when a path is given (the system pages the frames out to it as it
+// sees fit), by the page file otherwise, using large pages when
+// Config::useLargePages is set and the privilege is held.
+//
+// A writer thread takes the frames through an output queue of its own
+// and copies them into the ring. Frame #i always goes to slot i % N, so
+// any frame within the window is found in O(1). Readers get frames that
+// are views of the slot memory (no copy). A slot is pinned while such a
+// frame is held, and the writer drops a new frame rather than overwrite
+// a pinned slot.
+class Timeshift final : public FrameRecycler
+{
+public:
+
+    struct Stats
+    {
+        uint64_t written;  // Frames stored
+        uint64_t dropped;  // Frames not stored (slot pinned or frame too large)
+        uint64_t misses;   // Reads of frames no longer (or never) in the ring
+        size_t slotCount;
+        size_t slotSize;   // Bytes per slot
+        bool fileBacked;
+        bool largePages;
+    };
+
+    // Constructor/destructor
+
+    Timeshift()
+        : refCount_(1), receiver_(nullptr), queue_(-1), mapping_(nullptr),
+          view_(nullptr), mappedSize_(0), slotSize_(0), quit_(false),
+          writeCount_(0), stats_()
+    {
+    }
+
+    ~Timeshift()
+    {
+        assert(receiver_ == nullptr); // The writer should have been stopped.
+
+        // Every frame handed out has to be back by now (each holds a
+        // reference to the timeshift).
+        for (auto& slot : slots_)
+        {
+            assert(slot.pins == 0);
+            delete slot.frame;
+        }
+
+        if (view_ != nullptr)
+        {
+            UnmapViewOfFile(view_);
+            CloseHandle(mapping_);
+        }
+    }
+
+    // Public methods
+
+    // Slot size for frames of the given size and format, with the audio
+    // that comes with them
+    static size_t GetSlotSize(long width, long height, BMDPixelFormat format)
+    {
+        auto pixels = static_cast<size_t>(Utility::GetRowBytes(format, width)) * height;
+        auto audio = static_cast<size_t>(
+            Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()
+        );
+        return RoundUp(pixels, PageSize) + RoundUp(audio, PageSize) + PageSize;
+    }
+
+    // Map a ring of slotCount slots (of GetSlotSize bytes) and start storing
+    // the frames of a receiver in it. The ring is backed by the given file
+    // (replaced), or by the page file when the path is null. Returns false
+    // when the mapping can't be created.
+    bool Start(Receiver* receiver, size_t slotCount, size_t slotSize, const char* path)
+    {
+        assert(receiver_ == nullptr && view_ == nullptr);
+
+        slotSize_ = RoundUp(slotSize, PageSize);
+        if (!Map(static_cast<uint64_t>(slotSize_) * slotCount, path)) return false;
+
+        slots_ = std::vector<Slot>(slotCount);
+        stats_.slotCount = slotCount;
+        stats_.slotSize = slotSize_;
+        stats_.fileBacked = path != nullptr;
+
+        // Get our own queue of (shared) frames from the receiver.
+        receiver_ = receiver;
+        receiver_->AddRef();
+        queue_ = receiver_->AttachOutput();
+        assert(queue_ >= 0);
+
+        quit_.store(false, std::memory_order_relaxed);
+        writer_ = std::thread(&Timeshift::WriterLoop, this);
+        return true;
+    }
+
+    // Stop storing frames. The frames in the ring can still be read.
+    void Stop()
+    {
+        assert(receiver_ != nullptr);
+
+        quit_.store(true, std::memory_order_release);
+        writer_.join();
+
+        receiver_->DetachOutput(queue_);
+        queue_ = -1;
+        receiver_->Release();
+        receiver_ = nullptr;
+    }
+
+    // Number of frames the ring has seen (the index of the next one)
+    uint64_t CountWrittenFrames() const
+    {
+        return writeCount_.load(std::memory_order_acquire);
+    }
+
+    size_t GetSlotCount() const
+    {
+        return slots_.size();
+    }
+
+    // Retrieve frame #index if it's in the ring. The frame is a view of the
+    // slot, which stays pinned until the frame is released. Several
+    // readers asking for the same frame share the view.
+    bool TryReadFrame(uint64_t index, MemoryBackedFrame*& frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto& slot = slots_[index % slots_.size()];
+        if (slot.index != index + 1)
+        {
+            stats_.misses++;
+            return false;
+        }
+
+        if (slot.pins == 0)
+        {
+            auto header = GetHeader(index);
+            auto memory = GetSlotMemory(index);
+
+            // The view is kept for the next round unless the format
+            // changed, so reading normally doesn't allocate.
+            if (slot.frame != nullptr &&
+                (slot.frame->GetWidth() != header->width ||
+                 slot.frame->GetHeight() != header->height ||
+                 slot.frame->GetPixelFormat() != header->format))
+            {
+                delete slot.frame;
+                slot.frame = nullptr;
+            }
+
+            if (slot.frame == nullptr)
+                slot.frame = new MemoryBackedFrame(
+                    header->width, header->height, header->format, memory, this
+                );
+            else
+                slot.frame->AddRef(); // Revive the idle view.
+
+            slot.frame->SetCaptureTime(header->captureTime);
+            slot.frame->SetQueueTime(header->queueTime);
+            slot.frame->SetDisplayMode(header->displayMode);
+            slot.frame->SetGeneration(header->generation);
+            slot.frame->SetTimecodeBCD(header->timecode);
+            if (header->audioSampleFrames > 0)
+                slot.frame->SetAudio(memory + GetAudioOffset(), header->audioSampleFrames);
+            else
+                slot.frame->ClearAudio();
+
+            // Keep the timeshift alive while the frame is out.
+            slot.pins++;
+            AddRef();
+        }
+        else if (slot.frame->AddRef() == 0)
+        {
+            // Revived while its last release is on the way to RecycleFrame:
+            // that one will only take back the previous pin.
+            slot.pins++;
+            AddRef();
+        }
+
+        frame = slot.frame;
+        return true;
+    }
+
+    Stats GetStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // Reference counting (same semantics as the COM objects)
+
+    ULONG AddRef()
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release()
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+    // FrameRecycler implementation
+
+    void RecycleFrame(MemoryBackedFrame* frame) override
+    {
+        {
+            // The slot is found from the memory the frame is a view of.
+            void* bytes;
+            frame->GetBytes(&bytes);
+            auto offset = static_cast<size_t>(static_cast<uint8_t*>(bytes) - view_);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[offset / slotSize_].pins--;
+        }
+
+        // Drop the reference taken in TryReadFrame.
+        Release();
+    }
+
+private:
+
+    static const size_t PageSize = 4096;
+
+    // Frame properties, stored in the last page of the slot (after the
+    // pixels and the audio)
+    struct Header
+    {
+        BMDTimeValue captureTime;
+        int64_t queueTime;
+        long width;
+        long height;
+        BMDPixelFormat format;
+        BMDDisplayMode displayMode;
+        uint32_t generation;
+        BMDTimecodeBCD timecode;
+        long audioSampleFrames;
+    };
+
+    // Slot bookkeeping (in process memory, under the lock)
+    struct Slot
+    {
+        uint64_t index; // Index of the frame held + 1 (zero: none)
+        int pins;       // Times the view went out and hasn't come back yet
+        MemoryBackedFrame* frame; // View of the slot
+
+        Slot()
+            : index(0), pins(0), frame(nullptr)
+        {
+        }
+    };
+
+    std::atomic<ULONG> refCount_;
+    Receiver* receiver_;
+    int queue_;
+    HANDLE mapping_;
+    uint8_t* view_;
+    uint64_t mappedSize_;
+    size_t slotSize_;
+    std::vector<Slot> slots_;
+    std::thread writer_;
+    std::atomic<bool> quit_;
+    std::atomic<uint64_t> writeCount_;
+    Stats stats_;
+    mutable std::mutex mutex_;
+
+    static size_t RoundUp(size_t size, size_t unit)
+    {
+        return (size + unit - 1) / unit * unit;
+    }
+
+    uint8_t* GetSlotMemory(uint64_t index) const
+    {
+        return view_ + (index % slots_.size()) * slotSize_;
+    }
+
+    // Offset of the audio in a slot (also the room for the pixels)
+    size_t GetAudioOffset() const
+    {
+        return slotSize_ - PageSize - RoundUp(
+            static_cast<size_t>(Config::audioFrameCapacity * Utility::GetAudioSampleFrameBytes()),
+            PageSize
+        );
+    }
+
+    Header* GetHeader(uint64_t index) const
+    {
+        return reinterpret_cast<Header*>(GetSlotMemory(index) + slotSize_ - sizeof(Header));
+    }
+
+    bool Map(uint64_t size, const char* path)
+    {
+        HANDLE file = INVALID_HANDLE_VALUE;
+        if (path != nullptr)
+        {
+            file = CreateFileA(
+                path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL, nullptr
+            );
+            if (file == INVALID_HANDLE_VALUE) return false;
+        }
+
+        // Large pages are only available for page file backed mappings,
+        // and need the "Lock pages in memory" privilege.
+        auto largePage = GetLargePageMinimum();
+        if (path == nullptr && Config::useLargePages && largePage > 0)
+        {
+            // In 64 bits like the size (size_t is 32 bits wide on Win32).
+            auto unit = static_cast<uint64_t>(largePage);
+            auto rounded = (size + unit - 1) / unit * unit;
+            mapping_ = CreateFileMappingA(
+                INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES,
+                static_cast<DWORD>(rounded >> 32), static_cast<DWORD>(rounded), nullptr
+            );
+            if (mapping_ != nullptr)
+            {
+                view_ = static_cast<uint8_t*>(MapViewOfFile(
+                    mapping_, FILE_MAP_ALL_ACCESS | FILE_MAP_LARGE_PAGES, 0, 0, 0
+                ));
+                if (view_ != nullptr) size = rounded;
+                else CloseHandle(mapping_);
+            }
+            stats_.largePages = view_ != nullptr;
+        }
+
+        if (view_ == nullptr)
+        {
+            mapping_ = CreateFileMappingA(
+                file, nullptr, PAGE_READWRITE,
+                static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr
+            );
+            if (mapping_ != nullptr)
+            {
+                view_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+                if (view_ == nullptr) CloseHandle(mapping_);
+            }
+        }
+
+        // The mapping keeps the file open.
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+
+        if (view_ == nullptr)
+        {
+            mapping_ = nullptr;
+            return false;
+        }
+
+        mappedSize_ = size;
+        return true;
+    }
+
+    void WriterLoop()
+    {
+        while (!quit_.load(std::memory_order_acquire))
+        {
+            MemoryBackedFrame* frame;
+            if (receiver_->TryPopFrame(queue_, frame))
+            {
+                Write(frame);
+                frame->Release();
+            }
+            else
+            {
+                // Nothing new: the queue holds several frames, so polling
+                // leaves plenty of headroom.
+                std::this_thread::sleep_for(std::chrono::milliseconds(Config::writerPollInterval));
+            }
+        }
+    }
+
+    // Store a frame as the next one. It takes up its index even when it
+    // can't be stored, so frame indices keep following the capture.
+    void Write(MemoryBackedFrame* frame)
+    {
+        auto index = writeCount_.load(std::memory_order_relaxed);
+        auto& slot = slots_[index % slots_.size()];
+
+        void* bytes;
+        frame->GetBytes(&bytes);
+        auto size = static_cast<size_t>(frame->GetRowBytes()) * frame->GetHeight();
+        auto fits = RoundUp(size, PageSize) <= GetAudioOffset();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (slot.pins > 0 || !fits)
+            {
+                // Let the reader keep the old frame.
+                stats_.dropped++;
+                writeCount_.store(index + 1, std::memory_order_release);
+                return;
+            }
+            slot.index = 0; // Being written
+        }
+
+        // Pixels, audio and the properties (no lock needed: the slot
+        // can't be read while its index is cleared)
+        auto memory = GetSlotMemory(index);
+        std::memcpy(memory, bytes, size);
+
+        auto audioFrames = frame->GetAudioSampleFrameCount();
+        if (audioFrames > 0)
+            std::memcpy(
+                memory + GetAudioOffset(), frame->GetAudioBytes(),
+                static_cast<size_t>(audioFrames * Utility::GetAudioSampleFrameBytes())
+            );
+
+        auto header = GetHeader(index);
+        header->captureTime = frame->GetCaptureTime();
+        header->queueTime = frame->GetQueueTime();
+        header->width = frame->GetWidth();
+        header->height = frame->GetHeight();
+        header->format = frame->GetPixelFormat();
+        header->displayMode = frame->GetDisplayMode();
+        header->generation = frame->GetGeneration();
+        header->timecode = frame->GetTimecodeBCD();
+        header->audioSampleFrames = audioFrames;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slot.index = index + 1;
+            stats_.written++;
+        }
+        writeCount_.store(index + 1, std::memory_order_release);
+    }
+};
+
+// Frames of a timeshift ring, a given number of frames behind the latest
+// one (delayed playout)
+class TimeshiftSource final : public FrameSource
+{
+public:
+
+    TimeshiftSource(Timeshift* timeshift, int delayFrames)
+        : refCount_(1), timeshift_(timeshift), delay_(delayFrames), seekDelay_(-1)
+    {
+        assert(static_cast<size_t>(delayFrames) < timeshift->GetSlotCount());
+        timeshift_->AddRef();
+        readIndex_ = GetDelayPoint();
+    }
+
+    ~TimeshiftSource()
+    {
+        timeshift_->Release();
+    }
+
+    // Move the read point to another delay (in frames). Can be called from
+    // any thread; takes effect from the next retrieval, and any frame
+    // within the ring can be reached at once.
+    void Seek(int delayFrames)
+    {
+        assert(static_cast<size_t>(delayFrames) < timeshift_->GetSlotCount());
+        seekDelay_.store(delayFrames, std::memory_order_relaxed);
+    }
+
+    // FrameSource implementation
+
+    bool TryPopFrame(MemoryBackedFrame*& frame) override
+    {
+        ApplySeek();
+
+        // Start over at the delay point if the read point has fallen out
+        // of the ring.
+        if (timeshift_->CountWrittenFrames() - readIndex_ >= timeshift_->GetSlotCount())
+            readIndex_ = GetDelayPoint();
+
+        if (readIndex_ >= GetDelayPoint()) return false;
+
+        // A frame the ring couldn't store leaves a gap of one slot.
+        return timeshift_->TryReadFrame(readIndex_++, frame);
+    }
+
+    // Frames up to the delay point
+    size_t CountQueuedFrames() override
+    {
+        ApplySeek();
+        auto end = GetDelayPoint();
+        return end > readIndex_ ? static_cast<size_t>(end - readIndex_) : 0;
+    }
+
+    bool IsLive() const override
+    {
+        return true;
+    }
+
+    ULONG AddRef() override
+    {
+        return refCount_.fetch_add(1);
+    }
+
+    ULONG Release() override
+    {
+        auto val = refCount_.fetch_sub(1);
+        if (val == 1) delete this;
+        return val;
+    }
+
+private:
+
+    std::atomic<ULONG> refCount_;
+    Timeshift* timeshift_;
+    int delay_;          // Delay in frames
+    uint64_t readIndex_; // Next frame to retrieve
+    std::atomic<int> seekDelay_; // New delay to move to (-1: none)
+
+    void ApplySeek()
+    {
+        auto seek = seekDelay_.exchange(-1, std::memory_order_relaxed);
+        if (seek < 0) return;
+        delay_ = seek;
+        readIndex_ = GetDelayPoint();
+    }
+
+    // Index of the frame that is due at the current delay
+    uint64_t GetDelayPoint() const
+    {
+        auto written = timeshift_->CountWrittenFrames();
+        auto delay = static_cast<uint64_t>(delay_);
+        return written > delay ? written - delay : 0;
+    }
+};
@@ -0,0 +1,458 @@
+#pragma once
+
+#include "Common.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define V210_TARGET(isa)
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define V210_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// v210 (10-bit YUV 4:2:2) to 8-bit ARGB/BGRA converter
+//
+// The scalar path is the reference. The SSE4.1 and AVX2 paths use the same
+// fixed-point arithmetic, so their output is bit-exact against it. The
+// fastest path supported by the CPU is selected at construction.
+class V210Converter final
+{
+public:
+
+    enum class Kernel { Scalar, SSE41, AVX2 };
+
+    // Constructor
+
+    V210Converter()
+        : kernel_(DetectKernel())
+    {
+        BuildTables();
+    }
+
+    // Public methods
+
+    Kernel GetKernel() const
+    {
+        return kernel_;
+    }
+
+    // Force a specific kernel (e.g. for comparison against the reference).
+    void SetKernel(Kernel kernel)
+    {
+        kernel_ = kernel;
+    }
+
+    static const char* GetKernelName(Kernel kernel)
+    {
+        switch (kernel)
+        {
+        case Kernel::SSE41: return "SSE4.1";
+        case Kernel::AVX2: return "AVX2";
+        default: return "Scalar";
+        }
+    }
+
+    // Convert a whole frame.
+    void Convert(IDeckLinkVideoFrame* source, IDeckLinkVideoFrame* destination)
+    {
+        ConvertRows(source, destination, 0, source->GetHeight());
+    }
+
+    // Convert the rows in [rowBegin, rowEnd).
+    void ConvertRows(
+        IDeckLinkVideoFrame* source, IDeckLinkVideoFrame* destination,
+        long rowBegin, long rowEnd
+    )
+    {
+        assert(source->GetPixelFormat() == bmdFormat10BitYUV);
+        assert(source->GetWidth() == destination->GetWidth());
+        assert(source->GetHeight() == destination->GetHeight());
+
+        void* src;
+        void* dst;
+        AssertSuccess(source->GetBytes(&src));
+        AssertSuccess(destination->GetBytes(&dst));
+
+        ConvertRows(
+            static_cast<const uint8_t*>(src), source->GetRowBytes(),
+            static_cast<uint8_t*>(dst), destination->GetRowBytes(),
+            destination->GetPixelFormat(),
+            source->GetWidth(), source->GetHeight(), rowBegin, rowEnd
+        );
+    }
+
+    void ConvertRows(
+        const uint8_t* src, long srcRowBytes,
+        uint8_t* dst, long dstRowBytes,
+        BMDPixelFormat dstFormat,
+        long width, long height, long rowBegin, long rowEnd
+    ) const
+    {
+        assert(dstFormat == bmdFormat8BitARGB || dstFormat == bmdFormat8BitBGRA);
+
+        auto bgra = dstFormat == bmdFormat8BitBGRA;
+
+        // Rec.601 for SD, Rec.709 for everything else.
+        const auto& coeffs = height < 720 ? Rec601 : Rec709;
+
+        for (auto row = rowBegin; row < rowEnd; row++)
+        {
+            auto srcRow = reinterpret_cast<const uint32_t*>(src + srcRowBytes * row);
+            auto dstRow = reinterpret_cast<uint32_t*>(dst + dstRowBytes * row);
+
+            long done = 0;
+            if (kernel_ == Kernel::AVX2)
+                done = ConvertRowAVX2(srcRow, dstRow, width, coeffs, bgra);
+            else if (kernel_ == Kernel::SSE41)
+                done = ConvertRowSSE41(srcRow, dstRow, width, coeffs, bgra);
+
+            // The scalar path handles whatever the SIMD path left over.
+            ConvertRowScalar(srcRow, dstRow, done, width, coeffs, bgra);
+        }
+    }
+
+private:
+
+    // Fixed-point YCbCr to RGB coefficients (13 fractional bits, including
+    // the 10-bit to 8-bit scaling)
+    struct Coefficients
+    {
+        int32_t y, crToR, cbToG, crToG, cbToB;
+    };
+
+    static const Coefficients Rec601;
+    static const Coefficients Rec709;
+
+    static const int Shift = 13;
+    static const int Round = 1 << (Shift - 1);
+
+    // Location of a 10-bit component inside a 6-pixel (4-word) v210 block
+    struct Field
+    {
+        int word;
+        int shift;
+    };
+
+    static const Field YFields[6];
+    static const Field CbFields[6];
+    static const Field CrFields[6];
+
+    // Lookup tables for the SIMD paths
+    //
+    // SSE4.1 converts 12 pixels (8 words) per step as three 4-lane vectors,
+    // AVX2 converts 24 pixels (16 words) per step as three 8-lane vectors.
+    // Each vector loads a window of words starting at a base offset and
+    // gathers its Y/Cb/Cr words from there.
+    struct SSE41Tables
+    {
+        int base[3];
+        uint8_t shuffle[3][3][16]; // [vector][Y/Cb/Cr][byte]
+        int32_t multiplier[3][3][4];
+    };
+
+    struct AVX2Tables
+    {
+        int base[3];
+        int32_t permute[3][3][8];
+        int32_t shift[3][3][8];
+    };
+
+    Kernel kernel_;
+    SSE41Tables sse41_;
+    AVX2Tables avx2_;
+
+    // Runtime CPU feature detection
+
+    static void CPUID(int leaf, int subleaf, uint32_t regs[4])
+    {
+    #if defined(_MSC_VER)
+        int r[4];
+        __cpuidex(r, leaf, subleaf);
+        for (auto i = 0; i < 4; i++) regs[i] = static_cast<uint32_t>(r[i]);
+    #else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+    #endif
+    }
+
+    static uint64_t XGetBV()
+    {
+    #if defined(_MSC_VER)
+        return _xgetbv(0);
+    #else
+        uint32_t eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<uint64_t>(edx) << 32) | eax;
+    #endif
+    }
+
+    static Kernel DetectKernel()
+    {
+        uint32_t regs[4];
+        CPUID(0, 0, regs);
+        auto maxLeaf = regs[0];
+        if (maxLeaf < 1) return Kernel::Scalar;
+
+        CPUID(1, 0, regs);
+        auto sse41 = (regs[2] & (1u << 19)) != 0;
+        auto osxsave = (regs[2] & (1u << 27)) != 0;
+        auto avx = (regs[2] & (1u << 28)) != 0;
+
+        // AVX2 also needs the OS to save the YMM state.
+        if (maxLeaf >= 7 && osxsave && avx && (XGetBV() & 6) == 6)
+        {
+            CPUID(7, 0, regs);
+            if (regs[1] & (1u << 5)) return Kernel::AVX2;
+        }
+
+        return sse41 ? Kernel::SSE41 : Kernel::Scalar;
+    }
+
+    // Lookup table construction
+
+    static Field Locate(const Field fields[6], int pixel)
+    {
+        auto field = fields[pixel % 6];
+        field.word += pixel / 6 * 4;
+        return field;
+    }
+
+    template <int Lanes>
+    static int FindBase(int vector, int totalWords)
+    {
+        auto base = totalWords;
+        for (auto lane = 0; lane < Lanes; lane++)
+        {
+            auto pixel = vector * Lanes + lane;
+            base = (std::min)(base, Locate(YFields, pixel).word);
+            base = (std::min)(base, Locate(CbFields, pixel).word);
+            base = (std::min)(base, Locate(CrFields, pixel).word);
+        }
+        // Keep the load window inside the step.
+        return (std::min)(base, totalWords - Lanes);
+    }
+
+    void BuildTables()
+    {
+        const Field* fields[3] = { YFields, CbFields, CrFields };
+
+        for (auto v = 0; v < 3; v++)
+        {
+            sse41_.base[v] = FindBase<4>(v, 8);
+            avx2_.base[v] = FindBase<8>(v, 16);
+
+            for (auto c = 0; c < 3; c++)
+            {
+                for (auto lane = 0; lane < 4; lane++)
+                {
+                    auto f = Locate(fields[c], v * 4 + lane);
+                    auto word = f.word - sse41_.base[v];
+                    assert(word >= 0 && word < 4);
+                    for (auto i = 0; i < 4; i++)
+                        sse41_.shuffle[v][c][lane * 4 + i] =
+                            static_cast<uint8_t>(word * 4 + i);
+                    // Shift the field to the top of the lane with a multiply.
+                    sse41_.multiplier[v][c][lane] = 1 << (22 - f.shift);
+                }
+
+                for (auto lane = 0; lane < 8; lane++)
+                {
+                    auto f = Locate(fields[c], v * 8 + lane);
+                    auto word = f.word - avx2_.base[v];
+                    assert(word >= 0 && word < 8);
+                    avx2_.permute[v][c][lane] = word;
+                    avx2_.shift[v][c][lane] = f.shift;
+                }
+            }
+        }
+    }
+
+    // Scalar reference path
+
+    static int32_t Clamp(int32_t x)
+    {
+        return x < 0 ? 0 : (x > 255 ? 255 : x);
+    }
+
+    static void ConvertRowScalar(
+        const uint32_t* src, uint32_t* dst, long begin, long end,
+        const Coefficients& c, bool bgra
+    )
+    {
+        for (auto p = begin; p < end; p++)
+        {
+            auto fy = Locate(YFields, p);
+            auto fcb = Locate(CbFields, p);
+            auto fcr = Locate(CrFields, p);
+
+            auto y = static_cast<int32_t>((src[fy.word] >> fy.shift) & 0x3ff) - 64;
+            auto cb = static_cast<int32_t>((src[fcb.word] >> fcb.shift) & 0x3ff) - 512;
+            auto cr = static_cast<int32_t>((src[fcr.word] >> fcr.shift) & 0x3ff) - 512;
+
+            auto yt = y * c.y + Round;
+            auto r = static_cast<uint32_t>(Clamp((yt + cr * c.crToR) >> Shift));
+            auto g = static_cast<uint32_t>(Clamp((yt + cb * c.cbToG + cr * c.crToG) >> Shift));
+            auto b = static_cast<uint32_t>(Clamp((yt + cb * c.cbToB) >> Shift));
+
+            dst[p] = bgra ?
+                b | (g << 8) | (r << 16) | 0xff000000u :
+                0xffu | (r << 8) | (g << 16) | (b << 24);
+        }
+    }
+
+    // SSE4.1 path
+
+    V210_TARGET("sse4.1")
+    long ConvertRowSSE41(
+        const uint32_t* src, uint32_t* dst, long width,
+        const Coefficients& c, bool bgra
+    ) const
+    {
+        const auto cy = _mm_set1_epi32(c.y);
+        const auto crToR = _mm_set1_epi32(c.crToR);
+        const auto cbToG = _mm_set1_epi32(c.cbToG);
+        const auto crToG = _mm_set1_epi32(c.crToG);
+        const auto cbToB = _mm_set1_epi32(c.cbToB);
+        const auto round = _mm_set1_epi32(Round);
+        const auto yOffset = _mm_set1_epi32(64);
+        const auto cOffset = _mm_set1_epi32(512);
+        const auto zero = _mm_setzero_si128();
+        const auto max = _mm_set1_epi32(255);
+        const auto alpha = _mm_set1_epi32(static_cast<int>(bgra ? 0xff000000u : 0xffu));
+
+        long p = 0;
+        for (; p + 12 <= width; p += 12, src += 8, dst += 12)
+        {
+            for (auto v = 0; v < 3; v++)
+            {
+                auto words = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(src + sse41_.base[v])
+                );
+
+                __m128i comp[3];
+                for (auto i = 0; i < 3; i++)
+                {
+                    auto x = _mm_shuffle_epi8(words, _mm_loadu_si128(
+                        reinterpret_cast<const __m128i*>(sse41_.shuffle[v][i])
+                    ));
+                    x = _mm_mullo_epi32(x, _mm_loadu_si128(
+                        reinterpret_cast<const __m128i*>(sse41_.multiplier[v][i])
+                    ));
+                    comp[i] = _mm_srli_epi32(x, 22);
+                }
+
+                auto y = _mm_sub_epi32(comp[0], yOffset);
+                auto cb = _mm_sub_epi32(comp[1], cOffset);
+                auto cr = _mm_sub_epi32(comp[2], cOffset);
+
+                auto yt = _mm_add_epi32(_mm_mullo_epi32(y, cy), round);
+                auto r = _mm_add_epi32(yt, _mm_mullo_epi32(cr, crToR));
+                auto g = _mm_add_epi32(yt, _mm_add_epi32(
+                    _mm_mullo_epi32(cb, cbToG), _mm_mullo_epi32(cr, crToG)
+                ));
+                auto b = _mm_add_epi32(yt, _mm_mullo_epi32(cb, cbToB));
+
+                r = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(r, Shift), zero), max);
+                g = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(g, Shift), zero), max);
+                b = _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(b, Shift), zero), max);
+
+                auto out = bgra ?
+                    _mm_or_si128(
+                        _mm_or_si128(b, _mm_slli_epi32(g, 8)),
+                        _mm_or_si128(_mm_slli_epi32(r, 16), alpha)) :
+                    _mm_or_si128(
+                        _mm_or_si128(alpha, _mm_slli_epi32(r, 8)),
+                        _mm_or_si128(_mm_slli_epi32(g, 16), _mm_slli_epi32(b, 24)));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + v * 4), out);
+            }
+        }
+        return p;
+    }
+
+    // AVX2 path
+
+    V210_TARGET("avx2")
+    long ConvertRowAVX2(
+        const uint32_t* src, uint32_t* dst, long width,
+        const Coefficients& c, bool bgra
+    ) const
+    {
+        const auto cy = _mm256_set1_epi32(c.y);
+        const auto crToR = _mm256_set1_epi32(c.crToR);
+        const auto cbToG = _mm256_set1_epi32(c.cbToG);
+        const auto crToG = _mm256_set1_epi32(c.crToG);
+        const auto cbToB = _mm256_set1_epi32(c.cbToB);
+        const auto round = _mm256_set1_epi32(Round);
+        const auto yOffset = _mm256_set1_epi32(64);
+        const auto cOffset = _mm256_set1_epi32(512);
+        const auto mask = _mm256_set1_epi32(0x3ff);
+        const auto zero = _mm256_setzero_si256();
+        const auto max = _mm256_set1_epi32(255);
+        const auto alpha = _mm256_set1_epi32(static_cast<int>(bgra ? 0xff000000u : 0xffu));
+
+        long p = 0;
+        for (; p + 24 <= width; p += 24, src += 16, dst += 24)
+        {
+            for (auto v = 0; v < 3; v++)
+            {
+                auto words = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(src + avx2_.base[v])
+                );
+
+                __m256i comp[3];
+                for (auto i = 0; i < 3; i++)
+                {
+                    auto x = _mm256_permutevar8x32_epi32(words, _mm256_loadu_si256(
+                        reinterpret_cast<const __m256i*>(avx2_.permute[v][i])
+                    ));
+                    x = _mm256_srlv_epi32(x, _mm256_loadu_si256(
+                        reinterpret_cast<const __m256i*>(avx2_.shift[v][i])
+                    ));
+                    comp[i] = _mm256_and_si256(x, mask);
+                }
+
+                auto y = _mm256_sub_epi32(comp[0], yOffset);
+                auto cb = _mm256_sub_epi32(comp[1], cOffset);
+                auto cr = _mm256_sub_epi32(comp[2], cOffset);
+
+                auto yt = _mm256_add_epi32(_mm256_mullo_epi32(y, cy), round);
+                auto r = _mm256_add_epi32(yt, _mm256_mullo_epi32(cr, crToR));
+                auto g = _mm256_add_epi32(yt, _mm256_add_epi32(
+                    _mm256_mullo_epi32(cb, cbToG), _mm256_mullo_epi32(cr, crToG)
+                ));
+                auto b = _mm256_add_epi32(yt, _mm256_mullo_epi32(cb, cbToB));
+
+                r = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(r, Shift), zero), max);
+                g = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(g, Shift), zero), max);
+                b = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(b, Shift), zero), max);
+
+                auto out = bgra ?
+                    _mm256_or_si256(
+                        _mm256_or_si256(b, _mm256_slli_epi32(g, 8)),
+                        _mm256_or_si256(_mm256_slli_epi32(r, 16), alpha)) :
+                    _mm256_or_si256(
+                        _mm256_or_si256(alpha, _mm256_slli_epi32(r, 8)),
+                        _mm256_or_si256(_mm256_slli_epi32(g, 16), _mm256_slli_epi32(b, 24)));
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + v * 8), out);
+            }
+        }
+        return p;
+    }
+};
+
+// 255/876 for luma, 255/896 * 2(1 - K) style terms for chroma, scaled by 2^13
+const V210Converter::Coefficients V210Converter::Rec601 = { 2385, 3269, -802, -1665, 4131 };
+const V210Converter::Coefficients V210Converter::Rec709 = { 2385, 3672, -437, -1091, 4326 };
+
+// Component positions in a v210 block:
+// word0 = Cb0 Y0 Cr0, word1 = Y1 Cb2 Y2, word2 = Cr2 Y3 Cb4, word3 = Y4 Cr4 Y5
+const V210Converter::Field V210Converter::YFields[6] =
+    { { 0, 10 }, { 1, 0 }, { 1, 20 }, { 2, 10 }, { 3, 0 }, { 3, 20 } };
+const V210Converter::Field V210Converter::CbFields[6] =
+    { { 0, 0 }, { 0, 0 }, { 1, 10 }, { 1, 10 }, { 2, 20 }, { 2, 20 } };
+const V210Converter::Field V210Converter::CrFields[6] =
+    { { 0, 20 }, { 0, 20 }, { 2, 0 }, { 2, 0 }, { 3, 10 }, { 3, 10 } };
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads running band-parallel jobs
+//
+// A job is split into a number of bands that are picked up by the workers.
+// The worker that finishes the last band calls the completion function.
+// Only one job runs at a time; Dispatch must not be called before the
+// previous job has completed (see Wait).
+class WorkerPool final
+{
+public:
+
+    typedef void (*BandFunction)(void* context, int band, int bandCount);
+    typedef void (*DoneFunction)(void* context);
+
+    // Constructor/destructor
+
+    explicit WorkerPool(int workerCount)
+        : generation_(0), quit_(false), busy_(false),
+          band_(nullptr), done_(nullptr), context_(nullptr),
+          bandBegin_(0), bandCount_(0), nextBand_(0), remaining_(0)
+    {
+        // Zero means one worker per hardware thread.
+        if (workerCount <= 0)
+            workerCount = (std::max)(1u, std::thread::hardware_concurrency());
+
+        for (auto i = 0; i < workerCount; i++)
+            threads_.emplace_back(&WorkerPool::WorkerLoop, this);
+    }
+
+    ~WorkerPool()
+    {
+        Wait();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        wake_.notify_all();
+
+        for (auto& thread : threads_) thread.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Public methods
+
+    int GetWorkerCount() const
+    {
+        return static_cast<int>(threads_.size());
+    }
+
+    // Start a job and return without waiting for it.
+    void Dispatch(int bandCount, BandFunction band, DoneFunction done, void* context)
+    {
+        assert(bandCount > 0);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            assert(!busy_);
+            busy_ = true;
+            band_ = band;
+            done_ = done;
+            context_ = context;
+            // Band indices keep counting up across jobs, so a worker still
+            // draining the previous job can never take a band of this one.
+            bandBegin_ = nextBand_.load(std::memory_order_relaxed);
+            bandCount_ = bandCount;
+            remaining_.store(bandCount, std::memory_order_relaxed);
+            generation_++;
+        }
+        wake_.notify_all();
+    }
+
+    // Block until the current job (if any) has completed.
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return !busy_; });
+    }
+
+private:
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    uint64_t generation_;
+    bool quit_;
+    bool busy_;
+
+    // Current job (written under the mutex)
+    BandFunction band_;
+    DoneFunction done_;
+    void* context_;
+    uint64_t bandBegin_;
+    int bandCount_;
+    std::atomic<uint64_t> nextBand_;
+    std::atomic<int> remaining_;
+
+    void WorkerLoop()
+    {
+        uint64_t seen = 0;
+
+        while (true)
+        {
+            BandFunction band;
+            DoneFunction done;
+            void* context;
+            uint64_t bandBegin;
+            int bandCount;
+
+            // Sleep until a new job arrives.
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return quit_ || generation_ != seen; });
+                if (quit_) return;
+                seen = generation_;
+                band = band_;
+                done = done_;
+                context = context_;
+                bandBegin = bandBegin_;
+                bandCount = bandCount_;
+            }
+
+            // Process bands until none is left.
+            auto bandEnd = bandBegin + bandCount;
+            auto index = nextBand_.load(std::memory_order_relaxed);
+            while (index < bandEnd)
+            {
+                if (!nextBand_.compare_exchange_weak(
+                    index, index + 1, std::memory_order_relaxed)) continue;
+
+                band(context, static_cast<int>(index - bandBegin), bandCount);
+
+                // The last band to finish completes the job.
+                if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    if (done != nullptr) done(context);
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    busy_ = false;
+                    idle_.notify_all();
+                }
+
+                index = nextBand_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};